@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+set -e
+
+if [ -z $2 ]; then
+    echo "Check that functions were placed in RAM and print what it costs"
+    echo "Usage: $0 ELF FUNCTION..."
+    exit 1
+fi
+
+ELF=$1
+shift
+
+NM=$(dirname $0)/../riscv-none-elf-gcc/bin/riscv-none-elf-nm
+SIZE=$(dirname $0)/../riscv-none-elf-gcc/bin/riscv-none-elf-size
+if [ ! -x $NM ]; then
+    NM=nm
+    SIZE=size
+fi
+
+RAM_START=$((16#20000000))
+FAILED=0
+TOTAL=0
+SYMBOLS=$($NM -S $ELF)
+for FUNCTION in "$@"; do
+    SYMBOL=$(echo "$SYMBOLS" | awk -v name=$FUNCTION '$NF == name && NF == 4 { print; exit }')
+    read -r ADDRESS LENGTH TYPE NAME <<< "$SYMBOL"
+    if [ -z $ADDRESS ]; then
+        # Inlined or garbage collected, either way it's not costing anything
+        printf "%6s  %-24s not found\n" - $FUNCTION
+        continue
+    fi
+
+    LENGTH=$((16#$LENGTH))
+    if [ $((16#$ADDRESS)) -ge $RAM_START ]; then
+        TOTAL=$((TOTAL + LENGTH))
+        printf "%6d  %-24s RAM\n" $LENGTH $FUNCTION
+    else
+        FAILED=1
+        printf "%6d  %-24s FLASH\n" $LENGTH $FUNCTION
+    fi
+done
+printf "%6d  listed functions in RAM\n" $TOTAL
+
+# Everything in the section is paid for twice, in RAM and its copy in flash
+$SIZE -A $ELF | awk '$1 == ".ramcode" { printf "%6d  .ramcode (RAM and flash)\n", $2 }'
+
+if [ $FAILED -ne 0 ]; then
+    echo "Error: some functions ended up in flash"
+    exit 1
+fi
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# Copyright 2023 Xerbo
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Stand-in for LwIP's makefsdata: turns a directory into an fsdata file for
+# httpd (see HTTPD_FSDATA_FILE in lwipopts.h). Every file gets its complete
+# HTTP/1.1 response header built in, with a Content-Length so the connection
+# can be kept alive, and is gzipped if that makes it any smaller.
+
+import gzip
+import os
+import sys
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".htm": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".txt": "text/plain",
+    ".svg": "image/svg+xml",
+    ".xml": "text/xml",
+    ".png": "image/png",
+    ".gif": "image/gif",
+    ".jpg": "image/jpeg",
+    ".jpeg": "image/jpeg",
+    ".ico": "image/x-icon",
+}
+
+# Already compressed, gzip would only make them bigger
+NO_COMPRESS = {".png", ".gif", ".jpg", ".jpeg"}
+
+FLAGS = "FS_FILE_FLAGS_HEADER_INCLUDED | FS_FILE_FLAGS_HEADER_PERSISTENT | FS_FILE_FLAGS_HEADER_HTTPVER_1_1"
+
+
+def response(name, data):
+    extension = os.path.splitext(name)[1].lower()
+    status = "404 File not found" if name.startswith("/404.") else "200 OK"
+
+    headers = [
+        "HTTP/1.1 " + status,
+        "Server: lwIP",
+        "Content-Type: " + CONTENT_TYPES.get(extension, "application/octet-stream"),
+    ]
+
+    if extension not in NO_COMPRESS:
+        # mtime=0 keeps the output the same from build to build
+        compressed = gzip.compress(data, 9, mtime=0)
+        if len(compressed) < len(data):
+            data = compressed
+            headers.append("Content-Encoding: gzip")
+
+    headers.append("Content-Length: %d" % len(data))
+    return ("\r\n".join(headers) + "\r\n\r\n").encode() + data
+
+
+def c_identifier(name):
+    return "".join(c if c.isalnum() else "_" for c in name)
+
+
+def c_bytes(data):
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append("    " + " ".join("0x%02x," % b for b in data[i:i + 16]))
+    return "\n".join(lines)
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("Build an httpd fsdata file out of a directory")
+        print("Usage: %s DIRECTORY OUTPUT" % sys.argv[0])
+        sys.exit(1)
+
+    root = sys.argv[1]
+    names = []
+    for directory, _, files in os.walk(root):
+        for file in files:
+            path = os.path.join(directory, file)
+            names.append("/" + os.path.relpath(path, root).replace(os.sep, "/"))
+    names.sort()
+
+    out = [
+        "// Generated by scripts/makefsdata.py from %s, do not edit" % os.path.basename(os.path.abspath(root)),
+        "",
+        "#include <lwip/apps/fs.h>",
+        "#include <lwip/def.h>",
+        "",
+    ]
+
+    previous = "NULL"
+    total = 0
+    for name in names:
+        with open(os.path.join(root, name[1:]), "rb") as f:
+            data = response(name, f.read())
+        identifier = c_identifier(name)
+        # The name goes first, NUL terminated and padded so the response stays aligned
+        encoded_name = name.encode() + b"\0"
+        encoded_name += b"\0" * (-len(encoded_name) % 4)
+        total += len(data)
+
+        out.append("static const unsigned char data_%s[] __attribute__((aligned(4))) = {" % identifier)
+        out.append("    /* %s */" % name)
+        out.append(c_bytes(encoded_name))
+        out.append(c_bytes(data))
+        out.append("};")
+        out.append("")
+        out.append("const struct fsdata_file file_%s[] = {{" % identifier)
+        out.append("    %s," % previous)
+        out.append("    data_%s," % identifier)
+        out.append("    data_%s + %d," % (identifier, len(encoded_name)))
+        out.append("    sizeof(data_%s) - %d," % (identifier, len(encoded_name)))
+        out.append("    %s," % FLAGS)
+        out.append("}};")
+        out.append("")
+        previous = "file_" + identifier
+
+    out.append("#define FS_ROOT %s" % previous)
+    out.append("#define FS_NUMFILES %d" % len(names))
+    out.append("")
+
+    with open(sys.argv[2], "w") as f:
+        f.write("\n".join(out))
+    print("fsdata: %d files, %d bytes" % (len(names), total))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+set -e
+
+if [ -z $1 ]; then
+    echo "Print the RAM taken up by the Ethernet driver's descriptors, buffers and queues, and LwIP's heap and pools"
+    echo "Usage: $0 ELF"
+    exit 1
+fi
+
+NM=$(dirname $0)/../riscv-none-elf-gcc/bin/riscv-none-elf-nm
+if [ ! -x $NM ]; then
+    NM=nm
+fi
+
+TOTAL=0
+while read -r ADDRESS SIZE TYPE NAME; do
+    case $TYPE in
+        b | B | d | D) ;;
+        *) continue
+    esac
+    case $NAME in
+        eth_* | rx_* | tx_* | ram_heap | memp_memory_*) ;;
+        *) continue
+    esac
+
+    SIZE=$((16#$SIZE))
+    TOTAL=$((TOTAL + SIZE))
+    printf "%6d  %s\n" $SIZE $NAME
+done < <($NM --size-sort -S $1)
+printf "%6d  total\n" $TOTAL
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include "debug.h"
+#include "log.h"
 
 #ifndef BYTE_ORDER
 #define BYTE_ORDER LITTLE_ENDIAN
@@ -14,10 +15,14 @@
 #define PACK_STRUCT_END
 #define PACK_STRUCT_FIELD(x) x
 
-#define LWIP_PLATFORM_ASSERT(x) printf("Assertion \"%s\" failed at line %d in %s\n", x, __LINE__, __FILE__);
-#define LWIP_PLATFORM_DIAG(x) printf x;
+#define LWIP_PLATFORM_ASSERT(x) log_printf("Assertion \"%s\" failed at line %d in %s\n", x, __LINE__, __FILE__);
+#define LWIP_PLATFORM_DIAG(x) log_printf x;
 #define LWIP_RAND() ((uint32_t)rand())
 
 typedef uint32_t sys_prot_t;
 
+// Only used for frames the MAC didn't check, see chksum.c
+#define LWIP_CHKSUM ch32_chksum
+uint16_t ch32_chksum(const void *data, int len);
+
 #endif
@@ -17,7 +17,9 @@
 #ifndef CH32V30X_CONF_H_
 #define CH32V30X_CONF_H_
 
+#include <ch32v30x_dma.h>
 #include <ch32v30x_eth.h>
+#include <ch32v30x_flash.h>
 #include <ch32v30x_gpio.h>
 #include <ch32v30x_rcc.h>
 #include <ch32v30x_usart.h>
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Internet checksum used by LwIP (LWIP_CHKSUM in arch/cc.h), only needed for
+ * frames the MAC's checksum offload engine didn't verify.
+ */
+
+#include <stdint.h>
+
+#include "arch/cc.h"
+
+// RV32 has no carry flag, so instead of folding after every add the carries
+// out of the 32-bit accumulator are counted (add + sltu + add per word). Since
+// 2^32 = 1 (mod 0xFFFF) each carry is worth 1 in the final sum.
+#define ADD_WORD(sum, carry, word) do { \
+    uint32_t w_ = (word); \
+    (sum) += w_; \
+    (carry) += (sum) < w_; \
+} while (0)
+
+uint16_t ch32_chksum(const void *data, int len) {
+    const uint8_t *p = data;
+    uint32_t sum = 0;
+    uint32_t carry = 0;
+
+    // Sums are byte order independent as long as every byte stays in the same
+    // lane, an odd start is handled by shifting everything over by a byte and
+    // swapping the result back at the end
+    int odd = (uintptr_t)p & 1;
+    if (odd && len > 0) {
+        sum = (uint32_t)*p++ << 8;
+        len--;
+    }
+    if (((uintptr_t)p & 2) && len > 1) {
+        sum += *(const uint16_t *)p;
+        p += 2;
+        len -= 2;
+    }
+
+    // Aligned from here on, 16 bytes per iteration
+    const uint32_t *words = (const uint32_t *)p;
+    while (len >= 16) {
+        ADD_WORD(sum, carry, words[0]);
+        ADD_WORD(sum, carry, words[1]);
+        ADD_WORD(sum, carry, words[2]);
+        ADD_WORD(sum, carry, words[3]);
+        words += 4;
+        len -= 16;
+    }
+    while (len >= 4) {
+        ADD_WORD(sum, carry, *words++);
+        len -= 4;
+    }
+
+    p = (const uint8_t *)words;
+    if (len >= 2) {
+        ADD_WORD(sum, carry, *(const uint16_t *)p);
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0) {
+        ADD_WORD(sum, carry, *p);
+    }
+
+    // Fold down to 16 bits
+    sum = (sum & 0xFFFF) + (sum >> 16) + (carry & 0xFFFF) + (carry >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    if (odd) {
+        sum = ((sum & 0xFF) << 8) | (sum >> 8);
+    }
+    return sum;
+}
@@ -18,42 +18,362 @@
  */
 
 #include "eth.h"
+#include "eth_capture.h"
+#include "eth_classify.h"
+#include "log.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "sys_arch.h"
 
 #include <string.h>
 #include <lwip/etharp.h>
+#include <lwip/timeouts.h>
+#include <lwip/prot/ethernet.h>
 
 // From ch32vXXX_eth.c
 extern ETH_DMADESCTypeDef *DMATxDescToSet;
 extern ETH_DMADESCTypeDef *DMARxDescToGet;
 
-extern void usleep(uint32_t time);
-static uint32_t link_init(ETH_InitTypeDef *eth, uint16_t phy_address);
+__attribute__((aligned(4))) static ETH_DMADESCTypeDef eth_dma_rx[ETH_RX_RING_SIZE];
+__attribute__((aligned(4))) static ETH_DMADESCTypeDef eth_dma_tx[ETH_TX_RING_SIZE];
+// Both RX buffer pools, carved up in eth_start()
+__attribute__((aligned(4))) static uint8_t eth_buffer_rx[ETH_RX_SMALL_COUNT * ETH_RX_SMALL_SIZE + ETH_RX_LARGE_COUNT * ETH_RX_LARGE_SIZE];
+#if ETH_TX_ZERO_COPY
+// The pbuf chain to free once the descriptor has been sent, only set on the last segment
+static struct pbuf *tx_pbufs[ETH_TX_RING_SIZE];
+#if ETH_TX_RAW_COUNT
+// Handed out and reclaimed in ring order, like the descriptors they go with
+__attribute__((aligned(4))) static uint8_t eth_buffer_raw[ETH_TX_RAW_COUNT][ETH_TX_RAW_SIZE];
+static uint8_t tx_raw[ETH_TX_RING_SIZE];
+static uint32_t tx_raw_head;
+static uint32_t tx_raw_tail;
+#endif
+#else
+__attribute__((aligned(4))) static uint8_t eth_buffer_tx[ETH_TX_RING_SIZE][ETH_MAX_PACKET_SIZE];
+#endif
+// Oldest descriptor that hasn't been reclaimed yet
+static ETH_DMADESCTypeDef *tx_reclaim;
+static uint32_t tx_free = ETH_TX_RING_SIZE;
+// RX descriptors that have been given to the application but not released yet
+static volatile uint8_t rx_borrowed[ETH_RX_RING_SIZE];
+
+#if ETH_RX_ZERO_COPY
+struct eth_rx_pbuf {
+    struct pbuf_custom pc;
+    ETH_DMADESCTypeDef *desc;
+};
+static struct eth_rx_pbuf rx_pbufs[ETH_RX_RING_SIZE];
+#endif
+
+#if (ETH_RX_SMALL_SIZE % 4) != 0 || (ETH_RX_LARGE_SIZE % 4) != 0
+#error "RX buffer sizes must be a multiple of 4"
+#endif
+#if ETH_RX_SMALL_SIZE > ETH_MAX_PACKET_SIZE || ETH_RX_LARGE_SIZE > ETH_MAX_PACKET_SIZE
+#error "RX buffers can't be larger than ETH_MAX_PACKET_SIZE"
+#endif
+#if ETH_RX_SMALL_COUNT * ETH_RX_SMALL_SIZE + ETH_RX_LARGE_COUNT * ETH_RX_LARGE_SIZE < ETH_MAX_PACKET_SIZE
+#error "The RX ring is too small to hold a full size frame"
+#endif
+// Otherwise LwIP could hold every descriptor until its timers give up on the
+// segments and fragments it's queued (see net_profile.h)
+#if ETH_RX_ZERO_COPY && (TCP_OOSEQ_MAX_PBUFS == 0 || TCP_OOSEQ_MAX_PBUFS + IP_REASS_MAX_PBUFS >= ETH_RX_RING_SIZE)
+#error "TCP_OOSEQ_MAX_PBUFS + IP_REASS_MAX_PBUFS must be below ETH_RX_RING_SIZE"
+#endif
+#if !ETH_RX_POLL && (ETH_RX_QUEUE_SIZE & (ETH_RX_QUEUE_SIZE - 1)) != 0
+#error "ETH_RX_QUEUE_SIZE must be a power of 2"
+#endif
+#if (ETH_TX_QUEUE_SIZE & (ETH_TX_QUEUE_SIZE - 1)) != 0
+#error "ETH_TX_QUEUE_SIZE must be a power of 2"
+#endif
+#if (ETH_TX_RAW_COUNT & (ETH_TX_RAW_COUNT - 1)) != 0
+#error "ETH_TX_RAW_COUNT must be a power of 2"
+#endif
+#if (ETH_RX_POOL_SIZE & (ETH_RX_POOL_SIZE - 1)) != 0
+#error "ETH_RX_POOL_SIZE must be a power of 2"
+#endif
+#if ETH_RX_POOL_SIZE && ETH_RX_POOL_SIZE * PBUF_POOL_BUFSIZE < ETH_MAX_PACKET_SIZE
+#error "ETH_RX_POOL_SIZE is too small to hold a full size frame"
+#endif
+
+#if ETH_RX_POLL
+// Set by the ISR when it hands the RX ring over to the main loop
+static volatile uint8_t rx_scheduled;
+#else
+// Single producer (ISR), single consumer (main loop) queue of received frames
+static struct pbuf *rx_queue[ETH_RX_QUEUE_SIZE];
+static uint8_t rx_queue_checked[ETH_RX_QUEUE_SIZE];
+static volatile uint32_t rx_queue_head;
+static volatile uint32_t rx_queue_tail;
+#endif
+
+#if ETH_RX_POOL_SIZE
+// Single producer (main loop), single consumer (ISR) ring of single PBUF_POOL pbufs
+static struct pbuf *rx_pool[ETH_RX_POOL_SIZE];
+static volatile uint32_t rx_pool_head;
+static volatile uint32_t rx_pool_tail;
+#endif
+
+// Frames waiting for TX descriptors, only used from the main loop
+static struct pbuf *tx_queue[ETH_TX_QUEUE_SIZE];
+static uint32_t tx_queue_head;
+static uint32_t tx_queue_tail;
+
+#if LWIP_IGMP
+// Number of groups using each bit of the MAC's multicast hash table
+static uint8_t hash_refs[64];
+#endif
+
+#if ETH_PTP
+// The MAC writes timestamps over the buffer and next descriptor addresses of a
+// frame's last descriptor, these are what they were (see rx_restore())
+static uintptr_t rx_buffers[ETH_RX_RING_SIZE];
+struct ptp_stamp {
+    struct eth_timestamp time;
+    uint8_t valid;
+};
+// The frame last returned by eth_get_packet()
+static struct ptp_stamp rx_stamp;
+#if !ETH_RX_POLL
+static struct ptp_stamp rx_queue_stamp[ETH_RX_QUEUE_SIZE];
+// The frame last returned by eth_rx_dequeue()
+static struct ptp_stamp rx_dequeued_stamp;
+#endif
+// Headers of the frame each last TX descriptor belongs to, for the hook
+static const uint8_t *tx_headers[ETH_TX_RING_SIZE];
+static uint16_t tx_headers_len[ETH_TX_RING_SIZE];
+static eth_ptp_fn ptp_rx_hook;
+static eth_ptp_fn ptp_tx_hook;
+#define TX_TIMESTAMP ETH_DMATxDesc_TTSE
+#else
+#define TX_TIMESTAMP 0
+#endif
+
+#if ETH_VLAN_COUNT
+struct eth_vlan_stats eth_vlan_stats[ETH_VLAN_COUNT];
+// The netif for each slot of eth_vlan_stats
+static struct netif *vlan_netifs[ETH_VLAN_COUNT];
+// Slot of the only VLAN if there's just one, -1 otherwise. The MAC compares its ID (see rx_vlan_id())
+static int vlan_hw_slot = -1;
+// Slot + 1 of the VLAN the frame last returned by eth_get_pbuf() is for, 0 if untagged
+static uint8_t rx_vlan;
+#if !ETH_RX_POLL
+static uint8_t rx_queue_vlan[ETH_RX_QUEUE_SIZE];
+// The frame last returned by eth_rx_dequeue()
+static uint8_t rx_dequeued_vlan;
+#endif
+#endif
+
+struct eth_stats eth_stats;
+
+// Bring-up, stepped from LwIP's timers by eth_init_step()
+enum eth_init_state {
+    ETH_INIT_IDLE,
+    ETH_INIT_MAC_RESET,
+    ETH_INIT_PHY_RESET,
+#if ETH_PTP
+    ETH_INIT_PTP_ADDEND,
+    ETH_INIT_PTP_TIME,
+#endif
+    ETH_INIT_DONE,
+};
+static const char *const eth_init_names[] = {
+    [ETH_INIT_MAC_RESET] = "MAC reset",
+    [ETH_INIT_PHY_RESET] = "PHY reset",
+#if ETH_PTP
+    [ETH_INIT_PTP_ADDEND] = "PTP addend update",
+    [ETH_INIT_PTP_TIME] = "PTP time init",
+#endif
+};
+static struct {
+    enum eth_init_state state;
+    uint16_t phy_address;
+    // sys_now() when the current reset was started
+    uint32_t started;
+    eth_init_fn done;
+} eth_bringup;
+
+// Electronic signature unique ID, the MAC address is derived from it
+#ifndef ESIG_UID
+#define ESIG_UID ((const uint8_t *)0x1FFFF7E8)
+#endif
+
+static void eth_configure(void);
+static void eth_start(void);
 static void eth_apply_settings(const ETH_InitTypeDef *eth);
 
+// Microseconds since SysTick was started at the top of main()
+static uint32_t eth_uptime_us(void) {
+    return (uint32_t)(SysTick->CNT / SYS_TICKS_PER_US);
+}
+
+#if ETH_PTP
+void eth_ptp_set_hooks(eth_ptp_fn rx, eth_ptp_fn tx) {
+    ptp_rx_hook = rx;
+    ptp_tx_hook = tx;
+}
+
+void eth_ptp_timestamp(uint32_t high, uint32_t low, struct eth_timestamp *time) {
+    time->seconds = high;
+    // Binary rollover, 2^31 is a second
+    time->nanoseconds = (uint32_t)(((uint64_t)(low & 0x7FFFFFFF) * 1000000000) >> 31);
+}
+
+void eth_ptp_now(struct eth_timestamp *time) {
+    uint32_t high;
+    uint32_t low;
+    // Read the seconds again in case the sub-seconds rolled over in between
+    do {
+        high = ETH->PTPTSHR;
+        low = ETH->PTPTSLR;
+    } while (high != ETH->PTPTSHR);
+    eth_ptp_timestamp(high, low, time);
+}
+
+// Put back the addresses a timestamp might have been written over
+static inline void rx_restore(ETH_DMADESCTypeDef *desc) {
+    uint32_t i = desc - eth_dma_rx;
+    desc->Buffer1Addr = rx_buffers[i];
+    desc->Buffer2NextDescAddr = (uintptr_t)&eth_dma_rx[(i + 1) % ETH_RX_RING_SIZE];
+}
+
+static inline void tx_restore(ETH_DMADESCTypeDef *desc) {
+    uint32_t i = desc - eth_dma_tx;
+#if !ETH_TX_ZERO_COPY
+    desc->Buffer1Addr = (uintptr_t)eth_buffer_tx[i];
+#endif
+    desc->Buffer2NextDescAddr = (uintptr_t)&eth_dma_tx[(i + 1) % ETH_TX_RING_SIZE];
+}
+
+// Take the timestamp from a frame's last descriptor. There's no flag saying
+// one was written, but if it was the addresses won't be what they were.
+static void rx_take_stamp(ETH_DMADESCTypeDef *last) {
+    uint32_t i = last - eth_dma_rx;
+    uintptr_t next = (uintptr_t)&eth_dma_rx[(i + 1) % ETH_RX_RING_SIZE];
+    rx_stamp.valid = last->Buffer1Addr != rx_buffers[i] || last->Buffer2NextDescAddr != next;
+    if (rx_stamp.valid) {
+        eth_ptp_timestamp(last->Buffer2NextDescAddr, last->Buffer1Addr, &rx_stamp.time);
+        rx_restore(last);
+    }
+}
+
+// Remember where a frame's headers are, so the hook can be given them once it's sent
+static inline void tx_keep_headers(ETH_DMADESCTypeDef *last, const void *headers, uint16_t len) {
+    uint32_t i = last - eth_dma_tx;
+    tx_headers[i] = headers;
+    tx_headers_len[i] = len;
+}
+#endif
+
 static err_t ch32netif_output(struct netif *netif, struct pbuf *p) {
+    PROFILE_SCOPE(PROFILE_NETIF_OUTPUT);
     (void)netif;
-    LINK_STATS_INC(link.xmit);
-
-    if (eth_send_packet(p->payload, p->tot_len) == ETH_ERROR) {
+    if (eth_bringup.state != ETH_INIT_DONE) {
         return ERR_IF;
     }
+
+    // Frames have to go out in order, so only bypass the queue if it's empty
+    if (tx_queue_head == tx_queue_tail) {
+        uint32_t ret = eth_send_pbuf(p);
+        if (ret == ETH_SUCCESS) {
+            LINK_STATS_INC(link.xmit);
+            return ERR_OK;
+        }
+        // Waiting won't help, e.g. there wasn't enough memory to copy it
+        if (ret != ETH_RING_FULL) {
+            LINK_STATS_INC(link.drop);
+            return ERR_MEM;
+        }
+    }
+
+    uint32_t used = tx_queue_head - tx_queue_tail;
+    if (used == ETH_TX_QUEUE_SIZE) {
+        // Tell LwIP we're busy, TCP will keep the segment and try again later
+        eth_stats.tx_queue_drop++;
+        LINK_STATS_INC(link.drop);
+        return ERR_MEM;
+    }
+
+    // Hold onto the frame until eth_tx_poll() finds space for it
+    pbuf_ref(p);
+    tx_queue[tx_queue_head & (ETH_TX_QUEUE_SIZE - 1)] = p;
+    tx_queue_head++;
+
+    eth_stats.tx_queued++;
+    if (used + 1 > eth_stats.tx_queue_max) {
+        eth_stats.tx_queue_max = used + 1;
+    }
+    // Nothing's in flight to interrupt once it's done, so don't wait for that
+    if (tx_free == ETH_TX_RING_SIZE) {
+        sched_post(SCHED_TX);
+    }
     return ERR_OK;
 }
 
+#if LWIP_IGMP
+// Bit reversed CRC32 of the destination address as computed by the MAC, the
+// top 6 bits index the hash table
+static uint32_t eth_hash_crc(const uint8_t *mac) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (int i = 0; i < 6; i++) {
+        uint8_t byte = mac[i];
+        for (int bit = 0; bit < 8; bit++, byte >>= 1) {
+            crc = (crc << 1) ^ (((crc >> 31) ^ (byte & 1)) ? 0x04C11DB7 : 0);
+        }
+    }
+    return ~crc;
+}
+
+static err_t ch32netif_igmp_mac_filter(struct netif *netif, const ip4_addr_t *group, enum netif_mac_filter_action action) {
+    (void)netif;
+
+    // 01:00:5E followed by the lower 23 bits of the group address
+    const uint8_t mac[6] = { 0x01, 0x00, 0x5E, ip4_addr2(group) & 0x7F, ip4_addr3(group), ip4_addr4(group) };
+    uint32_t bit = eth_hash_crc(mac) >> 26;
+
+    if (action == NETIF_ADD_MAC_FILTER) {
+        if (hash_refs[bit]++ != 0) {
+            return ERR_OK;
+        }
+    } else {
+        if (hash_refs[bit] == 0 || --hash_refs[bit] != 0) {
+            return ERR_OK;
+        }
+    }
+
+    if (bit & 32) {
+        ETH->MACHTHR ^= 1u << (bit & 31);
+    } else {
+        ETH->MACHTLR ^= 1u << (bit & 31);
+    }
+    return ERR_OK;
+}
+#endif
+
 err_t ch32netif_init(struct netif *netif) {
     netif->linkoutput = ch32netif_output;
     netif->output     = etharp_output;
     netif->mtu        = MAX_ETH_PAYLOAD;
-    netif->flags      = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+    // The link comes up once the PHY says so, see eth_init()
+    netif->flags      = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP;
     netif->hostname = "lwip";
     netif->name[0] = 'c';
     netif->name[1] = 'h';
+#if LWIP_IGMP
+    // Only groups LwIP has joined get past the MAC's hash filter
+    netif->flags |= NETIF_FLAG_IGMP;
+    netif_set_igmp_mac_filter(netif, ch32netif_igmp_mac_filter);
+#endif
+
+#if ETH_RX_POOL_SIZE
+    // LwIP is up by now, so the ISR's pool can be filled
+    eth_rx_pool_refill();
+#endif
 
+    // The MAC gets it in eth_configure(), it may still be in reset
     eth_get_mac(netif->hwaddr);
-    ETH_MACAddressConfig(ETH_MAC_Address0, netif->hwaddr);
     netif->hwaddr_len = 6;
 
-    printf("MAC: %02X:%02X:%02X:%02X:%02X:%02X\n",
+    log_printf("MAC: %02X:%02X:%02X:%02X:%02X:%02X\n",
         netif->hwaddr[0],
         netif->hwaddr[1],
         netif->hwaddr[2],
@@ -65,8 +385,518 @@ err_t ch32netif_init(struct netif *netif) {
     return ERR_OK;
 }
 
+#if ETH_VLAN_COUNT
+// The VLAN ID for the MAC to compare, which flags frames that match. It can
+// only do one, so with more VLANs it's 0 and every tagged frame is flagged.
+static uint16_t rx_vlan_id(void) {
+    uint32_t count = 0;
+    for (int i = 0; i < ETH_VLAN_COUNT; i++) {
+        if (eth_vlan_stats[i].id != 0) {
+            vlan_hw_slot = i;
+            count++;
+        }
+    }
+    if (count != 1) {
+        vlan_hw_slot = -1;
+        return 0;
+    }
+    return eth_vlan_stats[vlan_hw_slot].id;
+}
+
+static err_t ch32netif_vlan_output(struct netif *netif, struct pbuf *p) {
+    struct eth_vlan_stats *stats = netif->state;
+    err_t err = ch32netif_output(netif, p);
+    if (err == ERR_OK) {
+        stats->tx_frames++;
+        stats->tx_bytes += p->tot_len;
+    }
+    return err;
+}
+
+err_t ch32netif_vlan_init(struct netif *netif) {
+    uintptr_t id = (uintptr_t)netif->state;
+    if (id == 0 || id >= 0xFFF) {
+        return ERR_ARG;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < ETH_VLAN_COUNT; i++) {
+        if (eth_vlan_stats[i].id == id) {
+            return ERR_ARG;
+        }
+        if (eth_vlan_stats[i].id == 0 && slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return ERR_MEM;
+    }
+
+    err_t err = ch32netif_init(netif);
+    if (err != ERR_OK) {
+        return err;
+    }
+    netif->linkoutput = ch32netif_vlan_output;
+    netif->name[0] = 'v';
+    netif->name[1] = 'l';
+    netif->state = &eth_vlan_stats[slot];
+    vlan_netifs[slot] = netif;
+    eth_vlan_stats[slot].id = id;
+
+    // Otherwise eth_configure() takes care of it
+    if (eth_bringup.state == ETH_INIT_DONE) {
+        ETH->MACVLANTR = ETH_VLANTagComparison_12Bit | rx_vlan_id();
+    } else {
+        rx_vlan_id();
+    }
+    return ERR_OK;
+}
+
+int eth_vlan_tag(const struct netif *netif) {
+    if (netif->linkoutput != ch32netif_vlan_output) {
+        return -1;
+    }
+    return ((const struct eth_vlan_stats *)netif->state)->id;
+}
+
+// Work out which netif a frame is for and take its VLAN tag off, by moving the
+// addresses up over it so the rest of the frame stays where the MAC put it.
+// Returns how far into the first buffer the frame now starts, or -1 if it was
+// dropped for being on a VLAN without a netif.
+static int rx_vlan_demux(ETH_DMADESCTypeDef *desc, uint32_t segments) {
+    uint8_t *frame = (uint8_t *)desc->Buffer1Addr;
+    rx_vlan = 0;
+    if (frame[12] != (ETHTYPE_VLAN >> 8) || frame[13] != (ETHTYPE_VLAN & 0xFF)) {
+        return 0;
+    }
+
+    // Priority tagged frames (ID 0) belong to the untagged netif
+    uint16_t id = ((frame[14] << 8) | frame[15]) & 0xFFF;
+    int slot = -1;
+    if (id == 0) {
+        slot = ETH_VLAN_COUNT;
+    } else if (vlan_hw_slot >= 0) {
+        // The frame status is only valid on the last descriptor
+        ETH_DMADESCTypeDef *last = desc;
+        for (uint32_t i = 1; i < segments; i++) {
+            last = (ETH_DMADESCTypeDef *)last->Buffer2NextDescAddr;
+        }
+        if (last->Status & ETH_DMARxDesc_VLAN) {
+            slot = vlan_hw_slot;
+        }
+    } else {
+        for (int i = 0; i < ETH_VLAN_COUNT; i++) {
+            if (eth_vlan_stats[i].id == id) {
+                slot = i;
+                break;
+            }
+        }
+    }
+
+    if (slot < 0) {
+        for (uint32_t i = 0; i < segments; i++) {
+            ETH_DMADESCTypeDef *next = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+            eth_release_packet(desc);
+            desc = next;
+        }
+        eth_stats.rx_vlan_dropped++;
+        LINK_STATS_INC(link.drop);
+        return -1;
+    }
+
+    if (slot < ETH_VLAN_COUNT) {
+        rx_vlan = slot + 1;
+    }
+    memmove(&frame[SIZEOF_VLAN_HDR], frame, 2 * ETH_HWADDR_LEN);
+    return SIZEOF_VLAN_HDR;
+}
+#endif
+
+#if ETH_RX_ZERO_COPY
+static void eth_rx_pbuf_free(struct pbuf *p) {
+    eth_release_packet(((struct eth_rx_pbuf *)p)->desc);
+}
+#endif
+
+// Whether the MAC verified every checksum in a frame, only valid on the last descriptor.
+// Frames with bad checksums are dropped by the MAC, leaving IPv4/IPv6 frames that
+// passed, IP fragments and unsupported payloads (bypassed) and non-IP frames.
+static inline uint8_t rx_checksum_checked(uint32_t status) {
+    return (status & (ETH_DMARxDesc_FT | ETH_DMARxDesc_IPV4HCE | ETH_DMARxDesc_MAMPCE)) == ETH_DMARxDesc_FT;
+}
+
+#if ETH_CLASSIFY
+// How close RX is to running out of room, as a percentage of whichever of the
+// ring, the queue to the main loop or the ISR's pbuf pool is fullest. The
+// frame being looked at (its segments) doesn't count against itself, or a full
+// sized one would always look like overload with small rings.
+static uint32_t rx_pressure(uint32_t segments) {
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < ETH_RX_RING_SIZE; i++) {
+        if (rx_borrowed[i] || (eth_dma_rx[i].Status & ETH_DMARxDesc_OWN) == 0) {
+            used++;
+        }
+    }
+    uint32_t pressure = (used - segments) * 100 / ETH_RX_RING_SIZE;
+
+#if !ETH_RX_POLL
+    uint32_t queued = (rx_queue_head - rx_queue_tail) * 100 / ETH_RX_QUEUE_SIZE;
+    if (queued > pressure) {
+        pressure = queued;
+    }
+#endif
+#if ETH_RX_POOL_SIZE
+    uint32_t taken = (ETH_RX_POOL_SIZE - (rx_pool_head - rx_pool_tail)) * 100 / ETH_RX_POOL_SIZE;
+    if (taken > pressure) {
+        pressure = taken;
+    }
+#endif
+    return pressure;
+}
+
+// Classify a frame while it's still in the DMA buffers (starting start bytes
+// into the first), and hand them straight back to the MAC if it isn't worth keeping
+static int rx_admit(ETH_DMADESCTypeDef *desc, uint32_t segments, uint16_t start, uint16_t length) {
+    uint16_t capacity = (desc->ControlBufferSize & ETH_DMARxDesc_RBS1) - start;
+    enum eth_class class = eth_classify((const uint8_t *)desc->Buffer1Addr + start, length < capacity ? length : capacity);
+    if (eth_classify_admit(class, rx_pressure(segments))) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < segments; i++) {
+        ETH_DMADESCTypeDef *next = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+        eth_release_packet(desc);
+        desc = next;
+    }
+    LINK_STATS_INC(link.drop);
+    return 0;
+}
+#endif
+
+struct pbuf *eth_get_pbuf(uint8_t *checked) {
+    ETH_DMADESCTypeDef *desc;
+    uint32_t segments;
+    uint16_t length;
+    uint32_t ret;
+    // How far into the first buffer the frame starts
+    uint16_t start = 0;
+    while (1) {
+        {
+            PROFILE_SCOPE(PROFILE_GET_PACKET);
+            ret = eth_get_packet(&desc, &segments, &length);
+        }
+        if (ret == ETH_ERROR) {
+            return NULL;
+        }
+#if ETH_VLAN_COUNT
+        int skip = rx_vlan_demux(desc, segments);
+        if (skip < 0) {
+            continue;
+        }
+        start = skip;
+        length -= skip;
+#endif
+#if ETH_CLASSIFY
+        if (!rx_admit(desc, segments, start, length)) {
+            continue;
+        }
+#endif
+        break;
+    }
+    PROFILE_SCOPE(PROFILE_RX_PBUF);
+
+#if ETH_RX_ZERO_COPY
+    // Wrap each DMA buffer, the descriptors go back to the MAC as LwIP frees the pbufs
+    struct pbuf *head = NULL;
+    uint16_t remaining = length;
+    for (uint32_t i = 0; i < segments; i++) {
+        ETH_DMADESCTypeDef *next = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+        if (i == segments - 1) {
+            *checked = rx_checksum_checked(desc->Status);
+        }
+        // The last descriptor might only hold the CRC
+        if (remaining == 0) {
+            eth_release_packet(desc);
+            desc = next;
+            continue;
+        }
+
+        uint16_t capacity = (desc->ControlBufferSize & ETH_DMARxDesc_RBS1) - start;
+        uint16_t size = remaining < capacity ? remaining : capacity;
+        struct eth_rx_pbuf *rx = &rx_pbufs[desc - eth_dma_rx];
+        rx->desc = desc;
+        rx->pc.custom_free_function = eth_rx_pbuf_free;
+        struct pbuf *p = pbuf_alloced_custom(PBUF_RAW, size, PBUF_REF, &rx->pc, (void *)(desc->Buffer1Addr + start), capacity);
+        start = 0;
+        if (head == NULL) {
+            head = p;
+        } else {
+            pbuf_cat(head, p);
+        }
+
+        remaining -= size;
+        desc = next;
+    }
+    return head;
+#else
+#if ETH_RX_POOL_SIZE
+    struct pbuf *p = eth_rx_pool_take(length);
+    if (p == NULL) {
+        eth_stats.rx_pool_empty++;
+        LINK_STATS_INC(link.drop);
+    }
+#else
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, length, PBUF_POOL);
+    if (p == NULL) {
+        LINK_STATS_INC(link.memerr);
+        LINK_STATS_INC(link.drop);
+    }
+#endif
+
+    uint16_t offset = 0;
+    for (uint32_t i = 0; i < segments; i++) {
+        ETH_DMADESCTypeDef *next = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+        if (i == segments - 1) {
+            *checked = rx_checksum_checked(desc->Status);
+        }
+        uint16_t capacity = (desc->ControlBufferSize & ETH_DMARxDesc_RBS1) - start;
+        uint16_t size = length - offset < capacity ? length - offset : capacity;
+        if (p != NULL && size != 0) {
+            pbuf_take_at(p, (const void *)(desc->Buffer1Addr + start), size, offset);
+        }
+
+        start = 0;
+        offset += size;
+        eth_release_packet(desc);
+        desc = next;
+    }
+    return p;
+#endif
+}
+
+#if ETH_RX_POOL_SIZE
+struct pbuf *eth_rx_pool_take(uint16_t length) {
+    uint32_t needed = (length + PBUF_POOL_BUFSIZE - 1) / PBUF_POOL_BUFSIZE;
+    uint32_t tail = rx_pool_tail;
+    if (rx_pool_head - tail < needed) {
+        return NULL;
+    }
+
+    // Trimming a single PBUF_POOL pbuf and chaining them never touches the allocator
+    struct pbuf *head = NULL;
+    uint16_t remaining = length;
+    for (uint32_t i = 0; i < needed; i++) {
+        struct pbuf *p = rx_pool[tail & (ETH_RX_POOL_SIZE - 1)];
+        tail++;
+
+        uint16_t size = remaining < PBUF_POOL_BUFSIZE ? remaining : PBUF_POOL_BUFSIZE;
+        pbuf_realloc(p, size);
+        if (head == NULL) {
+            head = p;
+        } else {
+            pbuf_cat(head, p);
+        }
+        remaining -= size;
+    }
+
+    // Make sure the slots have been read before they're handed back
+    __asm__ volatile("" ::: "memory");
+    rx_pool_tail = tail;
+    return head;
+}
+
+void eth_rx_pool_refill(void) {
+    uint32_t head = rx_pool_head;
+    while (head - rx_pool_tail < ETH_RX_POOL_SIZE) {
+        struct pbuf *p = pbuf_alloc(PBUF_RAW, PBUF_POOL_BUFSIZE, PBUF_POOL);
+        if (p == NULL) {
+            break;
+        }
+
+        rx_pool[head & (ETH_RX_POOL_SIZE - 1)] = p;
+        head++;
+        // Make sure the slot is written before it's published
+        __asm__ volatile("" ::: "memory");
+        rx_pool_head = head;
+    }
+}
+#endif
+
+#if !ETH_RX_POLL
+static void eth_rx_drain(void) {
+    struct pbuf *p;
+    uint8_t checked;
+    while ((p = eth_get_pbuf(&checked)) != NULL) {
+        uint32_t head = rx_queue_head;
+        uint32_t used = head - rx_queue_tail;
+        if (used == ETH_RX_QUEUE_SIZE) {
+            // Drop the frame rather than leaving it in the ring, so the MAC keeps receiving
+            pbuf_free(p);
+            eth_stats.rx_queue_drop++;
+            LINK_STATS_INC(link.drop);
+            continue;
+        }
+
+        rx_queue[head & (ETH_RX_QUEUE_SIZE - 1)] = p;
+        rx_queue_checked[head & (ETH_RX_QUEUE_SIZE - 1)] = checked;
+#if ETH_PTP
+        rx_queue_stamp[head & (ETH_RX_QUEUE_SIZE - 1)] = rx_stamp;
+#endif
+#if ETH_VLAN_COUNT
+        rx_queue_vlan[head & (ETH_RX_QUEUE_SIZE - 1)] = rx_vlan;
+#endif
+        // Make sure the slot is written before it's published
+        __asm__ volatile("" ::: "memory");
+        rx_queue_head = head + 1;
+
+        if (used + 1 > eth_stats.rx_queue_max) {
+            eth_stats.rx_queue_max = used + 1;
+        }
+    }
+}
+
+static struct pbuf *eth_rx_dequeue(uint8_t *checked) {
+    uint32_t tail = rx_queue_tail;
+    if (tail == rx_queue_head) {
+        return NULL;
+    }
+
+    struct pbuf *p = rx_queue[tail & (ETH_RX_QUEUE_SIZE - 1)];
+    *checked = rx_queue_checked[tail & (ETH_RX_QUEUE_SIZE - 1)];
+#if ETH_PTP
+    rx_dequeued_stamp = rx_queue_stamp[tail & (ETH_RX_QUEUE_SIZE - 1)];
+#endif
+#if ETH_VLAN_COUNT
+    rx_dequeued_vlan = rx_queue_vlan[tail & (ETH_RX_QUEUE_SIZE - 1)];
+#endif
+    __asm__ volatile("" ::: "memory");
+    rx_queue_tail = tail + 1;
+    return p;
+}
+#endif
+
+void eth_rx_irq(void) {
+    eth_stats.rx_interrupts++;
+#if ETH_RX_POLL
+    // Leave the ring to the main loop until it's been emptied
+    ETH_DMAITConfig(ETH_DMA_IT_R, DISABLE);
+    rx_scheduled = 1;
+#else
+    ETH_DMAClearITPendingBit(ETH_DMA_IT_R);
+    eth_rx_drain();
+#endif
+}
+
+uint32_t eth_rx_poll(struct netif *netif, uint32_t budget) {
+#if ETH_RX_POOL_SIZE
+    eth_rx_pool_refill();
+#endif
+#if ETH_RX_POLL
+    if (!rx_scheduled) {
+        return 0;
+    }
+    // Anything that arrives from here on sets this again
+    ETH_DMAClearITPendingBit(ETH_DMA_IT_R);
+#endif
+
+    uint32_t frames = 0;
+    while (frames < budget) {
+        uint8_t checked;
+#if ETH_RX_POLL
+        struct pbuf *p = eth_get_pbuf(&checked);
+#else
+        struct pbuf *p = eth_rx_dequeue(&checked);
+#endif
+        if (p == NULL) {
+            break;
+        }
+
+        frames++;
+        LINK_STATS_INC(link.recv);
+        if (eth_stats.boot_first_rx_us == 0) {
+            eth_stats.boot_first_rx_us = eth_uptime_us();
+        }
+#if ETH_VLAN_COUNT
+#if ETH_RX_POLL
+        uint8_t vlan = rx_vlan;
+#else
+        uint8_t vlan = rx_dequeued_vlan;
+#endif
+        struct netif *input = netif;
+        if (vlan != 0) {
+            input = vlan_netifs[vlan - 1];
+            eth_vlan_stats[vlan - 1].rx_frames++;
+            eth_vlan_stats[vlan - 1].rx_bytes += p->tot_len;
+        }
+#else
+        struct netif *input = netif;
+#endif
+        // Input is synchronous, so the netif's flags only apply to this frame
+        if (checked) {
+            NETIF_SET_CHECKSUM_CTRL(input, NETIF_CHECKSUM_DISABLE_ALL);
+        } else {
+            NETIF_SET_CHECKSUM_CTRL(input, NETIF_CHECKSUM_CHECK_IP | NETIF_CHECKSUM_CHECK_UDP | NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_ICMP);
+            eth_stats.rx_sw_checksum++;
+        }
+#if ETH_PTP
+#if ETH_RX_POLL
+        const struct ptp_stamp *stamp = &rx_stamp;
+#else
+        const struct ptp_stamp *stamp = &rx_dequeued_stamp;
+#endif
+        if (stamp->valid && ptp_rx_hook != NULL) {
+            ptp_rx_hook(&stamp->time, p->payload, p->len);
+        }
+#endif
+        PROFILE_SCOPE(PROFILE_NETIF_INPUT);
+        if (input->input(p, input) != ERR_OK) {
+            pbuf_free(p);
+        }
+    }
+
+#if ETH_RX_POLL
+    eth_stats.rx_polled += frames;
+    // The ring is empty, go back to interrupts. If a frame landed after the
+    // last check the pending status fires the interrupt straight away.
+    if (frames < budget) {
+        rx_scheduled = 0;
+        ETH_DMAITConfig(ETH_DMA_IT_R, ENABLE);
+    }
+#endif
+    return frames;
+}
+
+int eth_rx_pending(void) {
+#if ETH_RX_POLL
+    return rx_scheduled;
+#else
+    return rx_queue_head != rx_queue_tail;
+#endif
+}
+
+void eth_update_stats(void) {
+    uint32_t counters = ETH->DMAMFBOCR;
+    eth_stats.rx_missed_frames += counters & 0xFFFF;
+    eth_stats.rx_fifo_overflows += (counters >> 17) & 0x7FF;
+}
+
+void eth_get_ring_usage(struct eth_ring_usage *usage) {
+    usage->rx_ready = 0;
+    usage->rx_held = 0;
+    for (uint32_t i = 0; i < ETH_RX_RING_SIZE; i++) {
+        if (rx_borrowed[i]) {
+            usage->rx_held++;
+        } else if ((eth_dma_rx[i].Status & ETH_DMARxDesc_OWN) == 0) {
+            usage->rx_ready++;
+        }
+    }
+
+    usage->tx_busy = ETH_TX_RING_SIZE - tx_free;
+    usage->tx_queued = tx_queue_head - tx_queue_tail;
+}
+
 void eth_get_mac(uint8_t *mac) {
-    const uint8_t *esig_uid = (uint8_t *)0x1FFFF7E8;
+    const uint8_t *esig_uid = ESIG_UID;
     mac[0] = esig_uid[5];
     mac[1] = esig_uid[4];
     mac[2] = esig_uid[3];
@@ -84,26 +914,111 @@ void eth_configure_clock(void) {
     while (RCC_GetFlagStatus(RCC_FLAG_PLL3RDY) == 0);
 }
 
-uint32_t eth_init(uint16_t phy_address) {
+static void eth_init_step(void *arg);
+
+void eth_init(uint16_t phy_address, eth_init_fn done) {
+    eth_bringup.state = ETH_INIT_MAC_RESET;
+    eth_bringup.phy_address = phy_address;
+    eth_bringup.done = done;
+    eth_bringup.started = sys_now();
+
     // Enable the ethernet MAC
     RCC_AHBPeriphClockCmd(RCC_AHBPeriph_ETH_MAC | RCC_AHBPeriph_ETH_MAC_Tx | RCC_AHBPeriph_ETH_MAC_Rx, ENABLE);
     // Enable the internal 10BASE-T PHY
     EXTEN->EXTEN_CTR |= EXTEN_ETH_10M_EN;
 
-    // Reset MAC
+    // Reset MAC, usually done by the time it's first checked
     ETH_DeInit();
     ETH_SoftwareReset();
-    for (uint8_t i = 0; i < 100; i++) {
-        usleep(10000);
-        if ((ETH->DMABMR & ETH_DMABMR_SR) == 0) {
+    eth_init_step(NULL);
+}
+
+// The current step has finished, start the next one
+static void eth_init_next(void) {
+    switch (eth_bringup.state) {
+    case ETH_INIT_MAC_RESET:
+        // Set MAC frequency (sets CR to 0b000)
+        ETH->MACMIIAR &= MACMIIAR_CR_MASK;
+        // Reset PHY, this takes a few milliseconds
+        ETH_WritePHYRegister(eth_bringup.phy_address, PHY_BMCR, PHY_Reset);
+        eth_bringup.state = ETH_INIT_PHY_RESET;
+        break;
+#if ETH_PTP
+    case ETH_INIT_PHY_RESET:
+        // Fine correction: the addend is accumulated every HCLK cycle and each
+        // overflow adds the increment to the sub-seconds, which roll over at
+        // 2^31. So the clock has to overflow 2^31 / ETH_PTP_INCREMENT times a second.
+        ETH->PTPTSCR |= ETH_PTPTSCR_TSE;
+        ETH->PTPSSIR = ETH_PTP_INCREMENT;
+        ETH->PTPTSAR = (uint32_t)((1ull << 63) / ETH_PTP_INCREMENT / SystemCoreClock);
+        ETH->PTPTSCR |= ETH_PTPTSCR_TSARU;
+        eth_bringup.state = ETH_INIT_PTP_ADDEND;
+        break;
+    case ETH_INIT_PTP_ADDEND:
+        // Count from zero, a PTP slave would step it with the master's time
+        ETH->PTPTSHUR = 0;
+        ETH->PTPTSLUR = 0;
+        ETH->PTPTSCR |= ETH_PTPTSCR_TSFCU | ETH_PTPTSCR_TSSTI;
+        eth_bringup.state = ETH_INIT_PTP_TIME;
+        break;
+    case ETH_INIT_PTP_TIME:
+#else
+    case ETH_INIT_PHY_RESET:
+#endif
+        eth_configure();
+        eth_bringup.state = ETH_INIT_DONE;
+        eth_stats.boot_up_us = eth_uptime_us();
+        eth_bringup.done(ETH_SUCCESS);
+        return;
+    default:
+        return;
+    }
+    eth_bringup.started = sys_now();
+}
+
+// Check on whichever step is in progress and move on as soon as it's done,
+// only coming back later (from LwIP's timers) if it isn't, instead of sleeping
+static void eth_init_step(void *arg) {
+    (void)arg;
+    while (1) {
+        uint32_t busy;
+        switch (eth_bringup.state) {
+        case ETH_INIT_MAC_RESET:
+            busy = ETH->DMABMR & ETH_DMABMR_SR;
+            break;
+        case ETH_INIT_PHY_RESET:
+            busy = ETH_ReadPHYRegister(eth_bringup.phy_address, PHY_BMCR) & PHY_Reset;
             break;
+#if ETH_PTP
+        case ETH_INIT_PTP_ADDEND:
+            busy = ETH->PTPTSCR & ETH_PTPTSCR_TSARU;
+            break;
+        case ETH_INIT_PTP_TIME:
+            busy = ETH->PTPTSCR & ETH_PTPTSCR_TSSTI;
+            break;
+#endif
+        default:
+            return;
         }
-        if (i == 99) {
-            printf("Error: MAC reset timed out\n");
-            return ETH_ERROR;
+
+        if (!busy) {
+            eth_init_next();
+            continue;
+        }
+
+        if (sys_now() - eth_bringup.started >= ETH_INIT_TIMEOUT_MS) {
+            log_printf("Error: %s timed out\n", eth_init_names[eth_bringup.state]);
+            eth_bringup.state = ETH_INIT_IDLE;
+            eth_bringup.done(ETH_ERROR);
+            return;
         }
+        sys_timeout(ETH_INIT_POLL_MS, eth_init_step, NULL);
+        return;
     }
+}
 
+// Everything that has to wait for the resets, the MAC's registers are cleared by them
+static void eth_configure(void) {
     // Ethernet configuration
     ETH_InitTypeDef eth;
     ETH_StructInit(&eth);
@@ -112,34 +1027,106 @@ uint32_t eth_init(uint16_t phy_address) {
     eth.ETH_DropTCPIPChecksumErrorFrame = ETH_DropTCPIPChecksumErrorFrame_Enable;
     eth.ETH_ChecksumOffload = ETH_ChecksumOffload_Enable;
     eth.ETH_AutomaticPadCRCStrip = ETH_AutomaticPadCRCStrip_Enable;
-    if (link_init(&eth, phy_address) == ETH_ERROR) {
-        return ETH_ERROR;
+    eth.ETH_MulticastFramesFilter = ETH_MulticastFramesFilter_HashTable;
+#if LWIP_IGMP
+    // Groups LwIP joined while the MAC was still in reset
+    for (uint32_t bit = 0; bit < 64; bit++) {
+        if (hash_refs[bit] == 0) {
+            continue;
+        }
+        if (bit & 32) {
+            eth.ETH_HashTableHigh |= 1u << (bit & 31);
+        } else {
+            eth.ETH_HashTableLow |= 1u << (bit & 31);
+        }
     }
+#endif
+#if ETH_VLAN_COUNT
+    // VLANs added while the MAC was still in reset
+    eth.ETH_VLANTagComparison = ETH_VLANTagComparison_12Bit;
+    eth.ETH_VLANTagIdentifier = rx_vlan_id();
+#endif
+    eth_apply_settings(&eth);
+
+    uint8_t mac[6];
+    eth_get_mac(mac);
+    ETH_MACAddressConfig(ETH_MAC_Address0, mac);
+    eth_start();
 
     // Configure interrupts
-    ETH_DMAITConfig(ETH_DMA_IT_NIS | ETH_DMA_IT_R | ETH_DMA_IT_PHYLINK, ENABLE);
+    ETH_DMAITConfig(ETH_DMA_IT_NIS | ETH_DMA_IT_R | ETH_DMA_IT_T | ETH_DMA_IT_PHYLINK, ENABLE);
     // Enable them
     NVIC_EnableIRQ(ETH_IRQn);
-    return ETH_SUCCESS;
 }
 
-uint32_t eth_send_packet(const uint8_t *buffer, uint16_t len) {
-    // Check the DMA descriptor isn't owned by the MAC
-    // i.e. a transfer is in progress
-    if (DMATxDescToSet->Status & ETH_DMATxDesc_OWN) {
-        return ETH_ERROR;
+static void eth_start(void) {
+    ETH_DMARxDescChainInit(eth_dma_rx, eth_buffer_rx, ETH_RX_RING_SIZE);
+    // The SDK assumes every buffer is ETH_MAX_PACKET_SIZE, hand out buffers
+    // from both pools with the large ones spread evenly around the ring
+    uint8_t *small = eth_buffer_rx;
+    uint8_t *large = &eth_buffer_rx[ETH_RX_SMALL_COUNT * ETH_RX_SMALL_SIZE];
+    for (uint32_t i = 0; i < ETH_RX_RING_SIZE; i++) {
+        uint32_t size;
+        if ((i + 1) * ETH_RX_LARGE_COUNT / ETH_RX_RING_SIZE != i * ETH_RX_LARGE_COUNT / ETH_RX_RING_SIZE) {
+            eth_dma_rx[i].Buffer1Addr = (uintptr_t)large;
+            size = ETH_RX_LARGE_SIZE;
+            large += size;
+        } else {
+            eth_dma_rx[i].Buffer1Addr = (uintptr_t)small;
+            size = ETH_RX_SMALL_SIZE;
+            small += size;
+        }
+        eth_dma_rx[i].ControlBufferSize = (eth_dma_rx[i].ControlBufferSize & ~ETH_DMARxDesc_RBS1) | size;
+#if ETH_PTP
+        rx_buffers[i] = eth_dma_rx[i].Buffer1Addr;
+#endif
     }
+#if ETH_TX_ZERO_COPY
+    // Buffer addresses are filled in per frame
+    ETH_DMATxDescChainInit(eth_dma_tx, NULL, ETH_TX_RING_SIZE);
+#else
+    ETH_DMATxDescChainInit(eth_dma_tx, &eth_buffer_tx[0][0], ETH_TX_RING_SIZE);
+#endif
+    tx_reclaim = eth_dma_tx;
+    ETH_Start();
+}
 
-    memcpy((uint8_t *)ETH_GetCurrentTxBufferAddress(), buffer, len);
+#if ETH_CAPTURE
+#if !ETH_PTP || ETH_TX_ZERO_COPY
+// Snapshot a frame as it's handed to the MAC, or once it's sent with ETH_PTP
+// (see eth_tx_reclaim()) so it has the time it went out
+static void tx_capture(const struct pbuf *p, const struct eth_timestamp *time) {
+    uint16_t snap = eth_capture_begin(ETH_CAPTURE_TX, time, p->payload, p->len, p->tot_len);
+    if (snap == 0) {
+        return;
+    }
 
-    // Frame length
-    DMATxDescToSet->ControlBufferSize = len & ETH_DMATxDesc_TBS1;
-    // This is the only segment, therefore first and last
-    DMATxDescToSet->Status |= ETH_DMATxDesc_LS | ETH_DMATxDesc_FS;
-    // Give ownership back to the MAC
-    DMATxDescToSet->Status |= ETH_DMATxDesc_OWN;
-    // Enable automatic CRC generation
-    DMATxDescToSet->Status |= ETH_DMATxDesc_CIC_TCPUDPICMP_Full;
+    for (; snap != 0; p = p->next) {
+        uint16_t size = snap < p->len ? snap : p->len;
+        eth_capture_append(p->payload, size);
+        snap -= size;
+    }
+    eth_capture_end();
+}
+#endif
+
+// The same for a frame in one buffer
+static void tx_capture_buffer(const uint8_t *frame, uint16_t len, const struct eth_timestamp *time) {
+    uint16_t snap = eth_capture_begin(ETH_CAPTURE_TX, time, frame, len, len);
+    if (snap != 0) {
+        eth_capture_append(frame, snap);
+        eth_capture_end();
+    }
+}
+#endif
+
+// Hand a frame from first up to (not including) next over to the MAC
+static void tx_start(ETH_DMADESCTypeDef *first, ETH_DMADESCTypeDef *next) {
+    // Give ownership to the MAC
+    first->Status |= ETH_DMATxDesc_OWN;
+    if (eth_stats.boot_first_tx_us == 0) {
+        eth_stats.boot_first_tx_us = eth_uptime_us();
+    }
 
     // If the unavailable flag is set, reset it and resume transmission
     if (ETH->DMASR & ETH_DMASR_TBUS) {
@@ -147,61 +1134,420 @@ uint32_t eth_send_packet(const uint8_t *buffer, uint16_t len) {
         ETH->DMATPDR = 0;
     }
 
-    // Get the next DMA descriptor from the ring
-    DMATxDescToSet = (ETH_DMADESCTypeDef *)DMATxDescToSet->Buffer2NextDescAddr;
+    // Next free DMA descriptor in the ring
+    DMATxDescToSet = next;
+}
 
-    return ETH_SUCCESS;
+uint32_t eth_send_packet(const uint8_t *buffer, uint16_t len) {
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    if (p == NULL) {
+        return ETH_ERROR;
+    }
+
+    pbuf_take(p, buffer, len);
+    uint32_t ret = eth_send_pbuf(p);
+    pbuf_free(p);
+    return ret;
 }
 
-uint32_t eth_get_packet(uint8_t **buffer, uint16_t *len) {
-    // Check the DMA descriptor isn't owned by the MAC
-    // i.e. a transfer is in progress
-    if (DMARxDescToGet->Status & ETH_DMARxDesc_OWN) {
-        // If the unavailable flag is set, reset it
-        if (ETH->DMASR & ETH_DMASR_RBUS) {
-            ETH->DMASR = ETH_DMASR_RBUS;
-            ETH->DMARPDR = 0;
+uint32_t eth_send_pbuf(struct pbuf *p) {
+    PROFILE_SCOPE(PROFILE_SEND_PACKET);
+#if ETH_TX_ZERO_COPY
+    uint32_t segments = 0;
+    int needs_copy = 0;
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        if (q->len != 0) {
+            segments++;
+            needs_copy |= PBUF_NEEDS_COPY(q) != 0;
         }
+    }
+#else
+    const uint32_t segments = 1;
+#endif
+    if (segments == 0) {
         return ETH_ERROR;
     }
+#if ETH_TX_ZERO_COPY
+    // Too fragmented to ever fit in the ring, or some of it is only lent to
+    // us (PBUF_REF to a buffer the caller can change or free once we return,
+    // see etharp's queueing), send a flat copy
+    if (segments > ETH_TX_RING_SIZE || needs_copy) {
+        struct pbuf *flat = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+        if (flat == NULL) {
+            return ETH_ERROR;
+        }
 
-    // Make sure this is the only segment and no errors occurred
-    uint32_t status = DMARxDescToGet->Status;
-    if ((status & ETH_DMARxDesc_LS) && (status & ETH_DMARxDesc_FS) && (status & ETH_DMARxDesc_ES) == 0) {
-        // minus 4 bytes because of CRC
-        *len = ((DMARxDescToGet->Status & ETH_DMARxDesc_FL) >> 16) - 4;
-        *buffer = (uint8_t *)DMARxDescToGet->Buffer1Addr;
-    } else {
-        return ETH_ERROR;
+        uint32_t ret = eth_send_pbuf(flat);
+        pbuf_free(flat);
+        return ret;
     }
+#endif
 
-    // Give ownership back to the MAC
-    DMARxDescToGet->Status |= ETH_DMARxDesc_OWN;
-    // Grab the next DMA descriptor from the ring
-    DMARxDescToGet = (ETH_DMADESCTypeDef *)DMARxDescToGet->Buffer2NextDescAddr;
+    // Make sure there's enough descriptors not owned by the MAC
+    // i.e. no transfer is in progress on them
+    if (tx_free < segments) {
+        eth_tx_reclaim();
+        if (tx_free < segments) {
+            return ETH_RING_FULL;
+        }
+    }
 
+    ETH_DMADESCTypeDef *first = DMATxDescToSet;
+    ETH_DMADESCTypeDef *desc = first;
+#if ETH_TX_ZERO_COPY
+    ETH_DMADESCTypeDef *last = first;
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        if (q->len == 0) {
+            continue;
+        }
+
+        desc->Buffer1Addr = (uintptr_t)q->payload;
+        desc->ControlBufferSize = q->len & ETH_DMATxDesc_TBS1;
+        // Enable automatic checksum generation
+        uint32_t status = ETH_DMATxDesc_TCH | ETH_DMATxDesc_CIC_TCPUDPICMP_Full;
+        if (desc == first) {
+            status |= ETH_DMATxDesc_FS | TX_TIMESTAMP;
+        } else {
+            // The first descriptor is handed over last so the MAC never sees half a frame
+            status |= ETH_DMATxDesc_OWN;
+        }
+        desc->Status = status;
+
+        last = desc;
+        desc = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+    }
+
+    // Interrupt once the whole frame has gone out so it can be reclaimed
+    last->Status |= ETH_DMATxDesc_LS | ETH_DMATxDesc_IC;
+    // Hold onto the chain until then
+    pbuf_ref(p);
+    tx_pbufs[last - eth_dma_tx] = p;
+#if ETH_PTP
+    tx_keep_headers(last, (const void *)first->Buffer1Addr, first->ControlBufferSize & ETH_DMATxDesc_TBS1);
+#endif
+#else
+    pbuf_copy_partial(p, (uint8_t *)desc->Buffer1Addr, p->tot_len, 0);
+
+    // Frame length
+    desc->ControlBufferSize = p->tot_len & ETH_DMATxDesc_TBS1;
+    // This is the only segment, therefore first and last, interrupt once it's sent
+    desc->Status = ETH_DMATxDesc_TCH | ETH_DMATxDesc_LS | ETH_DMATxDesc_FS | ETH_DMATxDesc_IC | TX_TIMESTAMP;
+    // Enable automatic checksum generation
+    desc->Status |= ETH_DMATxDesc_CIC_TCPUDPICMP_Full;
+#if ETH_PTP
+    tx_keep_headers(desc, (const void *)desc->Buffer1Addr, p->tot_len);
+#endif
+    desc = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+#endif
+#if ETH_CAPTURE && !ETH_PTP
+    tx_capture(p, NULL);
+#endif
+    tx_free -= segments;
+
+    tx_start(first, desc);
     return ETH_SUCCESS;
 }
 
-static uint32_t link_init(ETH_InitTypeDef *eth, uint16_t phy_address) {
-    // Set MAC frequency (sets CR to 0b000)
-    ETH->MACMIIAR &= MACMIIAR_CR_MASK;
+uint8_t *eth_tx_claim(uint16_t len) {
+    if (eth_bringup.state != ETH_INIT_DONE) {
+        return NULL;
+    }
+    if (tx_free == 0) {
+        eth_tx_reclaim();
+        if (tx_free == 0) {
+            return NULL;
+        }
+    }
+
+#if ETH_TX_ZERO_COPY
+#if ETH_TX_RAW_COUNT
+    if (len > ETH_TX_RAW_SIZE) {
+        return NULL;
+    }
+    if (tx_raw_head - tx_raw_tail == ETH_TX_RAW_COUNT) {
+        eth_tx_reclaim();
+        if (tx_raw_head - tx_raw_tail == ETH_TX_RAW_COUNT) {
+            return NULL;
+        }
+    }
+    return eth_buffer_raw[tx_raw_head & (ETH_TX_RAW_COUNT - 1)];
+#else
+    (void)len;
+    return NULL;
+#endif
+#else
+    if (len > ETH_MAX_PACKET_SIZE) {
+        return NULL;
+    }
+    return (uint8_t *)DMATxDescToSet->Buffer1Addr;
+#endif
+}
+
+void eth_tx_commit(uint16_t len) {
+    ETH_DMADESCTypeDef *desc = DMATxDescToSet;
+#if ETH_TX_ZERO_COPY && ETH_TX_RAW_COUNT
+    desc->Buffer1Addr = (uintptr_t)eth_buffer_raw[tx_raw_head & (ETH_TX_RAW_COUNT - 1)];
+    tx_raw[desc - eth_dma_tx] = 1;
+    tx_raw_head++;
+#endif
+    desc->ControlBufferSize = len & ETH_DMATxDesc_TBS1;
+    desc->Status = ETH_DMATxDesc_TCH | ETH_DMATxDesc_LS | ETH_DMATxDesc_FS | ETH_DMATxDesc_IC | ETH_DMATxDesc_CIC_TCPUDPICMP_Full | TX_TIMESTAMP;
+#if ETH_PTP
+    tx_keep_headers(desc, (const void *)desc->Buffer1Addr, len);
+#endif
+#if ETH_CAPTURE && !ETH_PTP
+    tx_capture_buffer((const uint8_t *)desc->Buffer1Addr, len, NULL);
+#endif
+    tx_free--;
+    eth_stats.tx_raw++;
 
-    // Reset PHY
-    ETH_WritePHYRegister(phy_address, PHY_BMCR, PHY_Reset);
-    for (uint8_t i = 0; i < 100; i++) {
-        usleep(10000);
-        if ((ETH_ReadPHYRegister(phy_address, PHY_BMCR) & PHY_Reset) == 0) {
+    tx_start(desc, (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr);
+}
+
+#if ETH_CAPTURE && ETH_PTP
+// Snapshot a sent frame from what its last descriptor (i) held onto
+static void tx_capture_sent(uint32_t i, const struct eth_timestamp *time) {
+#if ETH_TX_ZERO_COPY
+    if (tx_pbufs[i] != NULL) {
+        tx_capture(tx_pbufs[i], time);
+        return;
+    }
+#endif
+    // Copied or raw frames, which are in one buffer
+    tx_capture_buffer(tx_headers[i], tx_headers_len[i], time);
+}
+#endif
+
+void eth_tx_reclaim(void) {
+    while (tx_free < ETH_TX_RING_SIZE) {
+        // Still being transmitted
+        if (tx_reclaim->Status & ETH_DMATxDesc_OWN) {
             break;
         }
-        if (i == 99) {
-            printf("Error: PHY reset timed out\n");
+
+#if ETH_TX_ZERO_COPY || ETH_PTP
+        uint32_t i = tx_reclaim - eth_dma_tx;
+#endif
+#if ETH_PTP
+        // Before the pbuf holding the headers is freed
+        if (tx_reclaim->Status & ETH_DMATxDesc_LS) {
+            struct eth_timestamp time;
+            int stamped = (tx_reclaim->Status & ETH_DMATxDesc_TTSS) != 0;
+            if (stamped) {
+                eth_ptp_timestamp(tx_reclaim->Buffer2NextDescAddr, tx_reclaim->Buffer1Addr, &time);
+            }
+            if (stamped && ptp_tx_hook != NULL) {
+                ptp_tx_hook(&time, tx_headers[i], tx_headers_len[i]);
+            }
+#if ETH_CAPTURE
+            tx_capture_sent(i, stamped ? &time : NULL);
+#endif
+        }
+        tx_restore(tx_reclaim);
+#endif
+#if ETH_TX_ZERO_COPY
+        if (tx_pbufs[i] != NULL) {
+            pbuf_free(tx_pbufs[i]);
+            tx_pbufs[i] = NULL;
+        }
+#if ETH_TX_RAW_COUNT
+        if (tx_raw[i]) {
+            tx_raw[i] = 0;
+            tx_raw_tail++;
+        }
+#endif
+#endif
+        tx_free++;
+        tx_reclaim = (ETH_DMADESCTypeDef *)tx_reclaim->Buffer2NextDescAddr;
+    }
+}
+
+void eth_tx_poll(void) {
+    eth_tx_reclaim();
+
+    while (tx_queue_tail != tx_queue_head) {
+        struct pbuf *p = tx_queue[tx_queue_tail & (ETH_TX_QUEUE_SIZE - 1)];
+        uint32_t ret = eth_send_pbuf(p);
+        if (ret == ETH_RING_FULL) {
+            break;
+        }
+
+        // Anything else would fail again, drop it rather than hold up the rest
+        if (ret == ETH_SUCCESS) {
+            LINK_STATS_INC(link.xmit);
+        } else {
+            LINK_STATS_INC(link.drop);
+        }
+        pbuf_free(p);
+        tx_queue_tail++;
+    }
+}
+
+static inline ETH_DMADESCTypeDef *rx_next(const ETH_DMADESCTypeDef *desc) {
+    return (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+}
+
+// Give descriptors holding a bad or partial frame straight back to the MAC
+static void rx_recycle(uint32_t segments) {
+    for (uint32_t i = 0; i < segments; i++) {
+        ETH_DMADESCTypeDef *desc = DMARxDescToGet;
+#if ETH_PTP
+        // Could be the end of a frame that was skipped
+        rx_restore(desc);
+#endif
+        DMARxDescToGet = rx_next(desc);
+        desc->Status = ETH_DMARxDesc_OWN;
+    }
+
+    if (ETH->DMASR & ETH_DMASR_RBUS) {
+        ETH->DMASR = ETH_DMASR_RBUS;
+        ETH->DMARPDR = 0;
+    }
+}
+
+#if ETH_CAPTURE
+// Snapshot a received frame, which can span more than one descriptor
+static void rx_capture(const ETH_DMADESCTypeDef *desc, uint16_t len) {
+    uint16_t capacity = desc->ControlBufferSize & ETH_DMARxDesc_RBS1;
+#if ETH_PTP
+    // Taken by rx_take_stamp() already
+    const struct eth_timestamp *time = rx_stamp.valid ? &rx_stamp.time : NULL;
+#else
+    const struct eth_timestamp *time = NULL;
+#endif
+    uint16_t snap = eth_capture_begin(ETH_CAPTURE_RX, time, (const uint8_t *)desc->Buffer1Addr, len < capacity ? len : capacity, len);
+    if (snap == 0) {
+        return;
+    }
+
+    for (; snap != 0; desc = rx_next(desc)) {
+        capacity = desc->ControlBufferSize & ETH_DMARxDesc_RBS1;
+        uint16_t size = snap < capacity ? snap : capacity;
+        eth_capture_append((const void *)desc->Buffer1Addr, size);
+        snap -= size;
+    }
+    eth_capture_end();
+}
+#endif
+
+static void rx_count_error(uint32_t status) {
+    if (status & ETH_DMARxDesc_CE) {
+        eth_stats.rx_crc_errors++;
+    } else if (status & (ETH_DMARxDesc_OE | ETH_DMARxDesc_DE)) {
+        eth_stats.rx_overflow_errors++;
+    } else if (status & ETH_DMARxDesc_LE) {
+        eth_stats.rx_length_errors++;
+    } else {
+        eth_stats.rx_other_errors++;
+    }
+    LINK_STATS_INC(link.drop);
+}
+
+uint32_t eth_get_packet(ETH_DMADESCTypeDef **desc, uint32_t *segments, uint16_t *len) {
+    while (1) {
+        ETH_DMADESCTypeDef *first = DMARxDescToGet;
+
+        // The ring has wrapped around to a descriptor the application still holds,
+        // reception is stalled until it gets released
+        if (rx_borrowed[first - eth_dma_rx]) {
+            return ETH_ERROR;
+        }
+
+        // Check the DMA descriptor isn't owned by the MAC
+        // i.e. a transfer is in progress
+        if (first->Status & ETH_DMARxDesc_OWN) {
+            // If the unavailable flag is set, reset it
+            if (ETH->DMASR & ETH_DMASR_RBUS) {
+                ETH->DMASR = ETH_DMASR_RBUS;
+                ETH->DMARPDR = 0;
+            }
             return ETH_ERROR;
         }
+
+        // Somehow ended up in the middle of a frame, skip to the start of the next one
+        if ((first->Status & ETH_DMARxDesc_FS) == 0) {
+            rx_count_error(first->Status);
+            rx_recycle(1);
+            continue;
+        }
+
+        // Find the last segment of the frame
+        ETH_DMADESCTypeDef *last = first;
+        uint32_t count = 1;
+        while ((last->Status & ETH_DMARxDesc_LS) == 0) {
+            ETH_DMADESCTypeDef *next = rx_next(last);
+            if (rx_borrowed[next - eth_dma_rx] || (next->Status & ETH_DMARxDesc_OWN)) {
+                // Still being received
+                return ETH_ERROR;
+            }
+            if (count == ETH_RX_RING_SIZE || (next->Status & ETH_DMARxDesc_FS)) {
+                // Truncated, a new frame starts before this one finished
+                break;
+            }
+
+            last = next;
+            count++;
+        }
+
+        uint32_t status = last->Status;
+        if ((status & ETH_DMARxDesc_LS) == 0) {
+            eth_stats.rx_other_errors++;
+            LINK_STATS_INC(link.drop);
+            rx_recycle(count);
+            continue;
+        }
+#if ETH_PTP
+        rx_take_stamp(last);
+#endif
+        if (status & ETH_DMARxDesc_ES) {
+            rx_count_error(status);
+            rx_recycle(count);
+            continue;
+        }
+
+        // Includes the 4 byte CRC, except for IEEE 802.3 frames (a length
+        // rather than an ethertype, which with checksum offload on is bits 7, 5
+        // and 0 all clear) that the MAC strips of their padding and CRC. Only
+        // frames that still have theirs can be told to be runts.
+        uint32_t length = (status & ETH_DMARxDesc_FL) >> 16;
+        if (status & (ETH_DMARxDesc_IPV4HCE | ETH_DMARxDesc_FT | ETH_DMARxDesc_MAMPCE)) {
+            if (length < 64) {
+                eth_stats.rx_runt_errors++;
+                LINK_STATS_INC(link.drop);
+                rx_recycle(count);
+                continue;
+            }
+            length -= 4;
+        }
+
+#if ETH_CAPTURE
+        rx_capture(first, length);
+#endif
+        // Lend the descriptors out, they're only given back to the MAC in eth_release_packet()
+        *desc = first;
+        *segments = count;
+        *len = length;
+        for (uint32_t i = 0; i < count; i++) {
+            rx_borrowed[DMARxDescToGet - eth_dma_rx] = 1;
+            // Grab the next DMA descriptor from the ring
+            DMARxDescToGet = rx_next(DMARxDescToGet);
+        }
+
+        return ETH_SUCCESS;
     }
+}
 
-    eth_apply_settings(eth);
-    return ETH_SUCCESS;
+void eth_release_packet(ETH_DMADESCTypeDef *desc) {
+    // Give ownership back to the MAC before clearing the borrowed flag,
+    // otherwise eth_get_packet() could mistake the stale status for a new frame
+    desc->Status = ETH_DMARxDesc_OWN;
+    rx_borrowed[desc - eth_dma_rx] = 0;
+
+    // Reception may have been suspended waiting for this descriptor
+    if (ETH->DMASR & ETH_DMASR_RBUS) {
+        ETH->DMASR = ETH_DMASR_RBUS;
+        ETH->DMARPDR = 0;
+    }
 }
 
 static void eth_apply_settings(const ETH_InitTypeDef *eth) {
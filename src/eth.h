@@ -20,14 +20,250 @@
 #include <debug.h>
 #include <lwip/netif.h>
 
+// Ring sizes are picked together with LwIP's, see NET_PROFILE
+#include "net_profile.h"
+
+// Hand RX DMA buffers to LwIP directly instead of copying them into a PBUF_POOL
+#ifndef ETH_RX_ZERO_COPY
+#define ETH_RX_ZERO_COPY 1
+#endif
+// Point TX descriptors at pbuf payloads instead of copying into a TX buffer
+#ifndef ETH_TX_ZERO_COPY
+#define ETH_TX_ZERO_COPY 1
+#endif
+
+// RX buffers come from two pools: small ones for the ARP, ACK and telemetry
+// frames that make up most traffic, and a few large ones spread evenly around
+// the ring. Frames that don't fit in one buffer span several descriptors.
+#ifndef ETH_RX_SMALL_COUNT
+#define ETH_RX_SMALL_COUNT 8
+#endif
+#ifndef ETH_RX_SMALL_SIZE
+#define ETH_RX_SMALL_SIZE 256
+#endif
+#ifndef ETH_RX_LARGE_COUNT
+#define ETH_RX_LARGE_COUNT 2
+#endif
+#ifndef ETH_RX_LARGE_SIZE
+#define ETH_RX_LARGE_SIZE ETH_MAX_PACKET_SIZE
+#endif
+
+// DMA ring sizes
+#define ETH_RX_RING_SIZE (ETH_RX_SMALL_COUNT + ETH_RX_LARGE_COUNT)
+#ifndef ETH_TX_RING_SIZE
+#if ETH_TX_ZERO_COPY
+// One descriptor per pbuf in a chain, these are cheap without a buffer attached
+#define ETH_TX_RING_SIZE 8
+#else
+#define ETH_TX_RING_SIZE 2
+#endif
+#endif
+
+// Mask the RX interrupt after it fires and poll the ring from the main loop
+// until it's empty, instead of taking an interrupt for every frame
+#ifndef ETH_RX_POLL
+#define ETH_RX_POLL 1
+#endif
+// Frames handed from the ISR to the main loop when not polling, must be a power of 2
+#ifndef ETH_RX_QUEUE_SIZE
+#define ETH_RX_QUEUE_SIZE 8
+#endif
+// PBUF_POOL pbufs set aside for the ISR to copy frames into when neither
+// zero-copy nor polling is used, so it never has to call into LwIP's allocator.
+// The main loop tops it back up, must be a power of 2
+#ifndef ETH_RX_POOL_SIZE
+#if !ETH_RX_ZERO_COPY && !ETH_RX_POLL
+#define ETH_RX_POOL_SIZE 8
+#else
+#define ETH_RX_POOL_SIZE 0
+#endif
+#endif
+// Maximum number of frames fed to LwIP per main loop iteration
+#ifndef ETH_RX_BATCH
+#define ETH_RX_BATCH 4
+#endif
+
+// Frames waiting for free TX descriptors, must be a power of 2
+#ifndef ETH_TX_QUEUE_SIZE
+#define ETH_TX_QUEUE_SIZE 8
+#endif
+
+// Buffers for raw frames (eth_tx_claim()) when TX is zero-copy and the
+// descriptors have none of their own, must be a power of 2
+#ifndef ETH_TX_RAW_COUNT
+#define ETH_TX_RAW_COUNT 2
+#endif
+#ifndef ETH_TX_RAW_SIZE
+#define ETH_TX_RAW_SIZE 256
+#endif
+
+// Longest frame eth_tx_claim() has room for
+#if !ETH_TX_ZERO_COPY
+#define ETH_TX_CLAIM_MAX ETH_MAX_PACKET_SIZE
+#elif ETH_TX_RAW_COUNT
+#define ETH_TX_CLAIM_MAX ETH_TX_RAW_SIZE
+#else
+#define ETH_TX_CLAIM_MAX 0
+#endif
+
+// Timestamp every frame with the MAC's IEEE 1588 clock, see eth_ptp_set_hooks()
+#ifndef ETH_PTP
+#define ETH_PTP 0
+#endif
+// Sub-second increment (in units of 2^-31 s) added every time the addend
+// overflows, 43 makes that about every 20ns. HCLK has to be faster than that.
+#ifndef ETH_PTP_INCREMENT
+#define ETH_PTP_INCREMENT 43
+#endif
+
+// How often eth_init() checks on the MAC and PHY resets, and how long it
+// waits for each before giving up
+#ifndef ETH_INIT_POLL_MS
+#define ETH_INIT_POLL_MS 1
+#endif
+#ifndef ETH_INIT_TIMEOUT_MS
+#define ETH_INIT_TIMEOUT_MS 1000
+#endif
+
+struct eth_stats {
+    uint32_t rx_interrupts;
+    uint32_t rx_polled;
+    uint32_t rx_crc_errors;
+    uint32_t rx_overflow_errors;
+    uint32_t rx_runt_errors;
+    uint32_t rx_length_errors;
+    uint32_t rx_other_errors;
+    // From the MAC's missed frame counter, see eth_update_stats()
+    uint32_t rx_missed_frames;
+    uint32_t rx_fifo_overflows;
+    // Frames the MAC didn't verify the checksums of, LwIP checks them instead
+    uint32_t rx_sw_checksum;
+    uint32_t rx_queue_max;
+    uint32_t rx_queue_drop;
+    // Frames dropped because the ISR's pbuf pool ran dry
+    uint32_t rx_pool_empty;
+    uint32_t tx_queued;
+    uint32_t tx_queue_max;
+    uint32_t tx_queue_drop;
+    // Frames sent with eth_tx_commit(), bypassing LwIP
+    uint32_t tx_raw;
+    // Frames tagged for a VLAN without a netif
+    uint32_t rx_vlan_dropped;
+    // Microseconds from boot (SysTick starting) until the MAC was ready and
+    // the first frame was received and sent, 0 until it happens
+    uint32_t boot_up_us;
+    uint32_t boot_first_rx_us;
+    uint32_t boot_first_tx_us;
+};
+extern struct eth_stats eth_stats;
+
+// Snapshot of how many descriptors are in use
+struct eth_ring_usage {
+    // Received frames waiting to be picked up
+    uint32_t rx_ready;
+    // Held by the application (LwIP in zero-copy mode)
+    uint32_t rx_held;
+    // Owned by the MAC or waiting to be reclaimed
+    uint32_t tx_busy;
+    // Frames waiting for a free descriptor
+    uint32_t tx_queued;
+};
+
 void eth_get_mac(uint8_t *mac);
 void eth_configure_clock(void);
-uint32_t eth_init(uint16_t phy_address);
+// Called with ETH_SUCCESS once the MAC and PHY are out of reset and frames
+// can flow, or ETH_ERROR if either reset timed out
+typedef void (*eth_init_fn)(uint32_t status);
+// Start bringing up the MAC and PHY and return straight away, the resets are
+// checked on from LwIP's timers so lwip_init() has to be called first. Until
+// done is called nothing is received and anything sent is dropped.
+void eth_init(uint16_t phy_address, eth_init_fn done);
+
+// Returned by the send functions when there aren't enough free descriptors,
+// unlike ETH_ERROR it's worth trying again once the MAC has sent something
+#define ETH_RING_FULL 2
 
 uint32_t eth_send_packet(const uint8_t *buffer, uint16_t len);
-uint32_t eth_get_packet(uint8_t **buffer, uint16_t *len);
+// Queue a (possibly chained) pbuf for transmission, in zero-copy mode a
+// reference is held until the MAC has finished with it
+uint32_t eth_send_pbuf(struct pbuf *p);
+// Get a DMA buffer to build a frame of up to len bytes in, without going
+// through LwIP or a pbuf. NULL if the ring is full or it doesn't fit (see
+// ETH_TX_RAW_SIZE). Nothing else may be sent until eth_tx_commit() is called.
+uint8_t *eth_tx_claim(uint16_t len);
+// Send the frame built in the buffer from eth_tx_claim(), checksums are
+// filled in by the MAC
+void eth_tx_commit(uint16_t len);
+// Free descriptors the MAC has finished transmitting
+void eth_tx_reclaim(void);
+// Reclaim descriptors and send any frames queued while the ring was full, call from the main loop
+void eth_tx_poll(void);
+// Borrow the next received frame from the RX ring, it starts at desc and spans
+// segments descriptors (each holding as much as its buffer fits). Every
+// descriptor stays with the application until eth_release_packet() is called on it.
+// Frames with errors are counted and handed straight back to the MAC.
+uint32_t eth_get_packet(ETH_DMADESCTypeDef **desc, uint32_t *segments, uint16_t *len);
+void eth_release_packet(ETH_DMADESCTypeDef *desc);
+
+// Fold the MAC's clear-on-read missed frame counters into eth_stats
+void eth_update_stats(void);
+void eth_get_ring_usage(struct eth_ring_usage *usage);
+
+#if ETH_PTP
+struct eth_timestamp {
+    uint32_t seconds;
+    uint32_t nanoseconds;
+};
+// Called from the main loop with the time a frame's start of frame delimiter
+// went past, frame holds at least its headers. Received frames are seen just
+// before LwIP gets them, sent ones once their descriptors are reclaimed (so
+// possibly from inside a send, don't send from here).
+typedef void (*eth_ptp_fn)(const struct eth_timestamp *time, const uint8_t *frame, uint16_t len);
+void eth_ptp_set_hooks(eth_ptp_fn rx, eth_ptp_fn tx);
+// Current time of the MAC's clock, which starts from zero in eth_init()
+void eth_ptp_now(struct eth_timestamp *time);
+// Convert the seconds and binary sub-seconds the MAC writes to descriptors
+void eth_ptp_timestamp(uint32_t high, uint32_t low, struct eth_timestamp *time);
+#endif
+
+#if ETH_VLAN_COUNT
+// Frames and bytes (without the tag) for each VLAN netif, id is 0 for unused slots
+struct eth_vlan_stats {
+    uint16_t id;
+    uint32_t rx_frames;
+    uint32_t rx_bytes;
+    uint32_t tx_frames;
+    uint32_t tx_bytes;
+};
+extern struct eth_vlan_stats eth_vlan_stats[ETH_VLAN_COUNT];
+#endif
 
 // LwIP driver
 err_t ch32netif_init(struct netif *netif);
+#if ETH_VLAN_COUNT
+// Init function for a netif on a VLAN, the ID (1-4094) is passed as the state:
+//   netif_add(&netif, &address, &netmask, &gateway, (void *)(uintptr_t)id, ch32netif_vlan_init, ethernet_input);
+// Frames tagged with the ID are given to it with the tag removed and frames it
+// sends are tagged, untagged frames go to the ch32netif_init() netif as usual.
+// VLAN netifs can't be removed again.
+err_t ch32netif_vlan_init(struct netif *netif);
+// LWIP_HOOK_VLAN_SET, the tag for frames sent on a netif or -1 for none
+int eth_vlan_tag(const struct netif *netif);
+#endif
+// Get the next received frame, checked is set if the MAC verified all of its checksums
+struct pbuf *eth_get_pbuf(uint8_t *checked);
+#if ETH_RX_POOL_SIZE
+// Take a pbuf chain of length bytes from the ISR's pool, NULL if there aren't enough.
+// Only call from one context at a time (the ISR)
+struct pbuf *eth_rx_pool_take(uint16_t length);
+// Top the pool back up from PBUF_POOL, only call from the main loop
+void eth_rx_pool_refill(void);
+#endif
+// Handle the RX interrupt, call from the ISR
+void eth_rx_irq(void);
+// Feed up to budget received frames to LwIP, call from the main loop
+uint32_t eth_rx_poll(struct netif *netif, uint32_t budget);
+// Whether eth_rx_poll() has frames waiting, the main loop shouldn't sleep if so
+int eth_rx_pending(void);
 
 #endif
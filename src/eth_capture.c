@@ -0,0 +1,315 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <debug.h>
+#include <string.h>
+#include <lwip/sys.h>
+
+#include "eth.h"
+#include "eth_capture.h"
+#include "sys_arch.h"
+
+#if ETH_CAPTURE
+#define MASK (ETH_CAPTURE_SIZE - 1)
+#define MAX_SNAPLEN (ETH_CAPTURE_SIZE / 4)
+
+#define PCAP_MAGIC        0xA1B2C3D4
+#define PCAP_MAGIC_NS     0xA1B23C4D
+#define LINKTYPE_ETHERNET 1
+
+#define ETHTYPE_IPV4 0x0800
+#define ETHTYPE_VLAN 0x8100
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+// Both in the CPU's byte order, readers go by the magic number
+struct pcap_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t zone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+// Without ETH_PTP, until it's read the timestamp is the SysTick count (high
+// word in seconds) so the division can wait until then
+struct pcap_record {
+    uint32_t seconds;
+    // Microseconds, nanoseconds with ETH_PTP
+    uint32_t fraction;
+    uint32_t captured;
+    uint32_t length;
+};
+
+static const struct pcap_header pcap_header = {
+#if ETH_PTP
+    .magic = PCAP_MAGIC_NS,
+#else
+    .magic = PCAP_MAGIC,
+#endif
+    .version_major = 2,
+    .version_minor = 4,
+    .snaplen = MAX_SNAPLEN,
+    .linktype = LINKTYPE_ETHERNET,
+};
+
+struct eth_capture_stats eth_capture_stats;
+
+static struct eth_capture_config config = {
+    .directions = ETH_CAPTURE_RX | ETH_CAPTURE_TX,
+    .snaplen = ETH_CAPTURE_SNAPLEN < MAX_SNAPLEN ? ETH_CAPTURE_SNAPLEN : MAX_SNAPLEN,
+    .ethertype = ETH_CAPTURE_ETHERTYPE,
+    .port = ETH_CAPTURE_PORT,
+};
+
+// Back to back pcap records, head is the end of the newest and tail the start
+// of the oldest. Both run freely and are masked on access, so a record can
+// wrap around the end.
+static uint8_t ring[ETH_CAPTURE_SIZE];
+static uint32_t ring_head;
+static uint32_t ring_tail;
+
+// The record between eth_capture_begin() and eth_capture_end()
+static uint32_t record_at;
+static uint32_t record_end;
+static sys_prot_t record_prot;
+
+// Download from eth_capture_open(), the records between position and end
+// are off limits to the writer
+static struct {
+    int open;
+    // Bytes of pcap_header read so far
+    uint32_t header_read;
+    volatile uint32_t position;
+    uint32_t end;
+    // Start of the first record whose timestamp hasn't been read yet
+    uint32_t next_record;
+} download;
+
+static void copy_in(uint32_t at, const void *data, uint32_t len) {
+    uint32_t offset = at & MASK;
+    uint32_t first = len < ETH_CAPTURE_SIZE - offset ? len : ETH_CAPTURE_SIZE - offset;
+    memcpy(&ring[offset], data, first);
+    memcpy(ring, (const uint8_t *)data + first, len - first);
+}
+
+static void copy_out(uint32_t at, void *data, uint32_t len) {
+    uint32_t offset = at & MASK;
+    uint32_t first = len < ETH_CAPTURE_SIZE - offset ? len : ETH_CAPTURE_SIZE - offset;
+    memcpy(data, &ring[offset], first);
+    memcpy((uint8_t *)data + first, ring, len - first);
+}
+
+static inline uint16_t read16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Only looks at the bytes that are there, anything too short to tell doesn't match
+static int wanted(const uint8_t *frame, uint16_t available) {
+    if (config.ethertype == 0 && config.port == 0) {
+        return 1;
+    }
+    if (available < 14) {
+        return 0;
+    }
+
+    uint32_t offset = 14;
+    uint16_t type = read16(&frame[12]);
+    if (type == ETHTYPE_VLAN && available >= 18) {
+        type = read16(&frame[16]);
+        offset = 18;
+    }
+    if (config.ethertype != 0 && type != config.ethertype) {
+        return 0;
+    }
+    if (config.port == 0) {
+        return 1;
+    }
+
+    // Later fragments don't have the ports
+    const uint8_t *ip = &frame[offset];
+    if (type != ETHTYPE_IPV4 || available < offset + 20 || (read16(&ip[6]) & 0x1FFF) != 0) {
+        return 0;
+    }
+    if (ip[9] != IP_PROTO_TCP && ip[9] != IP_PROTO_UDP) {
+        return 0;
+    }
+    offset += (ip[0] & 0x0F) * 4;
+    if (available < offset + 4) {
+        return 0;
+    }
+    return read16(&frame[offset]) == config.port || read16(&frame[offset + 2]) == config.port;
+}
+
+static void timestamp(struct pcap_record *record, const struct eth_timestamp *time) {
+#if ETH_PTP
+    struct eth_timestamp now;
+    if (time == NULL) {
+        eth_ptp_now(&now);
+        time = &now;
+    }
+    record->seconds = time->seconds;
+    record->fraction = time->nanoseconds;
+#else
+    (void)time;
+    uint64_t ticks = SysTick->CNT;
+    record->seconds = (uint32_t)(ticks >> 32);
+    record->fraction = (uint32_t)ticks;
+#endif
+}
+
+#if !ETH_PTP
+// From the SysTick count to seconds and microseconds, only one 64-bit division
+static void convert_timestamp(struct pcap_record *record) {
+    const uint32_t ticks_per_second = SYS_TICKS_PER_MS * 1000;
+    uint64_t ticks = (uint64_t)record->seconds << 32 | record->fraction;
+    uint32_t seconds = (uint32_t)(ticks / ticks_per_second);
+    record->seconds = seconds;
+    record->fraction = (uint32_t)(ticks - (uint64_t)seconds * ticks_per_second) / SYS_TICKS_PER_US;
+}
+#endif
+
+void eth_capture_configure(const struct eth_capture_config *new_config) {
+    SYS_ARCH_DECL_PROTECT(prot);
+    SYS_ARCH_PROTECT(prot);
+    config = *new_config;
+    if (config.snaplen > MAX_SNAPLEN) {
+        config.snaplen = MAX_SNAPLEN;
+    }
+    SYS_ARCH_UNPROTECT(prot);
+}
+
+void eth_capture_get_config(struct eth_capture_config *current) {
+    *current = config;
+}
+
+uint16_t eth_capture_begin(uint8_t direction, const struct eth_timestamp *time, const uint8_t *frame, uint16_t available, uint16_t len) {
+    if ((config.directions & direction) == 0 || config.snaplen == 0 || !wanted(frame, available)) {
+        return 0;
+    }
+
+    uint16_t snap = len < config.snaplen ? len : config.snaplen;
+    uint32_t size = sizeof(struct pcap_record) + snap;
+
+    SYS_ARCH_DECL_PROTECT(prot);
+    SYS_ARCH_PROTECT(prot);
+    while (ring_head + size - ring_tail > ETH_CAPTURE_SIZE) {
+        struct pcap_record oldest;
+        copy_out(ring_tail, &oldest, sizeof(oldest));
+        uint32_t oldest_end = ring_tail + sizeof(oldest) + oldest.captured;
+        // Still to be read by a download
+        if (download.open && (int32_t)(download.end - ring_tail) > 0 && (int32_t)(oldest_end - download.position) > 0) {
+            eth_capture_stats.busy++;
+            SYS_ARCH_UNPROTECT(prot);
+            return 0;
+        }
+
+        ring_tail = oldest_end;
+        eth_capture_stats.overwritten++;
+    }
+
+    struct pcap_record record = {
+        .captured = snap,
+        .length = len,
+    };
+    timestamp(&record, time);
+    copy_in(ring_head, &record, sizeof(record));
+    record_at = ring_head + sizeof(record);
+    record_end = record_at + snap;
+    record_prot = prot;
+    return snap;
+}
+
+void eth_capture_append(const void *data, uint16_t len) {
+    if (len > record_end - record_at) {
+        len = record_end - record_at;
+    }
+    copy_in(record_at, data, len);
+    record_at += len;
+}
+
+void eth_capture_end(void) {
+    ring_head = record_end;
+    eth_capture_stats.captured++;
+    SYS_ARCH_UNPROTECT(record_prot);
+}
+
+uint32_t eth_capture_open(void) {
+    SYS_ARCH_DECL_PROTECT(prot);
+    SYS_ARCH_PROTECT(prot);
+    if (download.open) {
+        SYS_ARCH_UNPROTECT(prot);
+        return 0;
+    }
+
+    download.open = 1;
+    download.header_read = 0;
+    download.position = ring_tail;
+    download.end = ring_head;
+    download.next_record = ring_tail;
+    SYS_ARCH_UNPROTECT(prot);
+    return sizeof(pcap_header) + (download.end - download.position);
+}
+
+uint32_t eth_capture_read(uint8_t *buffer, uint32_t size) {
+    uint32_t done = 0;
+    if (download.header_read < sizeof(pcap_header)) {
+        done = sizeof(pcap_header) - download.header_read;
+        if (done > size) {
+            done = size;
+        }
+        memcpy(buffer, (const uint8_t *)&pcap_header + download.header_read, done);
+        download.header_read += done;
+    }
+
+    // The writer keeps clear of everything from position on, so the copy
+    // doesn't need protecting, just moving position once it's done
+    uint32_t position = download.position;
+    uint32_t len = download.end - position;
+    if (len > size - done) {
+        len = size - done;
+    }
+    copy_out(position, &buffer[done], len);
+#if !ETH_PTP
+    // Convert the timestamps of the record headers that were copied, one can
+    // be split between this read and the next
+    while ((int32_t)(position + len - download.next_record) > 0) {
+        uint32_t at = download.next_record;
+        struct pcap_record record;
+        copy_out(at, &record, sizeof(record));
+        uint32_t next = at + sizeof(record) + record.captured;
+        convert_timestamp(&record);
+
+        uint32_t from = (int32_t)(position - at) > 0 ? position : at;
+        uint32_t to = (int32_t)(at + sizeof(record) - (position + len)) > 0 ? position + len : at + sizeof(record);
+        memcpy(&buffer[done + (from - position)], (const uint8_t *)&record + (from - at), to - from);
+        if (to != at + sizeof(record)) {
+            break;
+        }
+        download.next_record = next;
+    }
+#endif
+    __asm__ volatile("" ::: "memory");
+    download.position = position + len;
+    return done + len;
+}
+
+void eth_capture_close(void) {
+    download.open = 0;
+}
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Packet capture into RAM for debugging in the field. The driver copies the
+ * first few bytes of every frame it receives (as eth_get_packet() hands it
+ * out) and sends (as it's queued for the MAC) into a ring, already laid out
+ * as pcap records so a download (/capture.pcap, see httpd_stats.c) is a
+ * straight copy. The oldest records make room for new ones, except while a
+ * download still needs them, then new frames are dropped instead.
+ *
+ * Without ETH_PTP frames are timestamped by SysTick when the driver gets to
+ * them, the raw count is kept and only turned into seconds as it's read. With
+ * ETH_PTP it's the time the MAC stamped them with going past on the wire (in
+ * nanoseconds), sent frames are captured once they're out so they have it.
+ */
+
+#ifndef ETH_CAPTURE_H_
+#define ETH_CAPTURE_H_
+
+#include <stdint.h>
+
+#ifndef ETH_CAPTURE
+#define ETH_CAPTURE 0
+#endif
+
+// Bytes of pcap records kept, a power of 2. Each takes 16 bytes plus the
+// snapshot of the frame.
+#ifndef ETH_CAPTURE_SIZE
+#define ETH_CAPTURE_SIZE 8192
+#endif
+// Defaults for eth_capture_config, see below
+#ifndef ETH_CAPTURE_SNAPLEN
+#define ETH_CAPTURE_SNAPLEN 96
+#endif
+#ifndef ETH_CAPTURE_ETHERTYPE
+#define ETH_CAPTURE_ETHERTYPE 0
+#endif
+#ifndef ETH_CAPTURE_PORT
+#define ETH_CAPTURE_PORT 0
+#endif
+
+#if (ETH_CAPTURE_SIZE & (ETH_CAPTURE_SIZE - 1)) != 0
+#error "ETH_CAPTURE_SIZE must be a power of 2"
+#endif
+
+#define ETH_CAPTURE_RX 0x01
+#define ETH_CAPTURE_TX 0x02
+
+struct eth_capture_config {
+    // ETH_CAPTURE_RX and/or ETH_CAPTURE_TX, 0 stops capturing
+    uint8_t directions;
+    // Bytes kept of each frame, at most a quarter of ETH_CAPTURE_SIZE
+    uint16_t snaplen;
+    // Only frames of this ethertype (inside a VLAN tag if there is one), 0 for any
+    uint16_t ethertype;
+    // Only IPv4 TCP and UDP from or to this port, 0 for any
+    uint16_t port;
+};
+
+struct eth_capture_stats {
+    uint32_t captured;
+    // Records dropped to make room for new ones
+    uint32_t overwritten;
+    // Frames not captured because a download was still reading the oldest records
+    uint32_t busy;
+};
+
+extern struct eth_capture_stats eth_capture_stats;
+
+#if ETH_CAPTURE
+// Takes effect from the next frame, a download that's already going keeps the
+// records taken before
+void eth_capture_configure(const struct eth_capture_config *config);
+void eth_capture_get_config(struct eth_capture_config *config);
+
+struct eth_timestamp;
+
+// Driver side, from the main loop or the Ethernet interrupt. Start a record
+// for a frame of len bytes whose first available bytes (at least the headers
+// if it has them) are at frame. With ETH_PTP time is the frame's hardware
+// timestamp, NULL if it didn't get one, otherwise it's ignored. Returns how
+// many bytes of the frame to pass to eth_capture_append() before calling
+// eth_capture_end(), or 0 if it isn't wanted, then neither should be called.
+// The Ethernet interrupt is masked in between.
+uint16_t eth_capture_begin(uint8_t direction, const struct eth_timestamp *time, const uint8_t *frame, uint16_t available, uint16_t len);
+void eth_capture_append(const void *data, uint16_t len);
+void eth_capture_end(void);
+
+// Reader side, from the main loop. Take a snapshot of the ring as a pcap file,
+// returns its size or 0 if another download is still going. Capture carries
+// on meanwhile.
+uint32_t eth_capture_open(void);
+// Copy the next part of the file into buffer, returns the number of bytes (0 at the end)
+uint32_t eth_capture_read(uint8_t *buffer, uint32_t size);
+void eth_capture_close(void);
+#endif
+
+#endif
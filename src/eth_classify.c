@@ -0,0 +1,167 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <debug.h>
+
+#include "eth_classify.h"
+#include "sys_arch.h"
+
+#define TICKS_PER_SECOND (SYS_TICKS_PER_MS * 1000)
+
+#define ETHTYPE_IPV4 0x0800
+#define ETHTYPE_ARP  0x0806
+#define IP_PROTO_ICMP 1
+#define IP_PROTO_TCP  6
+#define IP_PROTO_UDP  17
+#define TCP_FLAG_SYN 0x02
+
+// Counts in SysTick ticks, every frame costs one second's worth divided by the rate
+struct bucket {
+    uint32_t cost;
+    uint32_t limit;
+    uint32_t level;
+    uint32_t last;
+};
+
+#define BUCKET(rate, burst) { \
+    .cost = (rate) ? TICKS_PER_SECOND / (rate) : 0, \
+    .limit = (rate) ? TICKS_PER_SECOND / (rate) * (burst) : 0 \
+}
+
+static struct bucket buckets[ETH_CLASS_COUNT] = {
+    [ETH_CLASS_ARP] = BUCKET(ETH_CLASSIFY_ARP_RATE, ETH_CLASSIFY_ARP_BURST),
+    [ETH_CLASS_ICMP] = BUCKET(ETH_CLASSIFY_ICMP_RATE, ETH_CLASSIFY_ICMP_BURST),
+    [ETH_CLASS_BROADCAST] = BUCKET(ETH_CLASSIFY_BROADCAST_RATE, ETH_CLASSIFY_BROADCAST_BURST),
+    [ETH_CLASS_MULTICAST] = BUCKET(ETH_CLASSIFY_MULTICAST_RATE, ETH_CLASSIFY_MULTICAST_BURST),
+};
+
+static volatile uint16_t priority_ports[ETH_CLASSIFY_PORTS];
+
+struct eth_class_stats eth_class_stats[ETH_CLASS_COUNT];
+
+const char *const eth_class_names[ETH_CLASS_COUNT] = {
+    [ETH_CLASS_PRIORITY] = "priority",
+    [ETH_CLASS_ARP] = "arp",
+    [ETH_CLASS_NORMAL] = "normal",
+    [ETH_CLASS_MULTICAST] = "multicast",
+    [ETH_CLASS_ICMP] = "icmp",
+    [ETH_CLASS_BROADCAST] = "broadcast",
+    [ETH_CLASS_OTHER] = "other",
+};
+
+int eth_classify_add_port(uint16_t port) {
+    for (int i = 0; i < ETH_CLASSIFY_PORTS; i++) {
+        if (priority_ports[i] == 0 || priority_ports[i] == port) {
+            priority_ports[i] = port;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int is_priority_port(uint16_t port) {
+    for (int i = 0; i < ETH_CLASSIFY_PORTS; i++) {
+        if (priority_ports[i] == port) {
+            return port != 0;
+        }
+    }
+    return 0;
+}
+
+static inline uint16_t read16(const uint8_t *data) {
+    return (data[0] << 8) | data[1];
+}
+
+enum eth_class eth_classify(const uint8_t *frame, uint16_t len) {
+    if (len < 14) {
+        return ETH_CLASS_OTHER;
+    }
+
+    // Group bit of the destination address, broadcast is all ones
+    int group = frame[0] & 0x01;
+    int broadcast = (frame[0] & frame[1] & frame[2] & frame[3] & frame[4] & frame[5]) == 0xFF;
+    uint16_t type = read16(&frame[12]);
+    if (type == ETHTYPE_ARP) {
+        return ETH_CLASS_ARP;
+    }
+    if (type != ETHTYPE_IPV4 || len < 14 + 20) {
+        return ETH_CLASS_OTHER;
+    }
+
+    const uint8_t *ip = &frame[14];
+    uint32_t header = (ip[0] & 0x0F) * 4;
+    uint8_t proto = ip[9];
+    // Only the first fragment has the transport header
+    int first_fragment = (read16(&ip[6]) & 0x1FFF) == 0;
+    const uint8_t *transport = &ip[header];
+    int has_ports = first_fragment && 14 + header + 4 <= len;
+
+    if ((proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) && has_ports && is_priority_port(read16(&transport[2]))) {
+        return ETH_CLASS_PRIORITY;
+    }
+    if (broadcast) {
+        return ETH_CLASS_BROADCAST;
+    }
+    if (group) {
+        return ETH_CLASS_MULTICAST;
+    }
+    if (proto == IP_PROTO_ICMP) {
+        return ETH_CLASS_ICMP;
+    }
+    // Anything but a SYN belongs to a connection that's already open (or is
+    // about to be reset, which is cheap either way)
+    if (proto == IP_PROTO_TCP && first_fragment && 14 + header + 14 <= len && (transport[13] & TCP_FLAG_SYN) == 0) {
+        return ETH_CLASS_PRIORITY;
+    }
+    return ETH_CLASS_NORMAL;
+}
+
+static int bucket_take(struct bucket *bucket) {
+    if (bucket->cost == 0) {
+        return 1;
+    }
+
+    uint32_t now = (uint32_t)SysTick->CNT;
+    uint32_t elapsed = now - bucket->last;
+    bucket->last = now;
+    if (elapsed >= bucket->limit - bucket->level) {
+        bucket->level = bucket->limit;
+    } else {
+        bucket->level += elapsed;
+    }
+
+    if (bucket->level < bucket->cost) {
+        return 0;
+    }
+    bucket->level -= bucket->cost;
+    return 1;
+}
+
+int eth_classify_admit(enum eth_class class, uint32_t pressure) {
+    struct eth_class_stats *stats = &eth_class_stats[class];
+    if ((pressure >= ETH_CLASSIFY_CRITICAL && class > ETH_CLASS_PRIORITY) ||
+        (pressure >= ETH_CLASSIFY_TIGHT && class > ETH_CLASS_NORMAL)) {
+        stats->pressure_drops++;
+        return 0;
+    }
+    if (!bucket_take(&buckets[class])) {
+        stats->rate_drops++;
+        return 0;
+    }
+
+    stats->frames++;
+    return 1;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Early classification of received frames, straight from the DMA buffer
+ * before a pbuf is allocated or LwIP sees them. Broadcast, ARP and ICMP can be
+ * rate limited, and when RX is close to running out of room (see
+ * rx_pressure() in eth.c) the least important frames are dropped first so a
+ * flood can't push out segments for connections that are already open.
+ */
+
+#ifndef ETH_CLASSIFY_H_
+#define ETH_CLASSIFY_H_
+
+#include <stdint.h>
+
+#ifndef ETH_CLASSIFY
+#define ETH_CLASSIFY 1
+#endif
+
+// Pressure (percentage of RX descriptors, queue or pool in use) above which
+// only classes up to ETH_CLASS_NORMAL get in, and then only ETH_CLASS_PRIORITY
+#ifndef ETH_CLASSIFY_TIGHT
+#define ETH_CLASSIFY_TIGHT 75
+#endif
+#ifndef ETH_CLASSIFY_CRITICAL
+#define ETH_CLASSIFY_CRITICAL 90
+#endif
+
+// Token buckets, frames per second and burst size, a rate of 0 means unlimited.
+// They apply whether or not RX is under pressure. By default only ARP (a storm
+// costs a pbuf and a cache lookup a frame, 50/s is plenty for one host) and
+// broadcast (to ff:ff:ff:ff:ff:ff only) are limited. Multicast the MAC lets in
+// is for groups the board joined (see ch32netif_igmp_mac_filter() in eth.c),
+// and ping floods are handy for testing.
+#ifndef ETH_CLASSIFY_ARP_RATE
+#define ETH_CLASSIFY_ARP_RATE 50
+#endif
+#ifndef ETH_CLASSIFY_ARP_BURST
+#define ETH_CLASSIFY_ARP_BURST 10
+#endif
+#ifndef ETH_CLASSIFY_ICMP_RATE
+#define ETH_CLASSIFY_ICMP_RATE 0
+#endif
+#ifndef ETH_CLASSIFY_ICMP_BURST
+#define ETH_CLASSIFY_ICMP_BURST 20
+#endif
+#ifndef ETH_CLASSIFY_BROADCAST_RATE
+#define ETH_CLASSIFY_BROADCAST_RATE 100
+#endif
+#ifndef ETH_CLASSIFY_BROADCAST_BURST
+#define ETH_CLASSIFY_BROADCAST_BURST 20
+#endif
+#ifndef ETH_CLASSIFY_MULTICAST_RATE
+#define ETH_CLASSIFY_MULTICAST_RATE 0
+#endif
+#ifndef ETH_CLASSIFY_MULTICAST_BURST
+#define ETH_CLASSIFY_MULTICAST_BURST 20
+#endif
+
+// Local TCP/UDP ports whose traffic is always ETH_CLASS_PRIORITY
+#ifndef ETH_CLASSIFY_PORTS
+#define ETH_CLASSIFY_PORTS 4
+#endif
+
+// In priority order, highest first
+enum eth_class {
+    // TCP segments for open connections (anything but a SYN), and ports added
+    // with eth_classify_add_port()
+    ETH_CLASS_PRIORITY,
+    ETH_CLASS_ARP,
+    // Other unicast IPv4, new connections and UDP
+    ETH_CLASS_NORMAL,
+    // IPv4 multicast that isn't to a priority port
+    ETH_CLASS_MULTICAST,
+    ETH_CLASS_ICMP,
+    // IPv4 broadcast that isn't to a priority port
+    ETH_CLASS_BROADCAST,
+    // Everything else (IPv6, unknown ethertypes)
+    ETH_CLASS_OTHER,
+    ETH_CLASS_COUNT
+};
+
+struct eth_class_stats {
+    uint32_t frames;
+    // Dropped by the class's token bucket
+    uint32_t rate_drops;
+    // Dropped because RX was running out of room
+    uint32_t pressure_drops;
+};
+
+extern struct eth_class_stats eth_class_stats[ETH_CLASS_COUNT];
+extern const char *const eth_class_names[ETH_CLASS_COUNT];
+
+// Treat TCP and UDP to a local port as priority, returns non-zero if the table is full
+int eth_classify_add_port(uint16_t port);
+// Sort a frame into a class, only the first len bytes (one DMA buffer) are looked at
+enum eth_class eth_classify(const uint8_t *frame, uint16_t len);
+// Decide whether to keep a frame given how full RX is (0-100) and count it
+int eth_classify_admit(enum eth_class class, uint32_t pressure);
+
+#endif
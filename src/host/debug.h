@@ -0,0 +1,277 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Stand-in for the SDK's debug.h (and everything it pulls in) when building
+ * ch32-lwip-host, only the parts of the SDK used by this project are here.
+ * Register and bit definitions follow ch32v30x.h/ch32v30x_eth.h, the
+ * implementations live in sim_eth.c.
+ */
+
+#ifndef HOST_DEBUG_H_
+#define HOST_DEBUG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Interrupt handlers are plain functions called by the simulation
+#define INTERRUPT(name) void name(void)
+
+typedef enum { RESET = 0, SET = !RESET } FlagStatus, ITStatus;
+typedef enum { DISABLE = 0, ENABLE = !DISABLE } FunctionalState;
+
+// HCLK, 144MHz
+extern uint32_t SystemCoreClock;
+
+// SysTick, counts at HCLK/8 (18MHz), see sys_arch.h for the CTLR bits
+typedef struct {
+    volatile uint32_t CTLR;
+    volatile uint32_t SR;
+    volatile uint64_t CNT;
+    volatile uint64_t CMP;
+} SysTick_Type;
+extern SysTick_Type sim_systick;
+#define SysTick (&sim_systick)
+
+typedef enum { SysTicK_IRQn = 12, ETH_IRQn = 61 } IRQn_Type;
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+
+void USART_Printf_Init(uint32_t baudrate);
+
+// Electronic signature unique ID
+extern const uint8_t sim_esig_uid[12];
+#define ESIG_UID sim_esig_uid
+
+// Flash, backed by a file with SIM_FLASH=path (see sim_flash.c)
+extern uint8_t sim_flash[256 * 1024];
+#define FLASH_BASE ((uintptr_t)sim_flash)
+
+typedef enum { FLASH_BUSY = 1, FLASH_ERROR_PG, FLASH_ERROR_WRP, FLASH_COMPLETE, FLASH_TIMEOUT } FLASH_Status;
+void FLASH_Unlock(void);
+void FLASH_Lock(void);
+FLASH_Status FLASH_ErasePage(uintptr_t address);
+FLASH_Status FLASH_ProgramWord(uintptr_t address, uint32_t data);
+
+// RCC
+#define RCC_AHBPeriph_ETH_MAC    0x00004000
+#define RCC_AHBPeriph_ETH_MAC_Tx 0x00008000
+#define RCC_AHBPeriph_ETH_MAC_Rx 0x00010000
+#define RCC_PREDIV2_Div2         0x00000010
+#define RCC_PLL3Mul_15           0x0000D000
+#define RCC_FLAG_PLL3RDY         0x3D
+
+void RCC_AHBPeriphClockCmd(uint32_t periph, FunctionalState state);
+void RCC_PREDIV2Config(uint32_t div);
+void RCC_PLL3Config(uint32_t mul);
+void RCC_PLL3Cmd(FunctionalState state);
+FlagStatus RCC_GetFlagStatus(uint8_t flag);
+
+// EXTEN
+typedef struct {
+    volatile uint32_t EXTEN_CTR;
+} EXTEN_TypeDef;
+extern EXTEN_TypeDef sim_exten;
+#define EXTEN (&sim_exten)
+#define EXTEN_ETH_10M_EN 0x40000000
+
+// ETH registers
+typedef struct {
+    volatile uint32_t MACCR;
+    volatile uint32_t MACFFR;
+    volatile uint32_t MACHTHR;
+    volatile uint32_t MACHTLR;
+    volatile uint32_t MACMIIAR;
+    volatile uint32_t MACMIIDR;
+    volatile uint32_t MACFCR;
+    volatile uint32_t MACVLANTR;
+    volatile uint32_t MACA0HR;
+    volatile uint32_t MACA0LR;
+    volatile uint32_t PTPTSCR;
+    volatile uint32_t PTPSSIR;
+    volatile uint32_t PTPTSHR;
+    volatile uint32_t PTPTSLR;
+    volatile uint32_t PTPTSHUR;
+    volatile uint32_t PTPTSLUR;
+    volatile uint32_t PTPTSAR;
+    volatile uint32_t DMABMR;
+    volatile uint32_t DMATPDR;
+    volatile uint32_t DMARPDR;
+    volatile uint32_t DMARDLAR;
+    volatile uint32_t DMATDLAR;
+    volatile uint32_t DMASR;
+    volatile uint32_t DMAOMR;
+    volatile uint32_t DMAIER;
+    volatile uint32_t DMAMFBOCR;
+} ETH_TypeDef;
+extern ETH_TypeDef sim_eth;
+#define ETH (&sim_eth)
+
+// DMA descriptors, the addresses are pointer sized so the rings work on 64-bit hosts
+typedef struct {
+    volatile uint32_t Status;
+    volatile uint32_t ControlBufferSize;
+    volatile uintptr_t Buffer1Addr;
+    volatile uintptr_t Buffer2NextDescAddr;
+} ETH_DMADESCTypeDef;
+
+extern ETH_DMADESCTypeDef *DMATxDescToSet;
+extern ETH_DMADESCTypeDef *DMARxDescToGet;
+
+#define ETH_MAX_PACKET_SIZE 1524
+#define MAX_ETH_PAYLOAD     1500
+
+#define ETH_SUCCESS 1
+#define ETH_ERROR   0
+
+#define ETH_DMATxDesc_OWN                 0x80000000
+#define ETH_DMATxDesc_IC                  0x40000000
+#define ETH_DMATxDesc_LS                  0x20000000
+#define ETH_DMATxDesc_FS                  0x10000000
+#define ETH_DMATxDesc_TTSE                0x02000000
+#define ETH_DMATxDesc_CIC_TCPUDPICMP_Full 0x00C00000
+#define ETH_DMATxDesc_TCH                 0x00100000
+#define ETH_DMATxDesc_TTSS                0x00020000
+#define ETH_DMATxDesc_ES                  0x00008000
+#define ETH_DMATxDesc_TBS1                0x00001FFF
+
+#define ETH_DMARxDesc_OWN     0x80000000
+#define ETH_DMARxDesc_FL      0x3FFF0000
+#define ETH_DMARxDesc_ES      0x00008000
+#define ETH_DMARxDesc_DE      0x00004000
+#define ETH_DMARxDesc_LE      0x00001000
+#define ETH_DMARxDesc_VLAN    0x00000400
+#define ETH_DMARxDesc_OE      0x00000800
+#define ETH_DMARxDesc_FS      0x00000200
+#define ETH_DMARxDesc_LS      0x00000100
+#define ETH_DMARxDesc_IPV4HCE 0x00000080
+#define ETH_DMARxDesc_FT      0x00000020
+#define ETH_DMARxDesc_CE      0x00000002
+#define ETH_DMARxDesc_MAMPCE  0x00000001
+#define ETH_DMARxDesc_RCH     0x00004000
+#define ETH_DMARxDesc_RBS1    0x00001FFF
+
+#define ETH_DMASR_TS   0x00000001
+#define ETH_DMASR_TBUS 0x00000004
+#define ETH_DMASR_RS   0x00000040
+#define ETH_DMASR_RBUS 0x00000080
+#define ETH_DMASR_NIS  0x00010000
+
+#define ETH_DMA_IT_T       ETH_DMASR_TS
+#define ETH_DMA_IT_R       ETH_DMASR_RS
+#define ETH_DMA_IT_NIS     ETH_DMASR_NIS
+#define ETH_DMA_IT_PHYLINK 0x80000000
+
+#define ETH_PTPTSCR_TSE   0x00000001
+#define ETH_PTPTSCR_TSFCU 0x00000002
+#define ETH_PTPTSCR_TSSTI 0x00000004
+#define ETH_PTPTSCR_TSSTU 0x00000008
+#define ETH_PTPTSCR_TSITE 0x00000010
+#define ETH_PTPTSCR_TSARU 0x00000020
+
+#define ETH_DMABMR_SR  0x00000001
+#define ETH_DMABMR_USP 0x00800000
+
+#define MACMIIAR_CR_MASK  0xFFFFFFE3
+#define MACCR_CLEAR_MASK  0xFF20810F
+#define MACFCR_CLEAR_MASK 0x0000FF41
+#define DMAOMR_CLEAR_MASK 0xF8DE3F23
+
+#define ETH_MAC_Address0 0x00000000
+
+#define ETH_Mode_FullDuplex 0x00000800
+#define ETH_Mode_HalfDuplex 0x00000000
+#define ETH_Speed_10M       0x00000000
+
+#define ETH_AutoNegotiation_Enable            0x00000001
+#define ETH_BroadcastFramesReception_Enable   0x00000000
+#define ETH_DropTCPIPChecksumErrorFrame_Enable 0x00000000
+#define ETH_ChecksumOffload_Enable            0x00000400
+#define ETH_AutomaticPadCRCStrip_Enable       0x00000080
+#define ETH_Internal_Pull_Up_Res_Enable       0x00100000
+#define ETH_MulticastFramesFilter_HashTable   0x00000004
+#define ETH_VLANTagComparison_12Bit           0x00010000
+
+typedef struct {
+    uint32_t ETH_AutoNegotiation;
+    uint32_t ETH_Watchdog;
+    uint32_t ETH_Jabber;
+    uint32_t ETH_InterFrameGap;
+    uint32_t ETH_CarrierSense;
+    uint32_t ETH_Speed;
+    uint32_t ETH_ReceiveOwn;
+    uint32_t ETH_LoopbackMode;
+    uint32_t ETH_Mode;
+    uint32_t ETH_ChecksumOffload;
+    uint32_t ETH_RetryTransmission;
+    uint32_t ETH_AutomaticPadCRCStrip;
+    uint32_t ETH_BackOffLimit;
+    uint32_t ETH_DeferralCheck;
+    uint32_t ETH_ReceiveAll;
+    uint32_t ETH_SourceAddrFilter;
+    uint32_t ETH_PassControlFrames;
+    uint32_t ETH_BroadcastFramesReception;
+    uint32_t ETH_DestinationAddrFilter;
+    uint32_t ETH_PromiscuousMode;
+    uint32_t ETH_MulticastFramesFilter;
+    uint32_t ETH_UnicastFramesFilter;
+    uint32_t ETH_HashTableHigh;
+    uint32_t ETH_HashTableLow;
+    uint32_t ETH_PauseTime;
+    uint32_t ETH_ZeroQuantaPause;
+    uint32_t ETH_PauseLowThreshold;
+    uint32_t ETH_UnicastPauseFrameDetect;
+    uint32_t ETH_ReceiveFlowControl;
+    uint32_t ETH_TransmitFlowControl;
+    uint32_t ETH_VLANTagComparison;
+    uint32_t ETH_VLANTagIdentifier;
+    uint32_t ETH_DropTCPIPChecksumErrorFrame;
+    uint32_t ETH_ReceiveStoreForward;
+    uint32_t ETH_FlushReceivedFrame;
+    uint32_t ETH_TransmitStoreForward;
+    uint32_t ETH_TransmitThresholdControl;
+    uint32_t ETH_ForwardErrorFrames;
+    uint32_t ETH_ForwardUndersizedGoodFrames;
+    uint32_t ETH_ReceiveThresholdControl;
+    uint32_t ETH_SecondFrameOperate;
+    uint32_t ETH_AddressAlignedBeats;
+    uint32_t ETH_FixedBurst;
+    uint32_t ETH_RxDMABurstLength;
+    uint32_t ETH_TxDMABurstLength;
+    uint32_t ETH_DescriptorSkipLength;
+    uint32_t ETH_DMAArbitration;
+} ETH_InitTypeDef;
+
+void ETH_DeInit(void);
+void ETH_SoftwareReset(void);
+void ETH_StructInit(ETH_InitTypeDef *eth);
+void ETH_Start(void);
+void ETH_MACAddressConfig(uint32_t address, uint8_t *mac);
+void ETH_DMAITConfig(uint32_t it, FunctionalState state);
+ITStatus ETH_GetDMAITStatus(uint32_t it);
+void ETH_DMAClearITPendingBit(uint32_t it);
+void ETH_DMARxDescChainInit(ETH_DMADESCTypeDef *desc, uint8_t *buffer, uint32_t count);
+void ETH_DMATxDescChainInit(ETH_DMADESCTypeDef *desc, uint8_t *buffer, uint32_t count);
+
+// PHY
+#define PHY_BMCR          0x00
+#define PHY_BMSR          0x01
+#define PHY_Reset         0x8000
+#define PHY_Linked_Status 0x0004
+
+uint16_t ETH_ReadPHYRegister(uint16_t phy_address, uint16_t reg);
+uint32_t ETH_WritePHYRegister(uint16_t phy_address, uint16_t reg, uint16_t value);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+
+// SysTick ticks per microsecond (HCLK/8)
+#define SIM_TICKS_PER_US 18
+
+// Run the simulated MAC/DMA for one time step, raising ETH_IRQHandler if needed
+void sim_step(void);
+// Run the hardware until an interrupt fires, stands in for wfi
+void sim_idle(void);
+// Move the simulated clock forward without running the hardware
+void sim_advance(uint64_t ticks);
+
+// Traffic source/sink, configured through environment variables (see README)
+void sim_traffic_init(void);
+// Get the next frame to receive, returns 0 once there's nothing left to send
+int sim_traffic_next(uint8_t *frame, uint16_t *len);
+// Called with every frame the MAC transmits
+void sim_traffic_tx(const uint8_t *frame, uint16_t len);
+// Print what was found checking transmitted frames (with SIM_VLAN), returns the exit status
+int sim_traffic_check(void);
+
+// Compare ch32_chksum() against LwIP's checksum and time both, returns the exit status
+int sim_chksum_bench(void);
+// Check log_printf()'s formatting against snprintf() and fill the ring until
+// records get dropped, returns the exit status
+int sim_log_check(void);
+// Check profile_record()'s aggregation and PROFILE_SCOPE against known
+// times, returns the exit status
+int sim_profile_check(void);
+// Hammer the ISR's RX pbuf pool from a second thread, returns the exit status
+int sim_pool_stress(uint32_t frames);
+// Have the driver's PTP hooks check the timestamps it hands out against the
+// ones the MAC wrote, returns nonzero if PTP is disabled
+int sim_ptp_check_start(void);
+// Called by the MAC model with every timestamp it writes
+void sim_ptp_stamped(int tx, uint32_t high, uint32_t low, const uint8_t *frame, uint16_t len);
+// Print the result of the check (if it was started), returns the exit status
+int sim_ptp_check_report(void);
+// Download /capture.pcap again and again while the traffic runs and check
+// the files against what the MAC saw, returns nonzero if capture is disabled
+int sim_capture_check_start(void);
+// Called by the MAC model with every frame it hands to the driver or sends
+void sim_capture_frame(int tx, const uint8_t *frame, uint16_t len);
+// Read some more of the current download, called whenever the main loop goes idle
+void sim_capture_poll(void);
+// Check the downloads (if the check was started), returns the exit status
+int sim_capture_check_report(void);
+// Send datagrams with udp_stream.h whenever the main loop goes idle, returns
+// nonzero if SIM_STREAM_SIZE is too long for a stream
+int sim_stream_check_start(void);
+void sim_stream_poll(void);
+// Called by the MAC model with every frame it sends
+void sim_stream_tx(const uint8_t *frame, uint16_t len);
+// Check every datagram was sent in order or counted as dropped (if the check
+// was started), returns the exit status
+int sim_stream_check_report(void);
+// Set every counter in /stats to its widest and check the response still
+// fits, returns the exit status
+int sim_stats_check(void);
+
+#endif
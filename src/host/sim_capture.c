@@ -0,0 +1,357 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Downloads /capture.pcap through httpd's custom file functions over and over
+ * while traffic is flowing, a few hundred bytes every time the main loop goes
+ * idle, then checks each download once it's all over (SIM_CAPTURE_CHECK=1).
+ * Every download has to be a well formed HTTP response holding a pcap file,
+ * and every record in it a snapshot of a frame the MAC received or sent,
+ * in order, with nothing the filter wanted missing unless the ring was busy.
+ * Timestamps only have to be in order for each direction, with ETH_PTP sent
+ * frames are captured after frames received while they were going out.
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lwip/apps/fs.h>
+
+#include "eth.h"
+#include "eth_capture.h"
+#include "sim.h"
+
+#if ETH_CAPTURE
+#define PCAP_MAGIC    0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+
+struct frame {
+    uint16_t len;
+    uint8_t *data;
+};
+
+struct history {
+    struct frame *frames;
+    uint32_t count;
+};
+
+struct download {
+    char *data;
+    uint32_t len;
+};
+
+static struct {
+    int running;
+    uint32_t chunk;
+    struct eth_capture_config config;
+    // What the MAC received and sent
+    struct history rx;
+    struct history tx;
+
+    // The download in progress
+    int open;
+    struct fs_file file;
+    struct download current;
+
+    struct download *downloads;
+    uint32_t download_count;
+    uint32_t records;
+    uint32_t failures;
+} check;
+
+static void fail(const char *what, uint32_t download) {
+    if (check.failures++ < 20) {
+        printf("Capture: %s (download %u)\n", what, download);
+    }
+}
+
+static uint32_t env_u32(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    return value ? (uint32_t)strtoul(value, NULL, 0) : fallback;
+}
+
+int sim_capture_check_start(void) {
+    check.running = 1;
+    check.chunk = env_u32("SIM_CAPTURE_CHUNK", 256);
+    eth_capture_get_config(&check.config);
+    check.config.snaplen = env_u32("SIM_CAPTURE_SNAPLEN", check.config.snaplen);
+    check.config.ethertype = env_u32("SIM_CAPTURE_ETHERTYPE", check.config.ethertype);
+    check.config.port = env_u32("SIM_CAPTURE_PORT", check.config.port);
+    eth_capture_configure(&check.config);
+    // Clamped to what the ring allows
+    eth_capture_get_config(&check.config);
+    return 0;
+}
+
+void sim_capture_frame(int tx, const uint8_t *frame, uint16_t len) {
+    if (!check.running) {
+        return;
+    }
+
+    struct history *history = tx ? &check.tx : &check.rx;
+    history->frames = realloc(history->frames, (history->count + 1) * sizeof(struct frame));
+    struct frame *f = &history->frames[history->count++];
+    f->len = len;
+    f->data = malloc(len);
+    memcpy(f->data, frame, len);
+}
+
+static int open_download(void) {
+    if (!fs_open_custom(&check.file, "/capture.pcap")) {
+        fail("couldn't open /capture.pcap", check.download_count);
+        return 0;
+    }
+
+    // Only one at a time
+    struct fs_file other;
+    if (fs_open_custom(&other, "/capture.pcap")) {
+        fail("opened /capture.pcap twice", check.download_count);
+        fs_close_custom(&other);
+    }
+
+    check.open = 1;
+    check.current.data = malloc(check.file.len);
+    check.current.len = 0;
+    return 1;
+}
+
+// Returns 0 once the download is finished
+static int read_download(uint32_t size) {
+    if (size > check.file.len - check.current.len) {
+        size = check.file.len - check.current.len;
+    }
+    int n = fs_read_custom(&check.file, &check.current.data[check.current.len], size);
+    if (n > 0) {
+        check.current.len += n;
+    }
+    if (n > 0 && check.current.len < (uint32_t)check.file.len) {
+        return 1;
+    }
+
+    fs_close_custom(&check.file);
+    check.open = 0;
+    check.downloads = realloc(check.downloads, (check.download_count + 1) * sizeof(struct download));
+    check.downloads[check.download_count++] = check.current;
+    return 0;
+}
+
+void sim_capture_poll(void) {
+    if (!check.running) {
+        return;
+    }
+    if (check.open || open_download()) {
+        read_download(check.chunk);
+    }
+}
+
+// memmem() isn't standard
+static const char *find(const char *data, uint32_t len, const char *text) {
+    uint32_t text_len = strlen(text);
+    for (uint32_t i = 0; i + text_len <= len; i++) {
+        if (memcmp(&data[i], text, text_len) == 0) {
+            return &data[i];
+        }
+    }
+    return NULL;
+}
+
+static uint16_t read16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Written separately from eth_capture.c's, so the two can be compared
+static int filter_wants(const uint8_t *frame, uint16_t len) {
+    uint16_t type = read16(&frame[12]);
+    const uint8_t *ip = &frame[14];
+    if (type == 0x8100) {
+        type = read16(&frame[16]);
+        ip = &frame[18];
+    }
+    if (check.config.ethertype != 0 && type != check.config.ethertype) {
+        return 0;
+    }
+    if (check.config.port == 0) {
+        return 1;
+    }
+    if (type != 0x0800 || (read16(&ip[6]) & 0x1FFF) != 0 || (ip[9] != 6 && ip[9] != 17)) {
+        return 0;
+    }
+    const uint8_t *ports = &ip[(ip[0] & 0x0F) * 4];
+    return ports + 4 <= frame + len && (read16(ports) == check.config.port || read16(&ports[2]) == check.config.port);
+}
+
+struct cursor {
+    const struct history *history;
+    uint32_t next;
+    int matched;
+    uint64_t last_time;
+};
+
+// Find the frame a record was taken from, returns the number of frames the
+// filter wanted that were skipped on the way or -1 if there isn't one
+static int32_t match(struct cursor *cursor, const uint8_t *data, uint32_t captured, uint32_t length) {
+    int32_t skipped = 0;
+    for (uint32_t i = cursor->next; i < cursor->history->count; i++) {
+        const struct frame *f = &cursor->history->frames[i];
+        if (f->len == length && memcmp(f->data, data, captured) == 0) {
+            cursor->next = i + 1;
+            // Anything before the first record was overwritten
+            if (!cursor->matched) {
+                skipped = 0;
+            }
+            cursor->matched = 1;
+            return skipped;
+        }
+        skipped += filter_wants(f->data, f->len);
+    }
+    return -1;
+}
+
+static void check_download(const struct download *download, uint32_t index) {
+    const char *body = find(download->data, download->len, "\r\n\r\n");
+    if (body == NULL || strncmp(download->data, "HTTP/1.1 200 OK\r\n", 17) != 0) {
+        fail("bad HTTP header", index);
+        return;
+    }
+    body += 4;
+    const char *length = find(download->data, body - download->data, "Content-Length: ");
+    uint32_t size = download->len - (body - download->data);
+    if (length == NULL || strtoul(length + 16, NULL, 10) != size) {
+        fail("Content-Length doesn't match the body", index);
+        return;
+    }
+
+    uint32_t header[6];
+    if (size < sizeof(header)) {
+        fail("no pcap header", index);
+        return;
+    }
+    memcpy(header, body, sizeof(header));
+    uint32_t magic = ETH_PTP ? PCAP_MAGIC_NS : PCAP_MAGIC;
+    uint32_t fraction_limit = ETH_PTP ? 1000000000 : 1000000;
+    if (header[0] != magic || header[1] != 0x00040002 || header[4] < check.config.snaplen || header[5] != 1) {
+        fail("bad pcap header", index);
+        return;
+    }
+
+    struct cursor rx = { .history = &check.rx };
+    struct cursor tx = { .history = &check.tx };
+    uint32_t gaps = 0;
+    for (uint32_t offset = sizeof(header); offset != size;) {
+        uint32_t record[4];
+        if (size - offset < sizeof(record)) {
+            fail("record header cut short", index);
+            return;
+        }
+        memcpy(record, &body[offset], sizeof(record));
+        offset += sizeof(record);
+        uint32_t captured = record[2];
+        uint32_t len = record[3];
+        if (size - offset < captured) {
+            fail("record cut short", index);
+            return;
+        }
+        if (captured != (len < check.config.snaplen ? len : check.config.snaplen) || captured > header[4]) {
+            fail("record isn't the snapshot length", index);
+        }
+        uint64_t time = (uint64_t)record[0] * fraction_limit + record[1];
+        if (record[1] >= fraction_limit) {
+            fail("bad timestamp", index);
+        }
+
+        const uint8_t *data = (const uint8_t *)&body[offset];
+        offset += captured;
+        check.records++;
+        if (!filter_wants(data, captured)) {
+            fail("record the filter doesn't want", index);
+        }
+        struct cursor *cursor = &rx;
+        int32_t skipped = match(cursor, data, captured, len);
+        if (skipped < 0) {
+            cursor = &tx;
+            skipped = match(cursor, data, captured, len);
+        }
+        if (skipped < 0) {
+            fail("record doesn't match a frame", index);
+            continue;
+        }
+        gaps += skipped;
+        if (time < cursor->last_time) {
+            fail("timestamp out of order", index);
+        }
+        cursor->last_time = time;
+    }
+
+    if (gaps > eth_capture_stats.busy) {
+        fail("frames missing", index);
+    }
+}
+
+int sim_capture_check_report(void) {
+    if (!check.running) {
+        return 0;
+    }
+
+    // Finish the download that's going and take one more of what's left
+    while (check.open && read_download(check.chunk));
+    if (open_download()) {
+        while (read_download(check.chunk));
+    }
+
+    for (uint32_t i = 0; i < check.download_count; i++) {
+        check_download(&check.downloads[i], i);
+    }
+    if (check.download_count == 0 || check.records == 0) {
+        fail("nothing captured", 0);
+    }
+
+    // The last one, for a closer look
+    const char *path = getenv("SIM_CAPTURE_PCAP");
+    if (path != NULL && check.download_count != 0) {
+        const struct download *last = &check.downloads[check.download_count - 1];
+        const char *body = find(last->data, last->len, "\r\n\r\n");
+        FILE *file = fopen(path, "wb");
+        if (body != NULL && file != NULL) {
+            body += 4;
+            fwrite(body, 1, last->len - (body - last->data), file);
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+
+    printf("Capture: %u downloads, %u records checked, %u captured, %u overwritten, %u busy, %u failures\n",
+        check.download_count, check.records, eth_capture_stats.captured, eth_capture_stats.overwritten,
+        eth_capture_stats.busy, check.failures);
+    return check.failures != 0;
+}
+#else
+int sim_capture_check_start(void) {
+    printf("Error: capture is disabled, set ETH_CAPTURE=1\n");
+    return 1;
+}
+
+void sim_capture_frame(int tx, const uint8_t *frame, uint16_t len) {
+    (void)tx;
+    (void)frame;
+    (void)len;
+}
+
+void sim_capture_poll(void) {
+}
+
+int sim_capture_check_report(void) {
+    return 0;
+}
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Checks ch32_chksum() against LwIP's own implementation for every length
+ * and alignment a frame can have, then times both (SIM_CHKSUM_BENCH=1).
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "arch/cc.h"
+#include "sim.h"
+
+// From LwIP's inet_chksum.c (LWIP_CHKSUM_ALGORITHM in lwipopts.h)
+uint16_t lwip_standard_chksum(const void *data, int len);
+
+#define BENCH_SIZE 1514
+#define BENCH_ROUNDS 200000
+
+typedef uint16_t (*chksum_fn)(const void *data, int len);
+
+static double bench(chksum_fn fn, const uint8_t *data, int len, uint16_t *result) {
+    struct timespec start, end;
+    uint32_t acc = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        // Keep the compiler from hoisting the call out of the loop
+        __asm__ volatile("" ::: "memory");
+        acc += fn(data, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *result = acc;
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    return ns / BENCH_ROUNDS;
+}
+
+int sim_chksum_bench(void) {
+    static uint8_t buffer[BENCH_SIZE + 8] __attribute__((aligned(4)));
+    srand(1);
+    for (uint32_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = rand();
+    }
+
+    uint32_t failures = 0;
+    for (int offset = 0; offset < 4; offset++) {
+        for (int len = 0; len <= BENCH_SIZE; len++) {
+            uint16_t expected = lwip_standard_chksum(&buffer[offset], len);
+            uint16_t actual = ch32_chksum(&buffer[offset], len);
+            if (expected != actual) {
+                if (failures++ < 10) {
+                    printf("Mismatch: offset %d length %d, expected %04X got %04X\n", offset, len, expected, actual);
+                }
+            }
+        }
+    }
+
+    // All ones is the worst case for carries
+    static uint8_t ones[BENCH_SIZE] __attribute__((aligned(4)));
+    for (uint32_t i = 0; i < sizeof(ones); i++) {
+        ones[i] = 0xFF;
+    }
+    if (lwip_standard_chksum(ones, sizeof(ones)) != ch32_chksum(ones, sizeof(ones))) {
+        printf("Mismatch: all ones\n");
+        failures++;
+    }
+    printf("Checksum: %u mismatches\n", failures);
+
+    const int sizes[] = { 20, 64, 576, BENCH_SIZE };
+    printf("%-8s %12s %12s\n", "length", "lwip (ns)", "ch32 (ns)");
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint16_t a, b;
+        double reference = bench(lwip_standard_chksum, buffer, sizes[i], &a);
+        double ours = bench(ch32_chksum, buffer, sizes[i], &b);
+        printf("%-8d %12.1f %12.1f\n", sizes[i], reference, ours);
+    }
+
+    return failures != 0;
+}
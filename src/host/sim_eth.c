@@ -0,0 +1,743 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Software model of the CH32V307 Ethernet MAC, its DMA engine and the
+ * internal 10BASE-T PHY. The hardware is stepped from sys_now() and
+ * sys_idle(), so the "interrupts" can only preempt the main loop at those points.
+ *
+ * Limitations:
+ *  - Writes to DMASR are only seen as write-1-to-clear when the value
+ *    differs from what was last published, or alongside a poll demand
+ *  - Address filtering isn't modelled, every frame is received. The VLAN tag
+ *    comparator only flags frames, like the real one
+ *  - Checksum offload only checks the IPv4 header, payloads of unfragmented
+ *    TCP/UDP/ICMP frames are reported as good without being looked at
+ *  - Every received frame gets a PTP timestamp, taken when it's written to
+ *    memory rather than when its start of frame delimiter went past
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lwip/stats.h>
+
+#include "sim.h"
+#include "eth.h"
+#include "eth_classify.h"
+#include "log.h"
+#include "ping_latency.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "sys_arch.h"
+
+// Written by the simulation after every step, zeroed by the driver to request a poll
+#define POLL_IDLE 1
+
+extern void ETH_IRQHandler(void);
+extern void SysTick_Handler(void);
+
+SysTick_Type sim_systick;
+EXTEN_TypeDef sim_exten;
+ETH_TypeDef sim_eth;
+uint32_t SystemCoreClock = 144000000;
+const uint8_t sim_esig_uid[12] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x02 };
+ETH_DMADESCTypeDef *DMATxDescToSet;
+ETH_DMADESCTypeDef *DMARxDescToGet;
+
+static struct {
+    int initialized;
+    // Traffic's over and the checks are running, the MAC stands still
+    int finished;
+    int in_irq;
+    int irq_enabled;
+    int in_systick;
+    int systick_enabled;
+    uint64_t step_ticks;
+    uint32_t mbps;
+    uint32_t crc_error_every;
+    uint64_t tx_cost_ticks;
+
+    // DMA
+    uint32_t status;
+    ETH_DMADESCTypeDef *rx;
+    ETH_DMADESCTypeDef *tx;
+    int rx_running;
+    int rx_suspended;
+    int tx_running;
+    int tx_suspended;
+    uint8_t tx_frame[ETH_MAX_PACKET_SIZE];
+    uint32_t tx_len;
+    int tx_timestamp;
+
+    // PTP clock in units of 2^-31 s (seconds above bit 31)
+    uint64_t ptp_time;
+    uint32_t ptp_addend;
+    uint32_t ptp_accumulator;
+    // SysTick->CNT the clock was last brought up to
+    uint64_t ptp_ticks;
+
+    // PHY
+    uint16_t phy[32];
+    int link_reported;
+    // When the PHY comes out of reset, 0 if it isn't in it
+    uint64_t phy_reset_done;
+
+    // Traffic
+    uint8_t frame[ETH_MAX_PACKET_SIZE];
+    uint16_t frame_len;
+    int have_frame;
+    int traffic_done;
+    uint64_t next_arrival;
+    uint64_t idle_since;
+
+    // Stats
+    uint32_t rx_frames;
+    uint32_t rx_missed;
+    uint32_t rx_stalls;
+    uint32_t tx_frames;
+    uint32_t irqs;
+    uint32_t systick_irqs;
+    uint64_t idle_ticks;
+    struct timespec start;
+} sim;
+
+static uint32_t env_u32(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    return value ? (uint32_t)strtoul(value, NULL, 0) : fallback;
+}
+
+static int pool_stress(void) {
+    return sim_pool_stress(env_u32("SIM_POOL_STRESS", 0));
+}
+
+// Checks turned on by an environment variable (see README), each one is a
+// ctest in CMakeLists.txt. They either run instead of the traffic and exit,
+// or start before it and report once it's over.
+static const struct sim_mode {
+    const char *name;
+    // Returns the exit status
+    int (*run)(void);
+    // Returns nonzero if the check can't run with this build
+    int (*start)(void);
+    // Returns the exit status
+    int (*report)(void);
+} sim_modes[] = {
+    { "SIM_CHKSUM_BENCH", .run = sim_chksum_bench },
+    { "SIM_LOG_CHECK", .run = sim_log_check },
+    { "SIM_PROFILE_CHECK", .run = sim_profile_check },
+    { "SIM_POOL_STRESS", .run = pool_stress },
+    { "SIM_PTP_CHECK", .start = sim_ptp_check_start, .report = sim_ptp_check_report },
+    { "SIM_CAPTURE_CHECK", .start = sim_capture_check_start, .report = sim_capture_check_report },
+    { "SIM_STREAM", .start = sim_stream_check_start, .report = sim_stream_check_report },
+    // Last, it overwrites the counters
+    { "SIM_STATS_CHECK", .report = sim_stats_check },
+};
+
+#define SIM_MODE_COUNT (sizeof(sim_modes) / sizeof(sim_modes[0]))
+
+static void sim_init(void) {
+    sim.initialized = 1;
+    sim.step_ticks = env_u32("SIM_STEP_US", 1) * SIM_TICKS_PER_US;
+    sim.mbps = env_u32("SIM_MBPS", 10);
+    sim.crc_error_every = env_u32("SIM_CRC_ERROR_EVERY", 0);
+    sim.tx_cost_ticks = env_u32("SIM_TX_COST_US", 0) * SIM_TICKS_PER_US;
+    clock_gettime(CLOCK_MONOTONIC, &sim.start);
+    for (uint32_t i = 0; i < SIM_MODE_COUNT; i++) {
+        const struct sim_mode *mode = &sim_modes[i];
+        if (getenv(mode->name) == NULL) {
+            continue;
+        }
+        if (mode->run != NULL) {
+            exit(mode->run());
+        }
+        if (mode->start != NULL && mode->start() != 0) {
+            exit(1);
+        }
+    }
+    sim_traffic_init();
+}
+
+static void sim_report(void) {
+    // Whatever the log task didn't get to yet
+    log_flush();
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - sim.start.tv_sec) + (end.tv_nsec - sim.start.tv_nsec) / 1e9;
+
+    printf("Simulated time:    %.3f s\n", SysTick->CNT / (SIM_TICKS_PER_US * 1e6));
+    printf("Wall time:         %.3f s\n", seconds);
+    printf("RX frames:         %u (%.0f frames/s)\n", sim.rx_frames, sim.rx_frames / seconds);
+    printf("RX missed:         %u\n", sim.rx_missed);
+    printf("RX ring stalls:    %u\n", sim.rx_stalls);
+    printf("TX frames:         %u\n", sim.tx_frames);
+    printf("Interrupts:        %u\n", sim.irqs);
+    printf("SysTick:           %u\n", sim.systick_irqs);
+    printf("Idle:              %.1f%%\n", 100.0 * sim.idle_ticks / SysTick->CNT);
+#if LINK_STATS
+    printf("LwIP link recv:    %u\n", (unsigned)lwip_stats.link.recv);
+    printf("LwIP link xmit:    %u\n", (unsigned)lwip_stats.link.xmit);
+    printf("LwIP link drop:    %u\n", (unsigned)lwip_stats.link.drop);
+#endif
+    printf("RX interrupts:     %u\n", eth_stats.rx_interrupts);
+    printf("RX polled:         %u\n", eth_stats.rx_polled);
+    printf("RX CRC errors:     %u\n", eth_stats.rx_crc_errors);
+    printf("RX overflows:      %u\n", eth_stats.rx_overflow_errors);
+    printf("RX runts:          %u\n", eth_stats.rx_runt_errors);
+    printf("RX length errors:  %u\n", eth_stats.rx_length_errors);
+    printf("RX other errors:   %u\n", eth_stats.rx_other_errors);
+    printf("RX SW checksums:   %u\n", eth_stats.rx_sw_checksum);
+    printf("RX queue max:      %u\n", eth_stats.rx_queue_max);
+    printf("RX queue drop:     %u\n", eth_stats.rx_queue_drop);
+    printf("RX pool empty:     %u\n", eth_stats.rx_pool_empty);
+    printf("RX VLAN dropped:   %u\n", eth_stats.rx_vlan_dropped);
+    printf("TX queued:         %u\n", eth_stats.tx_queued);
+    printf("TX queue max:      %u\n", eth_stats.tx_queue_max);
+    printf("TX queue drop:     %u\n", eth_stats.tx_queue_drop);
+    printf("Log records:       %u\n", log_stats.written);
+    printf("Log dropped:       %u\n", log_stats.dropped);
+    printf("Boot to MAC up:    %u us\n", eth_stats.boot_up_us);
+    printf("Boot to first RX:  %u us\n", eth_stats.boot_first_rx_us);
+    printf("Boot to first TX:  %u us\n", eth_stats.boot_first_tx_us);
+#if ETH_PTP
+    const struct ping_latency_stats *ping = &ping_latency_stats;
+    printf("Ping samples:      %u\n", ping->samples);
+    printf("Ping unmatched:    %u\n", ping->unmatched);
+    printf("Ping latency:      %u/%u/%u ns (min/mean/max)\n", ping->min_ns,
+        ping->samples ? (unsigned)(ping->total_ns / ping->samples) : 0, ping->max_ns);
+#endif
+
+#if ETH_CLASSIFY
+    printf("\n%-10s %10s %10s %10s\n", "class", "frames", "rate drop", "pressure");
+    for (int i = 0; i < ETH_CLASS_COUNT; i++) {
+        const struct eth_class_stats *class = &eth_class_stats[i];
+        printf("%-10s %10u %10u %10u\n", eth_class_names[i], class->frames, class->rate_drops, class->pressure_drops);
+    }
+#endif
+
+    printf("\n%-8s %10s %10s %10s %10s %10s\n", "task", "runs", "mean (us)", "max (us)", "latency", "overruns");
+    for (int i = 0; i < SCHED_MAX_TASKS; i++) {
+        const struct sched_task *task = &sched_tasks[i];
+        if (task->fn == NULL) {
+            continue;
+        }
+        uint64_t mean = task->runs ? task->total_run / task->runs : 0;
+        printf("%-8s %10u %10u %10u %10u %10u\n", task->name, task->runs, (unsigned)(mean / SYS_TICKS_PER_US),
+            task->max_run / SYS_TICKS_PER_US, task->max_latency / SYS_TICKS_PER_US, task->overruns);
+    }
+#if PROFILE
+    printf("\nTimings (ns):\n");
+    profile_print();
+#endif
+}
+
+// Bring the PTP clock up to the current time and carry out any updates the
+// driver asked for
+static void run_ptp(void) {
+    uint64_t ticks = SysTick->CNT - sim.ptp_ticks;
+    sim.ptp_ticks = SysTick->CNT;
+
+    uint32_t control = ETH->PTPTSCR;
+    if ((control & ETH_PTPTSCR_TSE) == 0) {
+        return;
+    }
+
+    // Every HCLK cycle (8 SysTick ticks) either adds the increment to the
+    // clock (coarse) or the addend to the accumulator, whose overflows do (fine)
+    uint64_t cycles = ticks * 8;
+    if (control & ETH_PTPTSCR_TSFCU) {
+        unsigned __int128 sum = sim.ptp_accumulator + (unsigned __int128)cycles * sim.ptp_addend;
+        sim.ptp_time += (uint64_t)(sum >> 32) * ETH->PTPSSIR;
+        sim.ptp_accumulator = (uint32_t)sum;
+    } else {
+        sim.ptp_time += cycles * ETH->PTPSSIR;
+    }
+
+    // Updates complete straight away
+    if (control & ETH_PTPTSCR_TSARU) {
+        sim.ptp_addend = ETH->PTPTSAR;
+        control &= ~ETH_PTPTSCR_TSARU;
+    }
+    if (control & ETH_PTPTSCR_TSSTI) {
+        sim.ptp_time = ((uint64_t)ETH->PTPTSHUR << 31) | (ETH->PTPTSLUR & 0x7FFFFFFF);
+        control &= ~ETH_PTPTSCR_TSSTI;
+    }
+    ETH->PTPTSCR = control;
+    ETH->PTPTSHR = (uint32_t)(sim.ptp_time >> 31);
+    ETH->PTPTSLR = (uint32_t)sim.ptp_time & 0x7FFFFFFF;
+}
+
+// Write the current time over the buffer and next descriptor addresses, the
+// caller has to have read the next descriptor already
+static void ptp_stamp(ETH_DMADESCTypeDef *desc, int tx, const uint8_t *frame, uint16_t len) {
+    run_ptp();
+    desc->Buffer1Addr = ETH->PTPTSLR;
+    desc->Buffer2NextDescAddr = ETH->PTPTSHR;
+#if ETH_PTP
+    sim_ptp_stamped(tx, ETH->PTPTSHR, ETH->PTPTSLR, frame, len);
+#else
+    (void)tx;
+    (void)frame;
+    (void)len;
+#endif
+}
+
+static void publish_status(void) {
+    // Only enabled interrupts feed into the summary
+    if (sim.status & ETH->DMAIER & (ETH_DMASR_TS | ETH_DMASR_RS)) {
+        sim.status |= ETH_DMASR_NIS;
+    }
+    ETH->DMASR = sim.status;
+}
+
+// Pick up writes the driver made directly to the registers
+static void sync_registers(void) {
+    if (ETH->DMASR != sim.status) {
+        sim.status &= ~ETH->DMASR;
+    }
+    if (ETH->DMARPDR != POLL_IDLE) {
+        sim.status &= ~ETH_DMASR_RBUS;
+        sim.rx_suspended = 0;
+    }
+    if (ETH->DMATPDR != POLL_IDLE) {
+        sim.status &= ~ETH_DMASR_TBUS;
+        sim.tx_suspended = 0;
+    }
+    ETH->DMARPDR = POLL_IDLE;
+    ETH->DMATPDR = POLL_IDLE;
+    publish_status();
+}
+
+// VLAN tag comparator, flags tagged frames with the ID in MACVLANTR (any ID if it's 0)
+static uint32_t rx_vlan_status(const uint8_t *frame) {
+    if (((frame[12] << 8) | frame[13]) != 0x8100) {
+        return 0;
+    }
+    uint32_t filter = ETH->MACVLANTR;
+    uint16_t tag = (frame[14] << 8) | frame[15];
+    uint16_t mask = (filter & ETH_VLANTagComparison_12Bit) ? 0xFFF : 0xFFFF;
+    if ((filter & mask) == 0 || (tag & mask) == (filter & mask)) {
+        return ETH_DMARxDesc_VLAN;
+    }
+    return 0;
+}
+
+// Checksum offload status bits for the last descriptor of a frame
+static uint32_t rx_checksum_status(const uint8_t *frame, uint16_t len) {
+    // The checksum engine looks past VLAN tags
+    if (len >= 18 && ((frame[12] << 8) | frame[13]) == 0x8100) {
+        frame += 4;
+        len -= 4;
+    }
+    uint16_t type = (frame[12] << 8) | frame[13];
+    // IEEE 802.3, a length rather than an ethertype
+    if (type < 0x600) {
+        return 0;
+    }
+    if (type == 0x86DD) {
+        return ETH_DMARxDesc_FT;
+    }
+    if (type != 0x0800 || len < 34) {
+        // Neither IPv4 nor IPv6, bypassed
+        return ETH_DMARxDesc_IPV4HCE | ETH_DMARxDesc_MAMPCE;
+    }
+
+    const uint8_t *ip = &frame[14];
+    uint32_t header_len = (ip[0] & 0x0F) * 4;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < header_len && 14 + i + 1 < len; i += 2) {
+        sum += (ip[i] << 8) | ip[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    if (sum != 0xFFFF) {
+        return ETH_DMARxDesc_FT | ETH_DMARxDesc_IPV4HCE;
+    }
+
+    // Fragments and unknown protocols have their payload bypassed
+    int fragment = ((ip[6] & 0x3F) | ip[7]) != 0;
+    int known = ip[9] == 1 || ip[9] == 6 || ip[9] == 17;
+    if (fragment || !known) {
+        return ETH_DMARxDesc_MAMPCE;
+    }
+    return ETH_DMARxDesc_FT;
+}
+
+static void receive_frame(const uint8_t *frame, uint16_t len) {
+    // Room for the CRC, which is left as zeros
+    uint32_t total = len + 4;
+    // IEEE 802.3 frames have their padding and CRC stripped
+    uint16_t type = (frame[12] << 8) | frame[13];
+    if ((ETH->MACCR & ETH_AutomaticPadCRCStrip_Enable) && type <= 1500 && 14 + type <= len) {
+        len = 14 + type;
+        total = len;
+    }
+
+    // A suspended DMA also fetches the descriptor again when the next frame
+    // arrives, not just on a poll demand
+    ETH_DMADESCTypeDef *desc = sim.rx;
+    if (sim.rx_suspended && (desc->Status & ETH_DMARxDesc_OWN)) {
+        sim.rx_suspended = 0;
+    }
+
+    // Make sure the whole frame fits before touching any descriptors
+    uint32_t space = 0;
+    for (int i = 0; !sim.rx_suspended && i < ETH_RX_RING_SIZE && space < total; i++) {
+        if ((desc->Status & ETH_DMARxDesc_OWN) == 0) {
+            break;
+        }
+        space += desc->ControlBufferSize & ETH_DMARxDesc_RBS1;
+        desc = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+    }
+    if (space < total) {
+        if (!sim.rx_suspended) {
+            sim.rx_suspended = 1;
+            sim.rx_stalls++;
+            sim.status |= ETH_DMASR_RBUS;
+        }
+        sim.rx_missed++;
+        if ((ETH->DMAMFBOCR & 0xFFFF) != 0xFFFF) {
+            ETH->DMAMFBOCR++;
+        }
+        return;
+    }
+
+    uint32_t offset = 0;
+    while (offset < total) {
+        desc = sim.rx;
+        uint32_t size = desc->ControlBufferSize & ETH_DMARxDesc_RBS1;
+        uint32_t chunk = total - offset < size ? total - offset : size;
+
+        uint8_t *buffer = (uint8_t *)desc->Buffer1Addr;
+        for (uint32_t i = 0; i < chunk; i++) {
+            buffer[i] = offset + i < len ? frame[offset + i] : 0;
+        }
+
+        uint32_t status = offset == 0 ? ETH_DMARxDesc_FS : 0;
+        offset += chunk;
+        if (offset == total) {
+            status |= ETH_DMARxDesc_LS | (total << 16) | rx_checksum_status(frame, len) | rx_vlan_status(frame);
+            // Corrupt every Nth frame
+            if (sim.crc_error_every && sim.rx_frames % sim.crc_error_every == sim.crc_error_every - 1) {
+                status |= ETH_DMARxDesc_ES | ETH_DMARxDesc_CE;
+            }
+        }
+        sim.rx = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+        if (offset == total && (ETH->PTPTSCR & ETH_PTPTSCR_TSE)) {
+            ptp_stamp(desc, 0, frame, len);
+        }
+        desc->Status = status;
+    }
+
+    if ((desc->Status & ETH_DMARxDesc_ES) == 0) {
+        sim_capture_frame(0, frame, len);
+    }
+    sim.rx_frames++;
+    sim.status |= ETH_DMASR_RS;
+}
+
+static void run_rx(void) {
+    if (!sim.rx_running) {
+        return;
+    }
+
+    while (!sim.traffic_done && SysTick->CNT >= sim.next_arrival) {
+        if (!sim.have_frame) {
+            if (!sim_traffic_next(sim.frame, &sim.frame_len)) {
+                sim.traffic_done = 1;
+                sim.idle_since = SysTick->CNT;
+                break;
+            }
+            sim.have_frame = 1;
+            // Preamble, SFD, CRC and inter-frame gap
+            uint32_t bits = (sim.frame_len + 24) * 8;
+            sim.next_arrival += (uint64_t)bits * SIM_TICKS_PER_US / sim.mbps;
+            continue;
+        }
+
+        receive_frame(sim.frame, sim.frame_len);
+        sim.have_frame = 0;
+    }
+}
+
+static void run_tx(void) {
+    if (!sim.tx_running || sim.tx_suspended) {
+        return;
+    }
+
+    while (sim.tx->Status & ETH_DMATxDesc_OWN) {
+        uint32_t status = sim.tx->Status;
+        if (status & ETH_DMATxDesc_FS) {
+            sim.tx_len = 0;
+            sim.tx_timestamp = (status & ETH_DMATxDesc_TTSE) && (ETH->PTPTSCR & ETH_PTPTSCR_TSE);
+        }
+
+        uint32_t size = sim.tx->ControlBufferSize & ETH_DMATxDesc_TBS1;
+        if (sim.tx_len + size <= sizeof(sim.tx_frame)) {
+            memcpy(&sim.tx_frame[sim.tx_len], (const uint8_t *)sim.tx->Buffer1Addr, size);
+            sim.tx_len += size;
+        }
+
+        if (status & ETH_DMATxDesc_LS) {
+            sim_traffic_tx(sim.tx_frame, sim.tx_len);
+            sim_capture_frame(1, sim.tx_frame, sim.tx_len);
+            sim_stream_tx(sim.tx_frame, sim.tx_len);
+            sim.tx_frames++;
+            // Stands in for the time the main loop took to produce the frame,
+            // frames keep arriving in the meantime
+            sim_advance(sim.tx_cost_ticks);
+            if (status & ETH_DMATxDesc_IC) {
+                sim.status |= ETH_DMASR_TS;
+            }
+        }
+
+        ETH_DMADESCTypeDef *desc = sim.tx;
+        sim.tx = (ETH_DMADESCTypeDef *)desc->Buffer2NextDescAddr;
+        if ((status & ETH_DMATxDesc_LS) && sim.tx_timestamp) {
+            ptp_stamp(desc, 1, sim.tx_frame, sim.tx_len);
+            status |= ETH_DMATxDesc_TTSS;
+        }
+        desc->Status = status & ~ETH_DMATxDesc_OWN;
+    }
+
+    // Nothing left to send, suspend until the next poll demand
+    sim.tx_suspended = 1;
+    sim.status |= ETH_DMASR_TBUS;
+}
+
+void sim_advance(uint64_t ticks) {
+    SysTick->CNT += ticks;
+}
+
+// SysTick compare/software interrupt
+static void run_systick(void) {
+    uint32_t ctlr = SysTick->CTLR;
+    if (!sim.systick_enabled || sim.in_systick || !(ctlr & SYSTICK_CTLR_STE) || !(ctlr & SYSTICK_CTLR_STIE)) {
+        return;
+    }
+    if ((ctlr & SYSTICK_CTLR_SWIE) || SysTick->CNT >= SysTick->CMP) {
+        sim.systick_irqs++;
+        sim.in_systick = 1;
+        SysTick_Handler();
+        sim.in_systick = 0;
+    }
+}
+
+void sim_step(void) {
+    sim_advance(sim.step_ticks ? sim.step_ticks : SIM_TICKS_PER_US);
+    // The ISR doesn't get preempted by itself
+    if (sim.in_irq || sim.finished) {
+        return;
+    }
+    // Before the rx_running check, bring-up waits on the clock's updates
+    run_ptp();
+    run_systick();
+    if (!sim.rx_running) {
+        return;
+    }
+    if (!sim.initialized) {
+        sim_init();
+    }
+
+    sync_registers();
+    run_tx();
+    run_rx();
+
+    if (!sim.link_reported && (sim.phy[PHY_BMSR] & PHY_Linked_Status)) {
+        sim.link_reported = 1;
+        sim.status |= ETH_DMA_IT_PHYLINK;
+    }
+    publish_status();
+
+    uint32_t pending = sim.status & ETH->DMAIER & (ETH_DMA_IT_T | ETH_DMA_IT_R | ETH_DMA_IT_PHYLINK);
+    if (sim.irq_enabled && (ETH->DMAIER & ETH_DMA_IT_NIS) && pending) {
+        sim.irqs++;
+        sim.in_irq = 1;
+        ETH_IRQHandler();
+        sim.in_irq = 0;
+    }
+
+    // Give the stack 100ms to finish up once the traffic has run out
+    if (sim.traffic_done && SysTick->CNT - sim.idle_since > 100000 * SIM_TICKS_PER_US) {
+        sim.finished = 1;
+        sim_report();
+        int failed = sim_traffic_check();
+        for (uint32_t i = 0; i < SIM_MODE_COUNT; i++) {
+            const struct sim_mode *mode = &sim_modes[i];
+            if (mode->report != NULL && getenv(mode->name) != NULL) {
+                failed |= mode->report();
+            }
+        }
+        exit(failed);
+    }
+}
+
+void sim_idle(void) {
+    uint64_t start = SysTick->CNT;
+    uint32_t irqs = sim.irqs + sim.systick_irqs;
+    // Like httpd sending the next part of a download
+    sim_capture_poll();
+    // Like the application sending telemetry
+    sim_stream_poll();
+    while (sim.irqs + sim.systick_irqs == irqs) {
+        sim_step();
+    }
+    sim.idle_ticks += SysTick->CNT - start;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    if (irq == SysTicK_IRQn) {
+        sim.systick_enabled = 1;
+    } else {
+        sim.irq_enabled = 1;
+    }
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    if (irq == SysTicK_IRQn) {
+        sim.systick_enabled = 0;
+    } else {
+        sim.irq_enabled = 0;
+    }
+}
+
+void USART_Printf_Init(uint32_t baudrate) {
+    (void)baudrate;
+}
+
+void RCC_AHBPeriphClockCmd(uint32_t periph, FunctionalState state) {
+    (void)periph;
+    (void)state;
+}
+
+void RCC_PREDIV2Config(uint32_t div) {
+    (void)div;
+}
+
+void RCC_PLL3Config(uint32_t mul) {
+    (void)mul;
+}
+
+void RCC_PLL3Cmd(FunctionalState state) {
+    (void)state;
+}
+
+FlagStatus RCC_GetFlagStatus(uint8_t flag) {
+    (void)flag;
+    return SET;
+}
+
+void ETH_DeInit(void) {
+    memset(&sim_eth, 0, sizeof(sim_eth));
+    sim.status = 0;
+    sim.ptp_time = 0;
+    sim.ptp_addend = 0;
+    sim.ptp_accumulator = 0;
+    sim.rx_running = 0;
+    sim.tx_running = 0;
+}
+
+void ETH_SoftwareReset(void) {
+    // Completes instantly
+    ETH_DeInit();
+}
+
+void ETH_StructInit(ETH_InitTypeDef *eth) {
+    memset(eth, 0, sizeof(*eth));
+    eth->ETH_Mode = ETH_Mode_FullDuplex;
+    eth->ETH_Speed = ETH_Speed_10M;
+}
+
+void ETH_Start(void) {
+    sim.rx_running = 1;
+    sim.tx_running = 1;
+    // Give the application time to bring up the netif before traffic starts
+    sim.next_arrival = SysTick->CNT + env_u32("SIM_START_US", 100000) * SIM_TICKS_PER_US;
+}
+
+void ETH_MACAddressConfig(uint32_t address, uint8_t *mac) {
+    (void)address;
+    ETH->MACA0HR = ((uint32_t)mac[5] << 8) | mac[4];
+    ETH->MACA0LR = ((uint32_t)mac[3] << 24) | ((uint32_t)mac[2] << 16) | ((uint32_t)mac[1] << 8) | mac[0];
+}
+
+void ETH_DMAITConfig(uint32_t it, FunctionalState state) {
+    if (state == ENABLE) {
+        ETH->DMAIER |= it;
+    } else {
+        ETH->DMAIER &= ~it;
+    }
+}
+
+ITStatus ETH_GetDMAITStatus(uint32_t it) {
+    sync_registers();
+    return (sim.status & it) ? SET : RESET;
+}
+
+void ETH_DMAClearITPendingBit(uint32_t it) {
+    sync_registers();
+    sim.status &= ~it;
+    publish_status();
+}
+
+void ETH_DMARxDescChainInit(ETH_DMADESCTypeDef *desc, uint8_t *buffer, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        desc[i].Status = ETH_DMARxDesc_OWN;
+        desc[i].ControlBufferSize = ETH_DMARxDesc_RCH | ETH_MAX_PACKET_SIZE;
+        desc[i].Buffer1Addr = (uintptr_t)&buffer[i * ETH_MAX_PACKET_SIZE];
+        desc[i].Buffer2NextDescAddr = (uintptr_t)&desc[(i + 1) % count];
+    }
+    DMARxDescToGet = desc;
+    sim.rx = desc;
+}
+
+void ETH_DMATxDescChainInit(ETH_DMADESCTypeDef *desc, uint8_t *buffer, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        desc[i].Status = ETH_DMATxDesc_TCH;
+        desc[i].ControlBufferSize = 0;
+        desc[i].Buffer1Addr = (uintptr_t)buffer + i * ETH_MAX_PACKET_SIZE;
+        desc[i].Buffer2NextDescAddr = (uintptr_t)&desc[(i + 1) % count];
+    }
+    DMATxDescToSet = desc;
+    sim.tx = desc;
+}
+
+uint16_t ETH_ReadPHYRegister(uint16_t phy_address, uint16_t reg) {
+    (void)phy_address;
+    if (sim.phy_reset_done && SysTick->CNT >= sim.phy_reset_done) {
+        // Auto-negotiation finds a full-duplex link partner
+        sim.phy_reset_done = 0;
+        sim.phy[PHY_BMCR] = 0x1100;
+        sim.phy[PHY_BMSR] = 0x7809 | 0x0020 | PHY_Linked_Status;
+    }
+    return sim.phy[reg & 31];
+}
+
+uint32_t ETH_WritePHYRegister(uint16_t phy_address, uint16_t reg, uint16_t value) {
+    (void)phy_address;
+    if (reg == PHY_BMCR && (value & PHY_Reset)) {
+        // Takes SIM_PHY_RESET_US, the reset bit stays set until then
+        memset(sim.phy, 0, sizeof(sim.phy));
+        sim.phy[PHY_BMCR] = PHY_Reset;
+        sim.phy_reset_done = SysTick->CNT + (uint64_t)env_u32("SIM_PHY_RESET_US", 5000) * SIM_TICKS_PER_US + 1;
+        sim.link_reported = 0;
+        return ETH_SUCCESS;
+    }
+
+    sim.phy[reg & 31] = value;
+    return ETH_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Flash for net_config.c. Starts out erased, or with the contents of the file
+ * named by SIM_FLASH, which is written back every time flash is locked again
+ * so a second run starts out with what the first one saved.
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+
+// What an erased word reads as on the CH32V30x, not all ones
+#define SIM_FLASH_ERASED 0xE339E339
+#define SIM_FLASH_PAGE_SIZE 4096
+
+uint8_t sim_flash[256 * 1024] __attribute__((aligned(SIM_FLASH_PAGE_SIZE)));
+static int unlocked;
+
+static void erase(uint8_t *page, uint32_t size) {
+    for (uint32_t i = 0; i < size; i += 4) {
+        *(uint32_t *)&page[i] = SIM_FLASH_ERASED;
+    }
+}
+
+// main() reads flash before anything else runs
+__attribute__((constructor)) static void sim_flash_load(void) {
+    erase(sim_flash, sizeof(sim_flash));
+    const char *path = getenv("SIM_FLASH");
+    FILE *file = path ? fopen(path, "rb") : NULL;
+    if (file != NULL) {
+        if (fread(sim_flash, 1, sizeof(sim_flash), file) != sizeof(sim_flash)) {
+            // Too short to be ours
+            erase(sim_flash, sizeof(sim_flash));
+        }
+        fclose(file);
+    }
+}
+
+void FLASH_Unlock(void) {
+    unlocked = 1;
+}
+
+void FLASH_Lock(void) {
+    unlocked = 0;
+
+    const char *path = getenv("SIM_FLASH");
+    FILE *file = path ? fopen(path, "wb") : NULL;
+    if (file != NULL) {
+        fwrite(sim_flash, 1, sizeof(sim_flash), file);
+        fclose(file);
+    }
+}
+
+static int in_flash(uintptr_t address, uint32_t len) {
+    return address >= FLASH_BASE && address + len <= FLASH_BASE + sizeof(sim_flash);
+}
+
+FLASH_Status FLASH_ErasePage(uintptr_t address) {
+    if (!unlocked || !in_flash(address, SIM_FLASH_PAGE_SIZE) || address % SIM_FLASH_PAGE_SIZE != 0) {
+        return FLASH_ERROR_WRP;
+    }
+    erase((uint8_t *)address, SIM_FLASH_PAGE_SIZE);
+    return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_ProgramWord(uintptr_t address, uint32_t data) {
+    if (!unlocked || !in_flash(address, 4) || address % 4 != 0) {
+        return FLASH_ERROR_WRP;
+    }
+    // Words can only be written once per erase
+    uint32_t *word = (uint32_t *)address;
+    if (*word != SIM_FLASH_ERASED) {
+        return FLASH_ERROR_PG;
+    }
+    *word = data;
+    return FLASH_COMPLETE;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Checks the deferred formatting in log.c against snprintf() by going through
+ * the ring like any other record, then fills the ring up to make sure records
+ * are dropped rather than overwritten and come out in order (SIM_LOG_CHECK=1).
+ */
+
+#include <debug.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "sim.h"
+
+static char buffer[LOG_BUFFER_SIZE];
+static uint32_t failures;
+
+static void expect(const char *format, const char *expected) {
+    uint32_t len = log_format(buffer, sizeof(buffer));
+    buffer[len] = '\0';
+    if (strcmp(buffer, expected) != 0) {
+        if (failures++ < 20) {
+            printf("Mismatch: \"%s\" expected \"%s\" got \"%s\"\n", format, expected, buffer);
+        }
+    }
+}
+
+#define CHECK(...) do { \
+    char expected[LOG_LINE_SIZE]; \
+    snprintf(expected, sizeof(expected), __VA_ARGS__); \
+    log_printf(__VA_ARGS__); \
+    expect(#__VA_ARGS__, expected); \
+} while (0)
+
+static void check_format(void) {
+    static const char *const text = "hello";
+    int value = 1234;
+
+    CHECK("plain\n");
+    CHECK("%d %d %d %d\n", 0, 42, -1, INT_MIN);
+    CHECK("%i %u %u\n", INT_MAX, 0u, UINT_MAX);
+    CHECK("[%5d|%-5d|%05d|%+d|% d|%+d]\n", 42, 42, -42, 42, 42, -42);
+    CHECK("%x %X %#x %#X %#x %o %#o %#o\n", 0xBEEFu, 0xBEEFu, 0xBEEFu, 0xBEEFu, 0u, 8u, 8u, 0u);
+    CHECK("%08x %02X:%02X %.3d %.0d| %5.3d\n", 0x1234u, 0xAu, 0xFFu, 7, 0, -7);
+    CHECK("%s|%.2s|%10s|%-10s|%.*s\n", text, text, text, text, 3, text);
+    CHECK("%c%c %5c|%-3c|\n", 'o', 'k', 'x', 'y');
+    CHECK("100%% %*d %-*d|\n", 6, 42, 6, 42);
+    CHECK("%hd %hu %hhd %hhu\n", 70000, 70000, 300, 300);
+    CHECK("%ld %lu %lx\n", LONG_MIN, ULONG_MAX, 0x7FFFFFFFul);
+    CHECK("%lld %llu %llx\n", LLONG_MIN, ULLONG_MAX, 0x123456789ABCDEFull);
+    CHECK("%zu %jd %td\n", sizeof(buffer), (intmax_t)-5, (ptrdiff_t)-9);
+    CHECK("%p\n", (void *)&value);
+    CHECK("%d %lld %d\n", 1, -2ll, 3);
+
+    // Floats aren't kept
+    log_printf("%d %f %d\n", 1, 2.5, 3);
+    expect("%d %f %d", "1 ? 3\n");
+
+    // Past LOG_MAX_ARGS
+    char format[64] = "";
+    char expected[64] = "";
+    for (int i = 0; i < LOG_MAX_ARGS + 2; i++) {
+        strcat(format, "%d ");
+        char digit[8];
+        snprintf(digit, sizeof(digit), i < LOG_MAX_ARGS ? "%d " : "? ", i);
+        strcat(expected, digit);
+    }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    log_printf(format, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9);
+#pragma GCC diagnostic pop
+    expect(format, expected);
+
+    // Lines too long for LOG_LINE_SIZE are cut short but still end the line
+    char line[LOG_LINE_SIZE * 2];
+    memset(line, 'a', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    log_printf("%s\n", line);
+    uint32_t len = log_format(buffer, sizeof(buffer));
+    if (len != LOG_LINE_SIZE - 1 || buffer[len - 1] != '\n') {
+        printf("Mismatch: long line came out as %u bytes\n", len);
+        failures++;
+    }
+}
+
+static void check_ring(void) {
+    // "%u" takes 3 words, go around the ring a few times
+    const uint32_t fits = LOG_RING_SIZE / 3;
+    for (uint32_t round = 0; round < 3; round++) {
+        uint32_t dropped = log_stats.dropped;
+        for (uint32_t i = 0; i < fits + 10; i++) {
+            log_printf("%u\n", (unsigned)i);
+        }
+        if (log_stats.dropped - dropped != 10) {
+            printf("Ring: expected 10 dropped records, got %u\n", log_stats.dropped - dropped);
+            failures++;
+        }
+
+        uint32_t next = 0;
+        uint32_t len;
+        while ((len = log_format(buffer, sizeof(buffer))) != 0) {
+            buffer[len] = '\0';
+            for (char *line = strtok(buffer, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+                if ((uint32_t)strtoul(line, NULL, 10) != next++) {
+                    printf("Ring: expected record %u, got %s\n", next - 1, line);
+                    failures++;
+                }
+            }
+        }
+        if (next != fits) {
+            printf("Ring: expected %u records, got %u\n", fits, next);
+            failures++;
+        }
+    }
+}
+
+int sim_log_check(void) {
+    // Get rid of anything logged during startup
+    while (log_format(buffer, sizeof(buffer)) != 0);
+
+    check_format();
+    check_ring();
+    printf("Log: %u failures\n", failures);
+    return failures != 0;
+}
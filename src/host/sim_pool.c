@@ -0,0 +1,115 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Stress test for the ISR's RX pbuf pool (SIM_POOL_STRESS=<frames>). A second
+ * thread plays the ISR, taking chains from the pool and handing them back to
+ * the main thread, which frees them and refills the pool like the main loop.
+ * Only the main thread ever calls into LwIP's allocator.
+ */
+
+#include <debug.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eth.h"
+#include "sim.h"
+
+#if ETH_RX_POOL_SIZE
+#define HANDBACK_SIZE 64
+
+static struct {
+    uint32_t frames;
+    struct pbuf *handback[HANDBACK_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t empty;
+} stress;
+
+static uint16_t frame_length(uint32_t i) {
+    return 60 + (i * 7919) % (MAX_ETH_PAYLOAD + 14 - 60 + 1);
+}
+
+static void *isr_thread(void *arg) {
+    (void)arg;
+    for (uint32_t i = 0; i < stress.frames; i++) {
+        uint16_t length = frame_length(i);
+        struct pbuf *p;
+        while ((p = eth_rx_pool_take(length)) == NULL) {
+            stress.empty++;
+            sched_yield();
+        }
+
+        // Tag every segment, a pbuf handed out twice ends up with the wrong tag
+        for (struct pbuf *q = p; q != NULL; q = q->next) {
+            memcpy(q->payload, &i, sizeof(i));
+        }
+
+        while (stress.head - stress.tail == HANDBACK_SIZE) {
+            sched_yield();
+        }
+        stress.handback[stress.head % HANDBACK_SIZE] = p;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        stress.head++;
+    }
+    return NULL;
+}
+
+int sim_pool_stress(uint32_t frames) {
+    stress.frames = frames;
+    eth_rx_pool_refill();
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, isr_thread, NULL);
+
+    uint32_t failures = 0;
+    for (uint32_t i = 0; i < frames; i++) {
+        while (stress.tail == stress.head) {
+            eth_rx_pool_refill();
+            sched_yield();
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        struct pbuf *p = stress.handback[stress.tail % HANDBACK_SIZE];
+        stress.tail++;
+
+        uint16_t length = 0;
+        for (struct pbuf *q = p; q != NULL; q = q->next) {
+            uint32_t tag;
+            memcpy(&tag, q->payload, sizeof(tag));
+            if (tag != i || q->ref != 1) {
+                failures++;
+            }
+            length += q->len;
+        }
+        if (length != frame_length(i) || p->tot_len != length) {
+            failures++;
+        }
+
+        pbuf_free(p);
+        eth_rx_pool_refill();
+    }
+
+    pthread_join(thread, NULL);
+    printf("Pool stress: %u frames, %u failures, pool ran dry %u times\n", frames, failures, stress.empty);
+    return failures != 0;
+}
+#else
+int sim_pool_stress(uint32_t frames) {
+    (void)frames;
+    printf("Error: the RX pool is disabled, set ETH_RX_ZERO_COPY=0 and ETH_RX_POLL=0\n");
+    return 1;
+}
+#endif
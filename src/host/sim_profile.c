@@ -0,0 +1,113 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Feeds profile_record() known times, including both ends of the range, and
+ * checks what it made of them, then that PROFILE_SCOPE records exactly once
+ * however its block is left (SIM_PROFILE_CHECK=1).
+ */
+
+#include <debug.h>
+#include <string.h>
+
+#include "profile.h"
+#include "sim.h"
+
+#if PROFILE
+static uint32_t failures;
+
+static void expect(const char *what, uint64_t got, uint64_t expected) {
+    if (got != expected) {
+        if (failures++ < 20) {
+            printf("Profile: %s expected %llu got %llu\n", what, (unsigned long long)expected, (unsigned long long)got);
+        }
+    }
+}
+
+static void check_record(void) {
+    static const uint32_t samples[] = { 7, 0, 1, 2, 3, 4, 1000, 1023, 1024, 0x40000000, 0x7FFFFFFF, 0xFFFFFFFF };
+    // Where each should land, the last three all in the top bucket
+    static const uint8_t buckets[] = { 3, 0, 1, 2, 2, 3, 10, 10, 11, 31, 31, 31 };
+
+    profile_reset();
+    uint32_t expected[32] = { 0 };
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        profile_record(PROFILE_NETIF_INPUT, samples[i]);
+        expected[buckets[i]]++;
+        total += samples[i];
+    }
+
+    const struct profile_stats *stats = &profile_stats[PROFILE_NETIF_INPUT];
+    expect("count", stats->count, sizeof(samples) / sizeof(samples[0]));
+    expect("min", stats->min, 0);
+    expect("max", stats->max, 0xFFFFFFFF);
+    expect("total", stats->total, total);
+    for (int i = 0; i < 32; i++) {
+        char what[16];
+        snprintf(what, sizeof(what), "bucket %d", i);
+        expect(what, stats->histogram[i], expected[i]);
+    }
+
+    // Min starts from the first sample, not 0
+    profile_record(PROFILE_NETIF_OUTPUT, 50);
+    profile_record(PROFILE_NETIF_OUTPUT, 20);
+    profile_record(PROFILE_NETIF_OUTPUT, 30);
+    stats = &profile_stats[PROFILE_NETIF_OUTPUT];
+    expect("min of 50, 20, 30", stats->min, 20);
+    expect("max of 50, 20, 30", stats->max, 50);
+
+    // Nothing else was touched
+    for (int i = 0; i < PROFILE_PROBE_COUNT; i++) {
+        if (i != PROFILE_NETIF_INPUT && i != PROFILE_NETIF_OUTPUT) {
+            expect("count of an unused probe", profile_stats[i].count, 0);
+        }
+    }
+
+    profile_reset();
+    expect("count after reset", profile_stats[PROFILE_NETIF_INPUT].count, 0);
+}
+
+static int scoped(int early) {
+    PROFILE_SCOPE(PROFILE_SEND_PACKET);
+    if (early) {
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        PROFILE_SCOPE(PROFILE_RX_PBUF);
+    }
+    return 0;
+}
+
+static void check_scope(void) {
+    profile_reset();
+    scoped(1);
+    scoped(0);
+    expect("scopes left", profile_stats[PROFILE_SEND_PACKET].count, 2);
+    expect("scopes in a loop", profile_stats[PROFILE_RX_PBUF].count, 2);
+    profile_reset();
+}
+
+int sim_profile_check(void) {
+    check_record();
+    check_scope();
+    printf("Profile: %u failures\n", failures);
+    return failures != 0;
+}
+#else
+int sim_profile_check(void) {
+    printf("Error: profiling is disabled, set PROFILE=1\n");
+    return 1;
+}
+#endif
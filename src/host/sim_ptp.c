@@ -0,0 +1,171 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Checks that the timestamps the driver hands to its PTP hooks are the ones
+ * the MAC model wrote for the same frame (SIM_PTP_CHECK=1). Received frames
+ * can be dropped on the way, so expected stamps are skipped until one matches
+ * the frame, but every sent frame has to come back in order.
+ */
+
+#include <debug.h>
+#include <string.h>
+
+#include "eth.h"
+#include "sim.h"
+
+#if ETH_PTP
+// Enough of each frame to tell generated pings apart
+#define COMPARE_SIZE 64
+#define FIFO_SIZE 256
+
+struct expected {
+    uint32_t high;
+    uint32_t low;
+    uint16_t len;
+    uint8_t frame[COMPARE_SIZE];
+};
+
+struct fifo {
+    struct expected entries[FIFO_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t overflows;
+};
+
+static struct {
+    int running;
+    struct fifo rx;
+    struct fifo tx;
+    uint32_t rx_checked;
+    uint32_t tx_checked;
+    uint32_t failures;
+} check;
+
+static void fail(const char *what, uint32_t index) {
+    if (check.failures++ < 20) {
+        printf("PTP: %s (frame %u)\n", what, index);
+    }
+}
+
+static int same_frame(const struct expected *expected, const uint8_t *frame, uint16_t len) {
+    uint16_t compare = len < expected->len ? len : expected->len;
+    if (compare > COMPARE_SIZE) {
+        compare = COMPARE_SIZE;
+    }
+    return memcmp(expected->frame, frame, compare) == 0;
+}
+
+static int same_time(const struct expected *expected, const struct eth_timestamp *time) {
+    struct eth_timestamp want;
+    eth_ptp_timestamp(expected->high, expected->low, &want);
+    return want.seconds == time->seconds && want.nanoseconds == time->nanoseconds;
+}
+
+static void check_rx(const struct eth_timestamp *time, const uint8_t *frame, uint16_t len) {
+    struct fifo *fifo = &check.rx;
+    check.rx_checked++;
+    while (fifo->tail != fifo->head) {
+        const struct expected *expected = &fifo->entries[fifo->tail++ % FIFO_SIZE];
+        if (!same_frame(expected, frame, len)) {
+            // Dropped by the driver
+            continue;
+        }
+        if (!same_time(expected, time)) {
+            fail("RX timestamp differs", check.rx_checked);
+        }
+        return;
+    }
+    fail("RX timestamp for a frame that wasn't received", check.rx_checked);
+}
+
+static void check_tx(const struct eth_timestamp *time, const uint8_t *frame, uint16_t len) {
+    struct fifo *fifo = &check.tx;
+    check.tx_checked++;
+    if (fifo->tail == fifo->head) {
+        fail("TX timestamp for a frame that wasn't sent", check.tx_checked);
+        return;
+    }
+
+    const struct expected *expected = &fifo->entries[fifo->tail++ % FIFO_SIZE];
+    if (!same_frame(expected, frame, len)) {
+        fail("TX timestamp for the wrong frame", check.tx_checked);
+    } else if (!same_time(expected, time)) {
+        fail("TX timestamp differs", check.tx_checked);
+    }
+}
+
+int sim_ptp_check_start(void) {
+    check.running = 1;
+    eth_ptp_set_hooks(check_rx, check_tx);
+    return 0;
+}
+
+void sim_ptp_stamped(int tx, uint32_t high, uint32_t low, const uint8_t *frame, uint16_t len) {
+    if (!check.running) {
+        return;
+    }
+
+    struct fifo *fifo = tx ? &check.tx : &check.rx;
+    if (fifo->head - fifo->tail == FIFO_SIZE) {
+        // Oldest first, that's the one most likely to have been dropped
+        fifo->tail++;
+        fifo->overflows++;
+    }
+    struct expected *expected = &fifo->entries[fifo->head++ % FIFO_SIZE];
+    expected->high = high;
+    expected->low = low;
+    expected->len = len;
+#if ETH_VLAN_COUNT
+    // The RX hook sees frames with their tag taken off
+    if (!tx && len >= 18 && frame[12] == 0x81 && frame[13] == 0x00) {
+        memcpy(expected->frame, frame, 12);
+        memcpy(&expected->frame[12], &frame[16], COMPARE_SIZE - 12);
+        expected->len = len - 4;
+        return;
+    }
+#endif
+    memcpy(expected->frame, frame, len < COMPARE_SIZE ? len : COMPARE_SIZE);
+}
+
+int sim_ptp_check_report(void) {
+    if (!check.running) {
+        return 0;
+    }
+
+    // Anything still sitting in the ring
+    eth_tx_reclaim();
+    if (check.tx.overflows != 0) {
+        fail("TX timestamps weren't taken in time", check.tx.overflows);
+    }
+    if (check.tx.head != check.tx.tail) {
+        fail("TX timestamps never taken", check.tx.head - check.tx.tail);
+    }
+    if (check.rx_checked == 0 || check.tx_checked == 0) {
+        fail("no timestamps taken", 0);
+    }
+
+    printf("PTP: %u RX and %u TX timestamps checked, %u failures\n", check.rx_checked, check.tx_checked, check.failures);
+    return check.failures != 0;
+}
+#else
+int sim_ptp_check_start(void) {
+    printf("Error: PTP is disabled, set ETH_PTP=1\n");
+    return 1;
+}
+
+int sim_ptp_check_report(void) {
+    return 0;
+}
+#endif
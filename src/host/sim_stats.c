@@ -0,0 +1,117 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Once the traffic is over, sets every counter /stats reports to its widest
+ * value and checks the response still fits in HTTPD_STATS_SIZE with the
+ * options the simulator was built with (SIM_STATS_CHECK=1). Try it with
+ * everything turned on after adding to /stats.
+ */
+
+#include <debug.h>
+#include <string.h>
+#include <lwip/apps/fs.h>
+#include <lwip/stats.h>
+
+#include "eth.h"
+#include "eth_capture.h"
+#include "eth_classify.h"
+#include "log.h"
+#include "ping_latency.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "sim.h"
+
+#define WIDEST(value) memset(&(value), 0xFF, sizeof(value))
+
+#if MEM_STATS || MEMP_STATS
+static void widest_mem(struct stats_mem *mem) {
+    WIDEST(mem->used);
+    WIDEST(mem->max);
+    WIDEST(mem->avail);
+    WIDEST(mem->err);
+}
+#endif
+
+static void widest_counters(void) {
+#if LINK_STATS
+    WIDEST(lwip_stats.link);
+#endif
+#if IP_STATS
+    WIDEST(lwip_stats.ip);
+#endif
+#if TCP_STATS
+    WIDEST(lwip_stats.tcp);
+#endif
+#if MEM_STATS
+    widest_mem(&lwip_stats.mem);
+#endif
+#if MEMP_STATS
+    for (int i = 0; i < MEMP_MAX; i++) {
+        widest_mem(lwip_stats.memp[i]);
+    }
+#endif
+
+    WIDEST(eth_stats);
+#if ETH_CLASSIFY
+    WIDEST(eth_class_stats);
+#endif
+#if ETH_VLAN_COUNT
+    // Only the ones in use are written
+    for (int i = 0; i < ETH_VLAN_COUNT; i++) {
+        uint16_t id = 4094 - i;
+        WIDEST(eth_vlan_stats[i]);
+        eth_vlan_stats[i].id = id;
+    }
+#endif
+#if ETH_CAPTURE
+    WIDEST(eth_capture_stats);
+#endif
+    WIDEST(log_stats);
+#if ETH_PTP
+    WIDEST(ping_latency_stats);
+    // So the mean is as wide as it gets too
+    ping_latency_stats.total_ns = (uint64_t)UINT32_MAX * ping_latency_stats.samples;
+#endif
+#if PROFILE
+    WIDEST(profile_stats);
+    for (int i = 0; i < PROFILE_PROBE_COUNT; i++) {
+        profile_stats[i].total = (uint64_t)UINT32_MAX * profile_stats[i].count;
+    }
+#endif
+
+    // Times are written in microseconds
+    for (int i = 0; i < SCHED_MAX_TASKS; i++) {
+        struct sched_task *task = &sched_tasks[i];
+        WIDEST(task->runs);
+        WIDEST(task->max_run);
+        WIDEST(task->max_latency);
+        WIDEST(task->overruns);
+    }
+}
+
+int sim_stats_check(void) {
+    widest_counters();
+
+    struct fs_file file;
+    if (!fs_open_custom(&file, "/stats")) {
+        printf("Stats: /stats doesn't fit in HTTPD_STATS_SIZE\n");
+        return 1;
+    }
+
+    int failed = file.len < 3 || memcmp(&file.data[file.len - 3], "}}\n", 3) != 0;
+    printf("Stats: %u bytes at most%s\n", (unsigned)file.len, failed ? ", but cut short" : "");
+    fs_close_custom(&file);
+    return failed;
+}
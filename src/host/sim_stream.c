@@ -0,0 +1,224 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Sends SIM_STREAM datagrams to the peer with udp_stream.h, one every time
+ * the main loop goes idle, alongside the rest of the traffic. Every frame the
+ * MAC sends for the stream has to carry the stream's headers with the right
+ * lengths and the next datagram in order, and every datagram has to have
+ * been either sent or counted as dropped. Streams too long for
+ * eth_tx_claim() mustn't open, and a datagram longer than the stream was
+ * opened for has to be counted as oversized rather than dropped. With
+ * SIM_STREAM_VLAN the stream is opened on that VLAN's netif and every frame
+ * has to carry its tag.
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lwip/netif.h>
+
+#include "eth.h"
+#include "sim.h"
+#include "udp_stream.h"
+
+#define SRC_PORT  50000
+#define DEST_PORT 50001
+
+static struct {
+    int running;
+    uint32_t count;
+    uint16_t size;
+    uint16_t vlan;
+    int open;
+    struct udp_stream stream;
+    uint32_t attempts;
+    // Datagrams seen going out on the wire
+    uint32_t received;
+    uint32_t failures;
+} check;
+
+static void fail(const char *what) {
+    if (check.failures++ < 20) {
+        printf("Stream: %s\n", what);
+    }
+}
+
+static uint32_t env_u32(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    return value ? (uint32_t)strtoul(value, NULL, 0) : fallback;
+}
+
+int sim_stream_check_start(void) {
+    check.running = 1;
+    check.count = env_u32("SIM_STREAM", 0);
+    check.size = env_u32("SIM_STREAM_SIZE", 64);
+    check.vlan = env_u32("SIM_STREAM_VLAN", 0);
+    // Room for the sequence number
+    if (check.size < 4) {
+        check.size = 4;
+    }
+    uint16_t max_len = check.vlan ? UDP_STREAM_VLAN_MAX_LEN : UDP_STREAM_MAX_LEN;
+    if (check.size > max_len) {
+        printf("Error: SIM_STREAM_SIZE is more than %u, see ETH_TX_RAW_SIZE\n", (unsigned)max_len);
+        return 1;
+    }
+#if !ETH_VLAN_COUNT
+    if (check.vlan) {
+        printf("Error: VLANs are disabled, set VLAN_IDS\n");
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+// The netif to open the stream on, NULL if it isn't up yet
+static struct netif *stream_netif(void) {
+#if ETH_VLAN_COUNT
+    if (check.vlan) {
+        struct netif *netif;
+        NETIF_FOREACH(netif) {
+            if (eth_vlan_tag(netif) == check.vlan) {
+                return netif;
+            }
+        }
+        return NULL;
+    }
+#endif
+    return netif_default;
+}
+
+static void open_stream(void) {
+    struct netif *netif = stream_netif();
+    if (netif == NULL) {
+        return;
+    }
+    // The peer's address on the VLAN, see main.c
+    ip4_addr_t peer;
+    IP4_ADDR(&peer, 192, 168, check.vlan ? check.vlan & 0xFF : 1, 2);
+
+    uint16_t max_len = check.vlan ? UDP_STREAM_VLAN_MAX_LEN : UDP_STREAM_MAX_LEN;
+    struct udp_stream stream;
+    if (udp_stream_open(&stream, netif, &peer, SRC_PORT, DEST_PORT, max_len + 1) != ERR_VAL) {
+        fail("opened a stream too long for eth_tx_claim()");
+    }
+    if (udp_stream_open(&check.stream, netif, &peer, SRC_PORT, DEST_PORT, check.size) != ERR_OK) {
+        return;
+    }
+    check.open = 1;
+
+    if (udp_stream_claim(&check.stream, check.size + 1) != NULL || check.stream.oversized != 1 || check.stream.dropped != 0) {
+        fail("a datagram longer than the stream wasn't counted as oversized");
+    }
+}
+
+void sim_stream_poll(void) {
+    if (!check.running || netif_default == NULL || check.attempts == check.count) {
+        return;
+    }
+    if (!check.open) {
+        open_stream();
+        return;
+    }
+
+    check.attempts++;
+    uint8_t *payload = udp_stream_claim(&check.stream, check.size);
+    if (payload == NULL) {
+        return;
+    }
+    uint32_t sequence = check.stream.sent;
+    memcpy(payload, &sequence, sizeof(sequence));
+    for (uint32_t i = sizeof(sequence); i < check.size; i++) {
+        payload[i] = sequence + i;
+    }
+    udp_stream_commit(&check.stream, check.size);
+}
+
+static uint16_t read16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+void sim_stream_tx(const uint8_t *frame, uint16_t len) {
+    // Long enough to look past a tag
+    if (!check.running || !check.open || len < UDP_STREAM_HEADER_LEN + SIZEOF_VLAN_HDR) {
+        return;
+    }
+    uint16_t link = SIZEOF_ETH_HDR;
+    uint16_t type = read16(&frame[12]);
+    if (type == ETHTYPE_VLAN) {
+        if ((read16(&frame[14]) & 0xFFF) != check.vlan) {
+            return;
+        }
+        link += SIZEOF_VLAN_HDR;
+        type = read16(&frame[16]);
+    } else if (check.vlan) {
+        return;
+    }
+    const uint8_t *ip = &frame[link];
+    const uint8_t *udp = &ip[IP_HLEN];
+    if (type != ETHTYPE_IP || ip[9] != IP_PROTO_UDP || read16(&udp[2]) != DEST_PORT) {
+        return;
+    }
+
+    // Everything but the lengths and checksums is fixed, relative to the IP header
+    static const struct { uint8_t from, to; } fixed[] = { { 0, 2 }, { 4, 10 }, { 12, 24 } };
+    if (link != check.stream.link_len || memcmp(frame, check.stream.header, link) != 0) {
+        fail("Ethernet header doesn't match the stream's");
+        return;
+    }
+    for (uint32_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++) {
+        if (memcmp(&ip[fixed[i].from], &check.stream.header[link + fixed[i].from], fixed[i].to - fixed[i].from) != 0) {
+            fail("headers don't match the stream's");
+            return;
+        }
+    }
+    if (len != link + IP_HLEN + UDP_HLEN + check.size || read16(&ip[2]) != IP_HLEN + UDP_HLEN + check.size || read16(&udp[4]) != UDP_HLEN + check.size) {
+        fail("wrong length");
+        return;
+    }
+
+    const uint8_t *payload = &udp[UDP_HLEN];
+    uint32_t sequence;
+    memcpy(&sequence, payload, sizeof(sequence));
+    if (sequence != check.received) {
+        fail("datagram out of order");
+    }
+    for (uint32_t i = sizeof(sequence); i < check.size; i++) {
+        if (payload[i] != (uint8_t)(sequence + i)) {
+            fail("payload corrupted");
+            break;
+        }
+    }
+    check.received = sequence + 1;
+}
+
+int sim_stream_check_report(void) {
+    if (!check.running) {
+        return 0;
+    }
+
+    const struct udp_stream *stream = &check.stream;
+    if (stream->sent == 0) {
+        fail("nothing sent");
+    }
+    if (check.received != stream->sent) {
+        fail("datagrams committed but not sent by the MAC");
+    }
+    if (stream->sent + stream->dropped != check.attempts) {
+        fail("datagrams neither sent nor dropped");
+    }
+    printf("Stream: %u datagrams of %u bytes, %u sent, %u dropped, %u oversized, %u failures\n", check.attempts,
+        check.size, stream->sent, stream->dropped, stream->oversized, check.failures);
+    return check.failures != 0;
+}
@@ -0,0 +1,555 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Traffic for the simulated MAC, either replayed from a pcap file or
+ * generated (an ARP request followed by ICMP echo requests from a peer).
+ *
+ * SIM_FLOOD=<n> mixes n ARP, broadcast, multicast or ICMP frames
+ * (SIM_FLOOD_TYPE) in before every generated frame, which become TCP ACKs for
+ * a connection to the web server so they can be told apart from the flood in
+ * the class counters.
+ *
+ * SIM_VLAN=<id>,<id>,... tags the ARP requests (one for each ID) and pings
+ * with each ID in turn, 0 for untagged, and moves them to 192.168.<ID>.0/24
+ * like main.c does for VLAN_IDS. Every transmitted frame's tag is then checked
+ * against the subnet it's for, and IDs without a netif must get nothing back.
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eth.h"
+#include "eth_classify.h"
+#include "sim.h"
+
+#define PCAP_MAGIC      0xA1B2C3D4
+#define PCAP_MAGIC_NS   0xA1B23C4D
+#define LINKTYPE_ETHERNET 1
+#define MAX_VLANS 8
+
+// The device's address (see main.c) and a made up peer
+static const uint8_t device_ip[4] = { 192, 168, 1, 10 };
+static const uint8_t peer_ip[4] = { 192, 168, 1, 2 };
+static const uint8_t peer_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+
+struct pcap_frame {
+    uint8_t *data;
+    uint16_t len;
+};
+
+static struct {
+    // Replay
+    struct pcap_frame *frames;
+    uint32_t frame_count;
+    uint32_t repeat;
+
+    // Generator
+    uint32_t count;
+    uint32_t payload_size;
+    uint32_t flood;
+    enum { FLOOD_ARP, FLOOD_BROADCAST, FLOOD_MULTICAST, FLOOD_ICMP, FLOOD_LLC } flood_type;
+
+    // Tags for generated frames
+    uint16_t vlans[MAX_VLANS];
+    uint32_t vlan_count;
+    uint32_t vlan_next;
+    uint32_t vlan_sent[MAX_VLANS];
+    uint32_t vlan_replies[MAX_VLANS];
+    uint32_t vlan_failures;
+
+    uint32_t sent;
+    FILE *tx_pcap;
+} traffic;
+
+static uint32_t env_u32(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    return value ? (uint32_t)strtoul(value, NULL, 0) : fallback;
+}
+
+static uint32_t swap32(uint32_t x) {
+    return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
+static void load_pcap(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Error: could not open %s\n", path);
+        exit(1);
+    }
+
+    uint32_t header[6];
+    if (fread(header, sizeof(header), 1, file) != 1) {
+        printf("Error: %s is too short\n", path);
+        exit(1);
+    }
+    int swapped = header[0] == swap32(PCAP_MAGIC) || header[0] == swap32(PCAP_MAGIC_NS);
+    uint32_t linktype = swapped ? swap32(header[5]) : header[5];
+    if ((!swapped && header[0] != PCAP_MAGIC && header[0] != PCAP_MAGIC_NS) || linktype != LINKTYPE_ETHERNET) {
+        printf("Error: %s isn't an Ethernet pcap file\n", path);
+        exit(1);
+    }
+
+    uint32_t record[4];
+    while (fread(record, sizeof(record), 1, file) == 1) {
+        uint32_t len = swapped ? swap32(record[2]) : record[2];
+        uint8_t *data = malloc(len);
+        if (data == NULL || fread(data, len, 1, file) != 1) {
+            free(data);
+            break;
+        }
+
+        // Anything that wouldn't fit on the wire gets skipped
+        if (len < 14 || len > MAX_ETH_PAYLOAD + 14) {
+            free(data);
+            continue;
+        }
+
+        traffic.frames = realloc(traffic.frames, (traffic.frame_count + 1) * sizeof(struct pcap_frame));
+        traffic.frames[traffic.frame_count].data = data;
+        traffic.frames[traffic.frame_count].len = len;
+        traffic.frame_count++;
+    }
+    fclose(file);
+    printf("Loaded %u frames from %s\n", traffic.frame_count, path);
+}
+
+static void write_pcap_header(FILE *file) {
+    const uint32_t header[6] = { PCAP_MAGIC, 0x00040002, 0, 0, 65535, LINKTYPE_ETHERNET };
+    fwrite(header, sizeof(header), 1, file);
+}
+
+void sim_traffic_init(void) {
+    const char *pcap = getenv("SIM_PCAP");
+    if (pcap != NULL) {
+        load_pcap(pcap);
+        traffic.repeat = env_u32("SIM_REPEAT", 1);
+    } else {
+        traffic.count = env_u32("SIM_FRAMES", 10000);
+        traffic.payload_size = env_u32("SIM_SIZE", 56);
+        if (traffic.payload_size > MAX_ETH_PAYLOAD - 28) {
+            traffic.payload_size = MAX_ETH_PAYLOAD - 28;
+        }
+
+        const char *vlans = getenv("SIM_VLAN");
+        while (vlans != NULL && *vlans != '\0' && traffic.vlan_count < MAX_VLANS) {
+            char *end;
+            traffic.vlans[traffic.vlan_count++] = strtoul(vlans, &end, 0) & 0xFFF;
+            vlans = *end == ',' ? end + 1 : end;
+        }
+
+        traffic.flood = env_u32("SIM_FLOOD", 0);
+        const char *type = getenv("SIM_FLOOD_TYPE");
+        if (type == NULL || strcmp(type, "arp") == 0) {
+            traffic.flood_type = FLOOD_ARP;
+        } else if (strcmp(type, "broadcast") == 0) {
+            traffic.flood_type = FLOOD_BROADCAST;
+        } else if (strcmp(type, "icmp") == 0) {
+            traffic.flood_type = FLOOD_ICMP;
+        } else if (strcmp(type, "multicast") == 0) {
+            traffic.flood_type = FLOOD_MULTICAST;
+        } else if (strcmp(type, "llc") == 0) {
+            traffic.flood_type = FLOOD_LLC;
+        } else {
+            printf("Error: unknown SIM_FLOOD_TYPE %s\n", type);
+            exit(1);
+        }
+    }
+
+    const char *tx_pcap = getenv("SIM_TX_PCAP");
+    if (tx_pcap != NULL) {
+        traffic.tx_pcap = fopen(tx_pcap, "wb");
+        if (traffic.tx_pcap != NULL) {
+            write_pcap_header(traffic.tx_pcap);
+        }
+    }
+}
+
+static void device_mac(uint8_t *mac) {
+    mac[0] = ETH->MACA0LR;
+    mac[1] = ETH->MACA0LR >> 8;
+    mac[2] = ETH->MACA0LR >> 16;
+    mac[3] = ETH->MACA0LR >> 24;
+    mac[4] = ETH->MACA0HR;
+    mac[5] = ETH->MACA0HR >> 8;
+}
+
+static uint16_t checksum(const uint8_t *data, uint32_t len) {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if (len & 1) {
+        sum += data[len - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static uint16_t generate_arp(uint8_t *frame) {
+    memset(frame, 0xFF, 6);
+    memcpy(&frame[6], peer_mac, 6);
+    frame[12] = 0x08; frame[13] = 0x06;
+
+    uint8_t *arp = &frame[14];
+    const uint8_t header[8] = { 0x00, 0x01, 0x08, 0x00, 6, 4, 0x00, 0x01 };
+    memcpy(arp, header, sizeof(header));
+    memcpy(&arp[8], peer_mac, 6);
+    memcpy(&arp[14], peer_ip, 4);
+    memset(&arp[18], 0, 6);
+    memcpy(&arp[24], device_ip, 4);
+    return 14 + 28;
+}
+
+static void ip_header(uint8_t *ip, uint8_t proto, uint16_t len, uint16_t id, const uint8_t *dst) {
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    ip[2] = len >> 8;
+    ip[3] = len;
+    ip[4] = id >> 8;
+    ip[5] = id;
+    ip[8] = 64;
+    ip[9] = proto;
+    memcpy(&ip[12], peer_ip, 4);
+    memcpy(&ip[16], dst, 4);
+    uint16_t sum = checksum(ip, 20);
+    ip[10] = sum >> 8;
+    ip[11] = sum;
+}
+
+static uint16_t generate_ping(uint8_t *frame, uint16_t sequence) {
+    device_mac(frame);
+    memcpy(&frame[6], peer_mac, 6);
+    frame[12] = 0x08; frame[13] = 0x00;
+
+    uint16_t ip_len = 20 + 8 + traffic.payload_size;
+    uint8_t *ip = &frame[14];
+    ip_header(ip, 1, ip_len, sequence, device_ip);
+
+    uint8_t *icmp = &ip[20];
+    memset(icmp, 0, 8);
+    icmp[0] = 8;
+    icmp[4] = 0x12;
+    icmp[5] = 0x34;
+    icmp[6] = sequence >> 8;
+    icmp[7] = sequence;
+    for (uint32_t i = 0; i < traffic.payload_size; i++) {
+        icmp[8 + i] = i;
+    }
+    uint16_t sum = checksum(icmp, 8 + traffic.payload_size);
+    icmp[2] = sum >> 8;
+    icmp[3] = sum;
+
+    return 14 + ip_len;
+}
+
+// Third byte of the addresses on a VLAN, see main.c
+static uint8_t vlan_subnet(uint16_t id) {
+    return id != 0 ? id & 0xFF : device_ip[2];
+}
+
+// Move a generated ARP request or ping onto a VLAN and tag it
+static uint16_t vlan_tag(uint8_t *frame, uint16_t len, uint32_t index) {
+    uint16_t id = traffic.vlans[index];
+    uint8_t subnet = vlan_subnet(id);
+    traffic.vlan_sent[index]++;
+    if (frame[13] == 0x06) {
+        frame[14 + 14 + 2] = subnet;
+        frame[14 + 24 + 2] = subnet;
+    } else {
+        uint8_t *ip = &frame[14];
+        ip[12 + 2] = subnet;
+        ip[16 + 2] = subnet;
+        ip[10] = 0;
+        ip[11] = 0;
+        uint16_t sum = checksum(ip, 20);
+        ip[10] = sum >> 8;
+        ip[11] = sum;
+    }
+    if (id == 0) {
+        return len;
+    }
+
+    memmove(&frame[16], &frame[12], len - 12);
+    frame[12] = 0x81;
+    frame[13] = 0x00;
+    frame[14] = id >> 8;
+    frame[15] = id;
+    return len + 4;
+}
+
+// Checksum over the IPv4 pseudo header and a TCP/UDP header plus payload
+static uint16_t transport_checksum(const uint8_t *ip, uint8_t *data, uint16_t len) {
+    uint8_t buffer[12 + MAX_ETH_PAYLOAD];
+    memcpy(buffer, &ip[12], 8);
+    buffer[8] = 0;
+    buffer[9] = ip[9];
+    buffer[10] = len >> 8;
+    buffer[11] = len;
+    memcpy(&buffer[12], data, len);
+    return checksum(buffer, 12 + len);
+}
+
+// Pure ACK from the peer for a connection to port 80
+static uint16_t generate_tcp_ack(uint8_t *frame, uint32_t sequence) {
+    device_mac(frame);
+    memcpy(&frame[6], peer_mac, 6);
+    frame[12] = 0x08; frame[13] = 0x00;
+
+    uint8_t *ip = &frame[14];
+    ip_header(ip, 6, 20 + 20, sequence, device_ip);
+
+    uint8_t *tcp = &ip[20];
+    memset(tcp, 0, 20);
+    tcp[0] = 40000 >> 8;
+    tcp[1] = 40000 & 0xFF;
+    tcp[3] = 80;
+    tcp[4] = sequence >> 24;
+    tcp[5] = sequence >> 16;
+    tcp[6] = sequence >> 8;
+    tcp[7] = sequence;
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x10;
+    tcp[14] = 0x10;
+    uint16_t sum = transport_checksum(ip, tcp, 20);
+    tcp[16] = sum >> 8;
+    tcp[17] = sum;
+    return 14 + 40;
+}
+
+// UDP to the discard port on every host, or every member of 239.1.2.3
+static uint16_t generate_broadcast(uint8_t *frame, uint16_t sequence, int multicast) {
+    static const uint8_t broadcast_ip[4] = { 255, 255, 255, 255 };
+    static const uint8_t group_ip[4] = { 239, 1, 2, 3 };
+    static const uint8_t group_mac[6] = { 0x01, 0x00, 0x5E, 0x01, 0x02, 0x03 };
+    if (multicast) {
+        memcpy(frame, group_mac, 6);
+    } else {
+        memset(frame, 0xFF, 6);
+    }
+    memcpy(&frame[6], peer_mac, 6);
+    frame[12] = 0x08; frame[13] = 0x00;
+
+    uint16_t udp_len = 8 + traffic.payload_size;
+    uint8_t *ip = &frame[14];
+    ip_header(ip, 17, 20 + udp_len, sequence, multicast ? group_ip : broadcast_ip);
+
+    uint8_t *udp = &ip[20];
+    udp[0] = 0x40; udp[1] = 0x00;
+    udp[2] = 0x00; udp[3] = 9;
+    udp[4] = udp_len >> 8;
+    udp[5] = udp_len;
+    udp[6] = 0; udp[7] = 0;
+    memset(&udp[8], 0, traffic.payload_size);
+    uint16_t sum = transport_checksum(ip, udp, udp_len);
+    udp[6] = sum >> 8;
+    udp[7] = sum;
+    return 14 + 20 + udp_len;
+}
+
+// Spanning tree configuration BPDU, an IEEE 802.3 frame short enough to be padded
+static uint16_t generate_llc(uint8_t *frame) {
+    static const uint8_t stp_mac[6] = { 0x01, 0x80, 0xC2, 0x00, 0x00, 0x00 };
+    memcpy(frame, stp_mac, 6);
+    memcpy(&frame[6], peer_mac, 6);
+    // Length of the LLC header and BPDU
+    frame[12] = 0x00; frame[13] = 3 + 35;
+    frame[14] = 0x42; frame[15] = 0x42; frame[16] = 0x03;
+    memset(&frame[17], 0, 35);
+    return 14 + 3 + 35;
+}
+
+static uint16_t generate_flood(uint8_t *frame, uint16_t sequence) {
+    switch (traffic.flood_type) {
+    case FLOOD_BROADCAST:
+        return generate_broadcast(frame, sequence, 0);
+    case FLOOD_MULTICAST:
+        return generate_broadcast(frame, sequence, 1);
+    case FLOOD_ICMP:
+        return generate_ping(frame, sequence);
+    case FLOOD_LLC:
+        return generate_llc(frame);
+    default:
+        return generate_arp(frame);
+    }
+}
+
+int sim_traffic_next(uint8_t *frame, uint16_t *len) {
+    if (traffic.frames != NULL) {
+        if (traffic.sent >= traffic.frame_count * traffic.repeat) {
+            return 0;
+        }
+
+        const struct pcap_frame *f = &traffic.frames[traffic.sent % traffic.frame_count];
+        memcpy(frame, f->data, f->len);
+        *len = f->len;
+    } else {
+        if (traffic.sent >= traffic.count * (traffic.flood + 1)) {
+            return 0;
+        }
+
+        // The peer introduces itself first (on every VLAN) so replies don't wait on ARP
+        uint32_t slot = traffic.sent % (traffic.flood + 1);
+        uint32_t arps = traffic.vlan_count ? traffic.vlan_count : 1;
+        if (traffic.sent < arps) {
+            *len = generate_arp(frame);
+            if (traffic.vlan_count) {
+                *len = vlan_tag(frame, *len, traffic.sent);
+            }
+        } else if (slot != traffic.flood) {
+            *len = generate_flood(frame, traffic.sent);
+        } else if (traffic.flood) {
+            *len = generate_tcp_ack(frame, traffic.sent);
+        } else {
+            *len = generate_ping(frame, traffic.sent);
+            if (traffic.vlan_count) {
+                *len = vlan_tag(frame, *len, traffic.vlan_next++ % traffic.vlan_count);
+            }
+        }
+    }
+
+    // Runt frames get padded like a real MAC would
+    if (*len < 60) {
+        memset(&frame[*len], 0, 60 - *len);
+        *len = 60;
+    }
+
+    traffic.sent++;
+    return 1;
+}
+
+// Check a transmitted frame went out on the VLAN its addresses belong to
+static void vlan_check_tx(const uint8_t *frame, uint16_t len) {
+    uint16_t id = 0;
+    if (len >= 18 && frame[12] == 0x81 && frame[13] == 0x00) {
+        id = ((frame[14] << 8) | frame[15]) & 0xFFF;
+        frame += 4;
+        len -= 4;
+    }
+
+    // The address of the peer or (echoed back) the device
+    uint8_t subnet;
+    if (frame[12] == 0x08 && frame[13] == 0x06 && len >= 14 + 28) {
+        subnet = frame[14 + 24 + 2];
+    } else if (frame[12] == 0x08 && frame[13] == 0x00 && len >= 14 + 20) {
+        subnet = frame[14 + 16 + 2];
+    } else {
+        return;
+    }
+
+    for (uint32_t i = 0; i < traffic.vlan_count; i++) {
+        if (vlan_subnet(traffic.vlans[i]) != subnet) {
+            continue;
+        }
+        if (traffic.vlans[i] != id) {
+            if (traffic.vlan_failures++ < 20) {
+                printf("VLAN: frame for 192.168.%u.0/24 sent on VLAN %u instead of %u\n", subnet, id, traffic.vlans[i]);
+            }
+        }
+        traffic.vlan_replies[i]++;
+        return;
+    }
+}
+
+void sim_traffic_tx(const uint8_t *frame, uint16_t len) {
+    if (traffic.vlan_count) {
+        vlan_check_tx(frame, len);
+    }
+    if (traffic.tx_pcap == NULL) {
+        return;
+    }
+
+    uint64_t us = SysTick->CNT / SIM_TICKS_PER_US;
+    const uint32_t record[4] = { us / 1000000, us % 1000000, len, len };
+    fwrite(record, sizeof(record), 1, traffic.tx_pcap);
+    fwrite(frame, len, 1, traffic.tx_pcap);
+    fflush(traffic.tx_pcap);
+}
+
+// Whether the driver has a netif for a VLAN
+static int vlan_known(uint16_t id) {
+    if (id == 0) {
+        return 1;
+    }
+#if ETH_VLAN_COUNT
+    for (int i = 0; i < ETH_VLAN_COUNT; i++) {
+        if (eth_vlan_stats[i].id == id) {
+            return 1;
+        }
+    }
+#endif
+    return 0;
+}
+
+int sim_traffic_check(void) {
+    // Shorter than 64 bytes once the MAC has stripped their padding, but not runts
+    if (traffic.flood && traffic.flood_type == FLOOD_LLC && eth_stats.rx_runt_errors != 0) {
+        printf("LLC: %u frames counted as runts\n", eth_stats.rx_runt_errors);
+        return 1;
+    }
+#if ETH_CLASSIFY
+    // Multicast isn't broadcast, and isn't limited by default
+    const struct eth_class_stats *broadcast = &eth_class_stats[ETH_CLASS_BROADCAST];
+    if (traffic.flood && traffic.flood_type == FLOOD_MULTICAST &&
+        (broadcast->frames + broadcast->rate_drops + broadcast->pressure_drops != 0 ||
+        eth_class_stats[ETH_CLASS_MULTICAST].rate_drops != 0)) {
+        printf("Multicast: counted as broadcast or rate limited\n");
+        return 1;
+    }
+#endif
+    if (traffic.vlan_count == 0) {
+        return 0;
+    }
+
+    // Frames can get lost under load, so only check each VLAN got (or didn't
+    // get) anything through
+    uint32_t failures = traffic.vlan_failures;
+    uint32_t foreign = 0;
+    printf("\n%-6s %10s %10s %10s %10s\n", "vlan", "sent", "replies", "rx", "tx");
+    for (uint32_t i = 0; i < traffic.vlan_count; i++) {
+        uint16_t id = traffic.vlans[i];
+        uint32_t rx = 0;
+        uint32_t tx = 0;
+#if ETH_VLAN_COUNT
+        for (int j = 0; j < ETH_VLAN_COUNT; j++) {
+            if (id != 0 && eth_vlan_stats[j].id == id) {
+                rx = eth_vlan_stats[j].rx_frames;
+                tx = eth_vlan_stats[j].tx_frames;
+            }
+        }
+#endif
+        printf("%-6u %10u %10u %10u %10u\n", id, traffic.vlan_sent[i], traffic.vlan_replies[i], rx, tx);
+
+        if (!vlan_known(id)) {
+            foreign += traffic.vlan_sent[i];
+            if (traffic.vlan_replies[i] != 0) {
+                printf("VLAN: %u has no netif but got replies\n", id);
+                failures++;
+            }
+        } else if (traffic.vlan_replies[i] == 0 || (id != 0 && (rx == 0 || rx > traffic.vlan_sent[i] || tx < traffic.vlan_replies[i]))) {
+            printf("VLAN: %u wasn't handled\n", id);
+            failures++;
+        }
+    }
+    if (foreign != 0 && (eth_stats.rx_vlan_dropped == 0 || eth_stats.rx_vlan_dropped > foreign)) {
+        printf("VLAN: %u frames for VLANs without a netif but %u dropped\n", foreign, eth_stats.rx_vlan_dropped);
+        failures++;
+    }
+
+    printf("VLAN: %u failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <debug.h>
+#include "arch/cc.h"
+#include "profile.h"
+#include "sim.h"
+#include "sys_arch.h"
+
+// Use instead of Delay_Us, time passes instantly in the simulation
+void usleep(uint32_t time) {
+    sim_advance((uint64_t)time * SIM_TICKS_PER_US);
+}
+
+// LwIP
+// Critical sections only mask the Ethernet interrupt, the only other context
+// that touches LwIP (or the driver's state), so everything else keeps its latency.
+// The nesting depth is handed back to sys_arch_unprotect() to restore.
+static volatile uint32_t protect_depth;
+
+sys_prot_t sys_arch_protect(void) {
+    NVIC_DisableIRQ(ETH_IRQn);
+    __asm__ volatile("" ::: "memory");
+    return protect_depth++;
+}
+
+void sys_arch_unprotect(sys_prot_t pval) {
+    __asm__ volatile("" ::: "memory");
+    protect_depth = pval;
+    if (pval == 0) {
+        NVIC_EnableIRQ(ETH_IRQn);
+    }
+}
+
+// Milliseconds since boot, same as on the board
+static volatile uint32_t sys_ms;
+static uint64_t sys_next_tick;
+
+static void systick_arm(uint64_t cmp) {
+    SysTick->CMP = cmp;
+    if (SysTick->CNT >= cmp) {
+        SysTick->CTLR |= SYSTICK_CTLR_SWIE;
+    }
+}
+
+static void systick_update(void) {
+    uint64_t now = SysTick->CNT;
+    if (now >= sys_next_tick) {
+        uint32_t behind = (uint32_t)(now - sys_next_tick)/SYS_TICKS_PER_MS + 1;
+        sys_ms += behind;
+        sys_next_tick += (uint64_t)behind*SYS_TICKS_PER_MS;
+    }
+    systick_arm(sys_next_tick);
+}
+
+INTERRUPT(SysTick_Handler) {
+    SysTick->CTLR &= ~SYSTICK_CTLR_SWIE;
+    SysTick->SR = 0;
+    systick_update();
+}
+
+void sys_tick_init(void) {
+    sys_next_tick = SysTick->CNT + SYS_TICKS_PER_MS;
+    SysTick->CMP = sys_next_tick;
+    SysTick->SR = 0;
+    SysTick->CTLR = SYSTICK_CTLR_STE | SYSTICK_CTLR_STIE;
+    NVIC_EnableIRQ(SysTicK_IRQn);
+}
+
+// Logging goes to stdout, each transfer is done as soon as it's started
+void sys_uart_init(uint32_t baudrate) {
+    USART_Printf_Init(baudrate);
+}
+
+int sys_uart_busy(void) {
+    return 0;
+}
+
+void sys_uart_send(const char *data, uint32_t len) {
+    fwrite(data, 1, len, stdout);
+}
+
+void sys_uart_write(const char *data, uint32_t len) {
+    fwrite(data, 1, len, stdout);
+    fflush(stdout);
+}
+
+// Called at least once per main loop iteration, which makes it a good place to run the hardware
+uint32_t sys_now(void) {
+    sim_step();
+    return sys_ms;
+}
+
+// Simulated interrupts only fire from sim_step(), so there's nothing to mask
+void sys_irq_disable(void) {
+}
+
+void sys_irq_enable(void) {
+}
+
+void sys_idle(uint32_t ms) {
+    if (ms == 0) {
+        return;
+    }
+    if (ms > SYS_IDLE_MAX_MS) {
+        ms = SYS_IDLE_MAX_MS;
+    }
+
+    systick_arm(sys_next_tick + (uint64_t)(ms - 1)*SYS_TICKS_PER_MS);
+    sim_idle();
+    systick_update();
+}
+
+#if PROFILE
+uint32_t profile_host_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+#endif
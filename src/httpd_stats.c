@@ -0,0 +1,327 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * /stats, a JSON snapshot of the LwIP and Ethernet driver counters served as
+ * a custom httpd file. Responses are built into a static buffer so nothing is
+ * allocated, if every buffer is busy the request gets a 404.
+ *
+ * With ETH_CAPTURE, /capture.pcap is the capture ring (see eth_capture.h),
+ * read into httpd's own buffers as it's sent. There's one download at a
+ * time, others get a 404 until it's done.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lwip/apps/fs.h>
+#include <lwip/memp.h>
+#include <lwip/stats.h>
+#include <lwip/sys.h>
+
+#include "eth.h"
+#include "eth_capture.h"
+#include "eth_classify.h"
+#include "log.h"
+#include "ping_latency.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "sys_arch.h"
+
+// Number of /stats requests that can be in flight at once
+#ifndef HTTPD_STATS_BUFFERS
+#define HTTPD_STATS_BUFFERS 1
+#endif
+
+// Size of each response, including the HTTP header. Enough for every counter
+// at its widest with the options that add to it, SIM_STATS_CHECK makes sure
+// (the profiler's histograms take the most).
+#ifndef HTTPD_STATS_SIZE
+#define HTTPD_STATS_SIZE (3072 + PROFILE * 2560 + ETH_PTP * 128 + ETH_CAPTURE * 128 + ETH_VLAN_COUNT * 64)
+#endif
+
+// Content-Length is written into the space left after it once the body has
+// been generated, so the connection can be kept alive for the next scrape
+#define HTTPD_STATS_HEADER \
+    "HTTP/1.1 200 OK\r\n" \
+    "Content-Type: application/json\r\n" \
+    "Cache-Control: no-cache\r\n" \
+    "Content-Length: "
+#define HTTPD_STATS_LENGTH_DIGITS 5
+#define HTTPD_STATS_BODY (sizeof(HTTPD_STATS_HEADER) - 1 + HTTPD_STATS_LENGTH_DIGITS + 4)
+
+struct stats_buffer {
+    int in_use;
+    uint32_t len;
+    char data[HTTPD_STATS_SIZE];
+};
+
+static struct stats_buffer stats_buffers[HTTPD_STATS_BUFFERS];
+
+#if ETH_CAPTURE
+#define HTTPD_CAPTURE_HEADER \
+    "HTTP/1.1 200 OK\r\n" \
+    "Content-Type: application/vnd.tcpdump.pcap\r\n" \
+    "Content-Disposition: attachment; filename=\"capture.pcap\"\r\n" \
+    "Cache-Control: no-cache\r\n" \
+    "Content-Length: %u\r\n\r\n"
+
+// Sent ahead of the pcap file, also marks the fs_file as /capture.pcap
+static struct {
+    char data[sizeof(HTTPD_CAPTURE_HEADER) + 8];
+    uint32_t len;
+} capture_header;
+#endif
+
+// Append to a buffer, once it's full everything else is dropped
+static void append(struct stats_buffer *buffer, const char *format, ...) {
+    if (buffer->len >= HTTPD_STATS_SIZE) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(&buffer->data[buffer->len], HTTPD_STATS_SIZE - buffer->len, format, args);
+    va_end(args);
+
+    if (n < 0 || (uint32_t)n >= HTTPD_STATS_SIZE - buffer->len) {
+        buffer->len = HTTPD_STATS_SIZE;
+    } else {
+        buffer->len += n;
+    }
+}
+
+static void append_proto(struct stats_buffer *buffer, const char *name, const struct stats_proto *proto) {
+    append(buffer, "\"%s\":{\"xmit\":%u,\"recv\":%u,\"fw\":%u,\"drop\":%u,\"chkerr\":%u,\"lenerr\":%u,\"memerr\":%u,\"rterr\":%u,\"proterr\":%u,\"opterr\":%u,\"err\":%u},",
+        name, (unsigned)proto->xmit, (unsigned)proto->recv, (unsigned)proto->fw, (unsigned)proto->drop,
+        (unsigned)proto->chkerr, (unsigned)proto->lenerr, (unsigned)proto->memerr, (unsigned)proto->rterr,
+        (unsigned)proto->proterr, (unsigned)proto->opterr, (unsigned)proto->err);
+}
+
+// Pools are written as [used, max, avail, err]
+static void append_mem(struct stats_buffer *buffer, const char *name, const struct stats_mem *mem) {
+    append(buffer, "\"%s\":[%u,%u,%u,%u]", name, (unsigned)mem->used, (unsigned)mem->max, (unsigned)mem->avail, (unsigned)mem->err);
+}
+
+static void generate(struct stats_buffer *buffer) {
+    eth_update_stats();
+    struct eth_ring_usage ring;
+    eth_get_ring_usage(&ring);
+
+    buffer->len = 0;
+    append(buffer, "%s%*s\r\n\r\n{\"uptime\":%u,", HTTPD_STATS_HEADER, HTTPD_STATS_LENGTH_DIGITS, "", (unsigned)sys_now());
+
+#if LINK_STATS
+    append_proto(buffer, "link", &lwip_stats.link);
+#endif
+#if IP_STATS
+    append_proto(buffer, "ip", &lwip_stats.ip);
+#endif
+#if TCP_STATS
+    append_proto(buffer, "tcp", &lwip_stats.tcp);
+#endif
+
+#if MEM_STATS
+    append_mem(buffer, "mem", &lwip_stats.mem);
+    append(buffer, ",");
+#endif
+#if MEMP_STATS
+    append(buffer, "\"memp\":{");
+    for (int i = 0; i < MEMP_MAX; i++) {
+        append_mem(buffer, lwip_stats.memp[i]->name, lwip_stats.memp[i]);
+        append(buffer, i == MEMP_MAX - 1 ? "}," : ",");
+    }
+#endif
+
+    append(buffer, "\"eth\":{\"rx_interrupts\":%u,\"rx_polled\":%u,\"rx_crc_errors\":%u,\"rx_overflow_errors\":%u,"
+        "\"rx_runt_errors\":%u,\"rx_length_errors\":%u,\"rx_other_errors\":%u,\"rx_missed_frames\":%u,\"rx_fifo_overflows\":%u,\"rx_sw_checksum\":%u,"
+        "\"rx_queue_max\":%u,\"rx_queue_drop\":%u,\"rx_pool_empty\":%u,\"tx_queued\":%u,\"tx_queue_max\":%u,\"tx_queue_drop\":%u,\"tx_raw\":%u,"
+        "\"rx_vlan_dropped\":%u},",
+        (unsigned)eth_stats.rx_interrupts, (unsigned)eth_stats.rx_polled, (unsigned)eth_stats.rx_crc_errors,
+        (unsigned)eth_stats.rx_overflow_errors, (unsigned)eth_stats.rx_runt_errors, (unsigned)eth_stats.rx_length_errors,
+        (unsigned)eth_stats.rx_other_errors, (unsigned)eth_stats.rx_missed_frames, (unsigned)eth_stats.rx_fifo_overflows,
+        (unsigned)eth_stats.rx_sw_checksum, (unsigned)eth_stats.rx_queue_max, (unsigned)eth_stats.rx_queue_drop,
+        (unsigned)eth_stats.rx_pool_empty, (unsigned)eth_stats.tx_queued, (unsigned)eth_stats.tx_queue_max,
+        (unsigned)eth_stats.tx_queue_drop, (unsigned)eth_stats.tx_raw, (unsigned)eth_stats.rx_vlan_dropped);
+
+#if ETH_CLASSIFY
+    // Classes are written as [frames, rate_drops, pressure_drops]
+    append(buffer, "\"classes\":{");
+    for (int i = 0; i < ETH_CLASS_COUNT; i++) {
+        const struct eth_class_stats *class = &eth_class_stats[i];
+        append(buffer, "\"%s\":[%u,%u,%u]%s", eth_class_names[i], (unsigned)class->frames,
+            (unsigned)class->rate_drops, (unsigned)class->pressure_drops, i == ETH_CLASS_COUNT - 1 ? "}," : ",");
+    }
+#endif
+
+#if ETH_VLAN_COUNT
+    // VLANs are written as [rx_frames, rx_bytes, tx_frames, tx_bytes] by ID
+    append(buffer, "\"vlans\":{");
+    const char *vlan_separator = "";
+    for (int i = 0; i < ETH_VLAN_COUNT; i++) {
+        const struct eth_vlan_stats *vlan = &eth_vlan_stats[i];
+        if (vlan->id == 0) {
+            continue;
+        }
+        append(buffer, "%s\"%u\":[%u,%u,%u,%u]", vlan_separator, (unsigned)vlan->id, (unsigned)vlan->rx_frames,
+            (unsigned)vlan->rx_bytes, (unsigned)vlan->tx_frames, (unsigned)vlan->tx_bytes);
+        vlan_separator = ",";
+    }
+    append(buffer, "},");
+#endif
+
+#if ETH_CAPTURE
+    append(buffer, "\"capture\":{\"captured\":%u,\"overwritten\":%u,\"busy\":%u},", (unsigned)eth_capture_stats.captured,
+        (unsigned)eth_capture_stats.overwritten, (unsigned)eth_capture_stats.busy);
+#endif
+    append(buffer, "\"log\":{\"written\":%u,\"dropped\":%u},", (unsigned)log_stats.written, (unsigned)log_stats.dropped);
+    // Microseconds from boot, 0 if it hasn't happened yet
+    append(buffer, "\"boot\":{\"eth_up\":%u,\"first_rx\":%u,\"first_tx\":%u},",
+        (unsigned)eth_stats.boot_up_us, (unsigned)eth_stats.boot_first_rx_us, (unsigned)eth_stats.boot_first_tx_us);
+#if ETH_PTP
+    // Time between the echo request and reply going past on the wire, in ns
+    const struct ping_latency_stats *ping = &ping_latency_stats;
+    append(buffer, "\"ping\":{\"samples\":%u,\"min\":%u,\"mean\":%u,\"max\":%u},", (unsigned)ping->samples,
+        (unsigned)ping->min_ns, ping->samples ? (unsigned)(ping->total_ns / ping->samples) : 0u, (unsigned)ping->max_ns);
+#endif
+
+#if PROFILE
+    // Probes are written as [count, min, mean, max, [histogram]] in PROFILE_NOW()
+    // ticks, the histogram stops at the last bucket with anything in it
+    append(buffer, "\"profile\":{");
+    for (int i = 0; i < PROFILE_PROBE_COUNT; i++) {
+        const struct profile_stats *probe = &profile_stats[i];
+        append(buffer, "\"%s\":[%u,%u,%u,%u,[", profile_probe_names[i], (unsigned)probe->count, (unsigned)probe->min,
+            probe->count ? (unsigned)(probe->total / probe->count) : 0u, (unsigned)probe->max);
+        int buckets = 32;
+        while (buckets > 0 && probe->histogram[buckets - 1] == 0) {
+            buckets--;
+        }
+        for (int bucket = 0; bucket < buckets; bucket++) {
+            append(buffer, bucket == 0 ? "%u" : ",%u", (unsigned)probe->histogram[bucket]);
+        }
+        append(buffer, i == PROFILE_PROBE_COUNT - 1 ? "]]}," : "]],");
+    }
+#endif
+
+    // Tasks are written as [runs, max run time, max latency, overruns], times in us
+    append(buffer, "\"sched\":{");
+    const char *separator = "";
+    for (int i = 0; i < SCHED_MAX_TASKS; i++) {
+        const struct sched_task *task = &sched_tasks[i];
+        if (task->fn == NULL) {
+            continue;
+        }
+        append(buffer, "%s\"%s\":[%u,%u,%u,%u]", separator, task->name, (unsigned)task->runs,
+            (unsigned)(task->max_run / SYS_TICKS_PER_US), (unsigned)(task->max_latency / SYS_TICKS_PER_US), (unsigned)task->overruns);
+        separator = ",";
+    }
+    append(buffer, "},");
+
+    append(buffer, "\"ring\":{\"rx_size\":%u,\"rx_ready\":%u,\"rx_held\":%u,\"tx_size\":%u,\"tx_busy\":%u,\"tx_queued\":%u}}\n",
+        (unsigned)ETH_RX_RING_SIZE, (unsigned)ring.rx_ready, (unsigned)ring.rx_held,
+        (unsigned)ETH_TX_RING_SIZE, (unsigned)ring.tx_busy, (unsigned)ring.tx_queued);
+
+    if (buffer->len < HTTPD_STATS_SIZE) {
+        // Right aligned, the spaces in front are allowed
+        char length[HTTPD_STATS_LENGTH_DIGITS + 1];
+        snprintf(length, sizeof(length), "%*u", HTTPD_STATS_LENGTH_DIGITS, (unsigned)(buffer->len - HTTPD_STATS_BODY));
+        memcpy(&buffer->data[sizeof(HTTPD_STATS_HEADER) - 1], length, HTTPD_STATS_LENGTH_DIGITS);
+    }
+}
+
+#if ETH_CAPTURE
+static int open_capture(struct fs_file *file) {
+    uint32_t size = eth_capture_open();
+    if (size == 0) {
+        return 0;
+    }
+
+    capture_header.len = snprintf(capture_header.data, sizeof(capture_header.data), HTTPD_CAPTURE_HEADER, (unsigned)size);
+    memset(file, 0, sizeof(struct fs_file));
+    // Without data httpd gets it from fs_read_custom()
+    file->len = capture_header.len + size;
+    file->pextension = &capture_header;
+    file->flags = FS_FILE_FLAGS_HEADER_INCLUDED | FS_FILE_FLAGS_HEADER_PERSISTENT | FS_FILE_FLAGS_HEADER_HTTPVER_1_1;
+    return 1;
+}
+
+int fs_read_custom(struct fs_file *file, char *buffer, int count) {
+    if (file->pextension != &capture_header) {
+        return FS_READ_EOF;
+    }
+
+    uint32_t done = 0;
+    if ((uint32_t)file->index < capture_header.len) {
+        done = capture_header.len - file->index;
+        if (done > (uint32_t)count) {
+            done = count;
+        }
+        memcpy(buffer, &capture_header.data[file->index], done);
+    }
+    done += eth_capture_read((uint8_t *)&buffer[done], count - done);
+
+    file->index += done;
+    return done != 0 ? (int)done : FS_READ_EOF;
+}
+#endif
+
+int fs_open_custom(struct fs_file *file, const char *name) {
+#if ETH_CAPTURE
+    if (strcmp(name, "/capture.pcap") == 0) {
+        return open_capture(file);
+    }
+#endif
+    if (strcmp(name, "/stats") != 0 && strcmp(name, "/stats.json") != 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < HTTPD_STATS_BUFFERS; i++) {
+        struct stats_buffer *buffer = &stats_buffers[i];
+        if (buffer->in_use) {
+            continue;
+        }
+
+        generate(buffer);
+        if (buffer->len >= HTTPD_STATS_SIZE) {
+            // Truncated JSON is worse than nothing, make HTTPD_STATS_SIZE bigger
+            return 0;
+        }
+
+        buffer->in_use = 1;
+        memset(file, 0, sizeof(struct fs_file));
+        file->data = buffer->data;
+        file->len = buffer->len;
+        file->index = buffer->len;
+        file->pextension = buffer;
+        file->flags = FS_FILE_FLAGS_HEADER_INCLUDED | FS_FILE_FLAGS_HEADER_PERSISTENT | FS_FILE_FLAGS_HEADER_HTTPVER_1_1;
+        return 1;
+    }
+
+    return 0;
+}
+
+void fs_close_custom(struct fs_file *file) {
+#if ETH_CAPTURE
+    if (file->pextension == &capture_header) {
+        eth_capture_close();
+        return;
+    }
+#endif
+    struct stats_buffer *buffer = file->pextension;
+    if (buffer != NULL) {
+        buffer->in_use = 0;
+    }
+}
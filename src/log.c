@@ -0,0 +1,498 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * A record in the ring is a header word (the number of argument words plus
+ * one, so zero means not written yet), the format string pointer and the
+ * arguments. Writers reserve space by moving log_head forward with a CAS and
+ * write the header last, the reader (only ever the main loop) stops at the
+ * first record that isn't finished and zeroes each one after formatting it.
+ */
+
+#include <stddef.h>
+
+#include "log.h"
+#include "scheduler.h"
+#include "sys_arch.h"
+
+#define MASK (LOG_RING_SIZE - 1)
+// 64-bit arguments take two words on the board, one on the host
+#define WORDS_64 (sizeof(uint64_t) / sizeof(uintptr_t))
+
+struct log_stats log_stats;
+
+static volatile uintptr_t log_ring[LOG_RING_SIZE];
+// Everything before head has been reserved, everything before tail is free again
+#if LOG
+static uint32_t log_head;
+#endif
+static volatile uint32_t log_tail;
+
+static char log_buffer[LOG_BUFFER_SIZE];
+
+enum {
+    FLAG_LEFT = 1 << 0,
+    FLAG_ZERO = 1 << 1,
+    FLAG_PLUS = 1 << 2,
+    FLAG_SPACE = 1 << 3,
+    FLAG_ALT = 1 << 4,
+    FLAG_WIDTH_ARG = 1 << 5,
+    FLAG_PRECISION_ARG = 1 << 6
+};
+
+enum { SIZE_CHAR, SIZE_SHORT, SIZE_INT, SIZE_LONG, SIZE_64 };
+
+// A conversion specification, everything after the '%'
+struct spec {
+    uint8_t flags;
+    uint8_t size;
+    char conversion;
+    int width;
+    // -1 if there isn't one
+    int precision;
+};
+
+static const char *parse_spec(const char *p, struct spec *spec) {
+    spec->flags = 0;
+    spec->size = SIZE_INT;
+    spec->width = 0;
+    spec->precision = -1;
+
+    for (;; p++) {
+        if (*p == '-') {
+            spec->flags |= FLAG_LEFT;
+        } else if (*p == '0') {
+            spec->flags |= FLAG_ZERO;
+        } else if (*p == '+') {
+            spec->flags |= FLAG_PLUS;
+        } else if (*p == ' ') {
+            spec->flags |= FLAG_SPACE;
+        } else if (*p == '#') {
+            spec->flags |= FLAG_ALT;
+        } else {
+            break;
+        }
+    }
+
+    if (*p == '*') {
+        spec->flags |= FLAG_WIDTH_ARG;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        spec->width = spec->width * 10 + (*p++ - '0');
+    }
+    if (*p == '.') {
+        p++;
+        spec->precision = 0;
+        if (*p == '*') {
+            spec->flags |= FLAG_PRECISION_ARG;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            spec->precision = spec->precision * 10 + (*p++ - '0');
+        }
+    }
+
+    // size_t and ptrdiff_t are long sized, h and hh are passed as int
+    if (*p == 'h' && p[1] == 'h') {
+        spec->size = SIZE_CHAR;
+        p += 2;
+    } else if (*p == 'h') {
+        spec->size = SIZE_SHORT;
+        p++;
+    } else if (*p == 'l' && p[1] == 'l') {
+        spec->size = sizeof(long long) == 8 ? SIZE_64 : SIZE_LONG;
+        p += 2;
+    } else if (*p == 'j') {
+        spec->size = SIZE_64;
+        p++;
+    } else if (*p == 'l' || *p == 'z' || *p == 't') {
+        spec->size = SIZE_LONG;
+        p++;
+    }
+
+    spec->conversion = *p;
+    return *p ? p + 1 : p;
+}
+
+static int is_integer(char conversion) {
+    switch (conversion) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int is_float(char conversion) {
+    switch (conversion) {
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+#if LOG
+struct arg_list {
+    uintptr_t words[LOG_MAX_ARGS];
+    uint32_t count;
+};
+
+static void push(struct arg_list *list, uintptr_t word) {
+    if (list->count < LOG_MAX_ARGS) {
+        list->words[list->count++] = word;
+    }
+}
+
+static void push_64(struct arg_list *list, uint64_t value) {
+    if (WORDS_64 == 1) {
+        push(list, (uintptr_t)value);
+    } else {
+        push(list, (uintptr_t)value);
+        push(list, (uintptr_t)(value >> 32));
+    }
+}
+
+// Walk the format string just far enough to know what every argument is
+static void collect(struct arg_list *list, const char *format, va_list args) {
+    const char *p = format;
+    while (*p) {
+        if (*p++ != '%') {
+            continue;
+        }
+
+        struct spec spec;
+        p = parse_spec(p, &spec);
+        if (spec.flags & FLAG_WIDTH_ARG) {
+            push(list, (unsigned int)va_arg(args, int));
+        }
+        if (spec.flags & FLAG_PRECISION_ARG) {
+            push(list, (unsigned int)va_arg(args, int));
+        }
+
+        if (is_integer(spec.conversion)) {
+            if (spec.size == SIZE_64) {
+                push_64(list, va_arg(args, unsigned long long));
+            } else if (spec.size == SIZE_LONG) {
+                push(list, va_arg(args, unsigned long));
+            } else {
+                push(list, va_arg(args, unsigned int));
+            }
+        } else if (spec.conversion == 's' || spec.conversion == 'p') {
+            push(list, (uintptr_t)va_arg(args, const void *));
+        } else if (is_float(spec.conversion)) {
+            // Not kept, printed as '?'
+            (void)va_arg(args, double);
+        } else if (spec.conversion != '%') {
+            // No way of knowing what the argument was, so nothing after it can be trusted
+            return;
+        }
+    }
+}
+
+void log_vprintf(const char *format, va_list args) {
+    struct arg_list list;
+    list.count = 0;
+    collect(&list, format, args);
+
+    uint32_t words = 2 + list.count;
+    uint32_t head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    do {
+        if (head + words - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE) {
+            __atomic_fetch_add(&log_stats.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&log_head, &head, head + words, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    log_ring[(head + 1) & MASK] = (uintptr_t)format;
+    for (uint32_t i = 0; i < list.count; i++) {
+        log_ring[(head + 2 + i) & MASK] = list.words[i];
+    }
+    __atomic_store_n(&log_ring[head & MASK], list.count + 1, __ATOMIC_RELEASE);
+
+    __atomic_fetch_add(&log_stats.written, 1, __ATOMIC_RELAXED);
+    sched_post(SCHED_LOG);
+}
+
+void log_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vprintf(format, args);
+    va_end(args);
+}
+#endif
+
+// snprintf() style output, len keeps counting past the end of the buffer
+struct output {
+    char *buffer;
+    uint32_t size;
+    uint32_t len;
+};
+
+static void put(struct output *out, char c) {
+    if (out->len + 1 < out->size) {
+        out->buffer[out->len] = c;
+    }
+    out->len++;
+}
+
+static void pad(struct output *out, char c, int count) {
+    while (count-- > 0) {
+        put(out, c);
+    }
+}
+
+static void put_string(struct output *out, const struct spec *spec, const char *string) {
+    if (string == NULL) {
+        string = "(null)";
+    }
+    int len = 0;
+    while (string[len] && (spec->precision < 0 || len < spec->precision)) {
+        len++;
+    }
+
+    if (!(spec->flags & FLAG_LEFT)) {
+        pad(out, ' ', spec->width - len);
+    }
+    for (int i = 0; i < len; i++) {
+        put(out, string[i]);
+    }
+    if (spec->flags & FLAG_LEFT) {
+        pad(out, ' ', spec->width - len);
+    }
+}
+
+static void put_number(struct output *out, const struct spec *spec, uint64_t value, int negative) {
+    uint32_t base = 10;
+    const char *digits = "0123456789abcdef";
+    const char *prefix = "";
+    if (spec->conversion == 'x' || spec->conversion == 'X' || spec->conversion == 'p') {
+        base = 16;
+        if (spec->conversion == 'X') {
+            digits = "0123456789ABCDEF";
+        }
+        if (spec->conversion == 'p' || ((spec->flags & FLAG_ALT) && value != 0)) {
+            prefix = spec->conversion == 'X' ? "0X" : "0x";
+        }
+    } else if (spec->conversion == 'o') {
+        base = 8;
+        if (spec->flags & FLAG_ALT) {
+            prefix = "0";
+        }
+    } else if (negative) {
+        prefix = "-";
+    } else if (spec->flags & FLAG_PLUS) {
+        prefix = "+";
+    } else if (spec->flags & FLAG_SPACE) {
+        prefix = " ";
+    }
+
+    char text[24];
+    int len = 0;
+    // A precision of 0 prints nothing for 0
+    if (value != 0 || spec->precision != 0) {
+        do {
+            text[len++] = digits[value % base];
+            value /= base;
+        } while (value != 0);
+    }
+    if (base == 8 && *prefix && len > 0 && text[len - 1] == '0') {
+        prefix = "";
+    }
+
+    int prefix_len = 0;
+    while (prefix[prefix_len]) {
+        prefix_len++;
+    }
+    int zeros = spec->precision > len ? spec->precision - len : 0;
+    int total = prefix_len + zeros + len;
+    if ((spec->flags & (FLAG_ZERO | FLAG_LEFT)) == FLAG_ZERO && spec->precision < 0 && spec->width > total) {
+        zeros += spec->width - total;
+        total = spec->width;
+    }
+
+    if (!(spec->flags & FLAG_LEFT)) {
+        pad(out, ' ', spec->width - total);
+    }
+    for (int i = 0; i < prefix_len; i++) {
+        put(out, prefix[i]);
+    }
+    pad(out, '0', zeros);
+    while (len > 0) {
+        put(out, text[--len]);
+    }
+    if (spec->flags & FLAG_LEFT) {
+        pad(out, ' ', spec->width - total);
+    }
+}
+
+uint32_t log_format_record(char *buffer, uint32_t size, const char *format, const uintptr_t *args, uint32_t count) {
+    struct output out = { buffer, size, 0 };
+    uint32_t next = 0;
+    // Missing arguments (past LOG_MAX_ARGS) read as 0 and mark the conversion
+    int missing;
+#define POP() (next < count ? args[next++] : (missing = 1, 0))
+
+    const char *p = format;
+    while (*p) {
+        if (*p != '%') {
+            put(&out, *p++);
+            continue;
+        }
+
+        const char *start = p;
+        struct spec spec;
+        p = parse_spec(p + 1, &spec);
+        missing = 0;
+        if (spec.flags & FLAG_WIDTH_ARG) {
+            int width = (int)(unsigned int)POP();
+            if (width < 0) {
+                spec.flags |= FLAG_LEFT;
+                width = -width;
+            }
+            spec.width = width;
+        }
+        if (spec.flags & FLAG_PRECISION_ARG) {
+            int precision = (int)(unsigned int)POP();
+            spec.precision = precision < 0 ? -1 : precision;
+        }
+
+        if (is_integer(spec.conversion)) {
+            uint64_t value;
+            if (spec.size == SIZE_64) {
+                value = POP();
+                if (WORDS_64 != 1) {
+                    value |= (uint64_t)POP() << 32;
+                }
+            } else {
+                value = POP();
+            }
+
+            int is_signed = spec.conversion == 'd' || spec.conversion == 'i';
+            int negative = 0;
+            if (spec.size == SIZE_CHAR) {
+                value = is_signed ? (uint64_t)(int64_t)(signed char)value : (unsigned char)value;
+            } else if (spec.size == SIZE_SHORT) {
+                value = is_signed ? (uint64_t)(int64_t)(short)value : (unsigned short)value;
+            } else if (spec.size == SIZE_INT) {
+                value = is_signed ? (uint64_t)(int64_t)(int)(unsigned int)value : (unsigned int)value;
+            } else if (spec.size == SIZE_LONG && is_signed) {
+                value = (uint64_t)(int64_t)(long)value;
+            }
+            if (is_signed && (int64_t)value < 0) {
+                negative = 1;
+                value = -value;
+            }
+
+            if (missing) {
+                put(&out, '?');
+            } else if (spec.conversion == 'c') {
+                char c[2] = { (char)value, '\0' };
+                spec.precision = -1;
+                put_string(&out, &spec, c);
+            } else {
+                put_number(&out, &spec, value, negative);
+            }
+        } else if (spec.conversion == 's' || spec.conversion == 'p') {
+            uintptr_t value = POP();
+            if (missing) {
+                put(&out, '?');
+            } else if (spec.conversion == 's') {
+                put_string(&out, &spec, (const char *)value);
+            } else {
+                put_number(&out, &spec, value, 0);
+            }
+        } else if (spec.conversion == '%') {
+            put(&out, '%');
+        } else if (is_float(spec.conversion)) {
+            put(&out, '?');
+        } else {
+            // Unknown, print it as it is along with the rest
+            while (start < p) {
+                put(&out, *start++);
+            }
+            while (*p) {
+                put(&out, *p++);
+            }
+        }
+    }
+#undef POP
+
+    if (size != 0) {
+        buffer[out.len < size ? out.len : size - 1] = '\0';
+    }
+    return out.len;
+}
+
+uint32_t log_format(char *buffer, uint32_t size) {
+    uint32_t len = 0;
+    uint32_t tail = log_tail;
+    while (size - len >= LOG_LINE_SIZE) {
+        uintptr_t header = __atomic_load_n(&log_ring[tail & MASK], __ATOMIC_ACQUIRE);
+        if (header == 0) {
+            break;
+        }
+
+        uint32_t count = header - 1;
+        uint32_t words = 2 + count;
+        const char *format = (const char *)log_ring[(tail + 1) & MASK];
+        uintptr_t args[LOG_MAX_ARGS];
+        for (uint32_t i = 0; i < count; i++) {
+            args[i] = log_ring[(tail + 2 + i) & MASK];
+        }
+
+        uint32_t n = log_format_record(&buffer[len], LOG_LINE_SIZE, format, args, count);
+        if (n >= LOG_LINE_SIZE) {
+            // Cut short, but still ends the line
+            n = LOG_LINE_SIZE - 1;
+            buffer[len + n - 1] = '\n';
+        }
+        len += n;
+
+        for (uint32_t i = 0; i < words; i++) {
+            log_ring[(tail + i) & MASK] = 0;
+        }
+        tail += words;
+        __atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+    }
+    return len;
+}
+
+int log_task(void) {
+    if (sys_uart_busy()) {
+        // log_tx_done() posts this again
+        return 0;
+    }
+
+    uint32_t len = log_format(log_buffer, sizeof(log_buffer));
+    if (len != 0) {
+        sys_uart_send(log_buffer, len);
+    }
+    // Only when the UART finishes straight away (on the host)
+    return !sys_uart_busy() && log_ring[log_tail & MASK] != 0;
+}
+
+void log_tx_done(void) {
+    sched_post(SCHED_LOG);
+}
+
+void log_flush(void) {
+    while (sys_uart_busy());
+
+    uint32_t len;
+    while ((len = log_format(log_buffer, sizeof(log_buffer))) != 0) {
+        sys_uart_write(log_buffer, len);
+    }
+}
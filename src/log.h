@@ -0,0 +1,93 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Non-blocking logging. log_printf() only stores the format string pointer
+ * and the raw arguments in a lock-free ring, which is safe from interrupts
+ * and never waits; the text is formatted later by the SCHED_LOG task and sent
+ * out by UART DMA (see sys_uart_send()). When the ring is full records are
+ * counted and dropped.
+ *
+ * Since formatting is deferred, the format string and anything passed for %s
+ * have to still be there when the task gets to it, i.e. string literals or
+ * other constant data, not buffers on the stack. Floating point isn't
+ * supported.
+ */
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#ifndef LOG
+#define LOG 1
+#endif
+
+// Size of the ring in words, a power of 2. A record takes two words plus one
+// per argument (two for 64-bit ones).
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 256
+#endif
+// Words of arguments kept per record, any more are printed as '?'
+#ifndef LOG_MAX_ARGS
+#define LOG_MAX_ARGS 8
+#endif
+// Bytes formatted for each UART transfer, and the longest a line can get
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 256
+#endif
+#ifndef LOG_LINE_SIZE
+#define LOG_LINE_SIZE 128
+#endif
+
+#if (LOG_RING_SIZE & (LOG_RING_SIZE - 1)) != 0
+#error "LOG_RING_SIZE must be a power of 2"
+#endif
+#if LOG_LINE_SIZE > LOG_BUFFER_SIZE
+#error "LOG_LINE_SIZE must fit in LOG_BUFFER_SIZE"
+#endif
+
+struct log_stats {
+    uint32_t written;
+    uint32_t dropped;
+};
+
+extern struct log_stats log_stats;
+
+#if LOG
+void log_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_vprintf(const char *format, va_list args);
+#else
+// Straight to the SDK's blocking printf
+#include <stdio.h>
+#define log_printf printf
+#define log_vprintf vprintf
+#endif
+
+// Format as many whole records as fit into buffer (at least LOG_LINE_SIZE
+// bytes) and take them off the ring, returns the number of bytes written
+uint32_t log_format(char *buffer, uint32_t size);
+// Format one record, returns the length it would have had like snprintf(),
+// args holds count words as stored by log_vprintf()
+uint32_t log_format_record(char *buffer, uint32_t size, const char *format, const uintptr_t *args, uint32_t count);
+
+// SCHED_LOG task, starts the next UART transfer if the last one is done
+int log_task(void);
+// Called by the UART DMA interrupt once a transfer has finished
+void log_tx_done(void);
+// Write out everything left with interrupts off, for fault handlers
+void log_flush(void);
+
+#endif
@@ -17,32 +17,88 @@
 #ifndef LWIPOPTS_H_
 #define LWIPOPTS_H_
 
+// TCP window, heap, pbuf pool and DMA ring sizes
+#include "net_profile.h"
+
 // Basic config
 #define NO_SYS 1
 #define LWIP_SOCKET 0
 #define LWIP_NETCONN 0
 #define LWIP_NOASSERT 1
 
-// Memory
-#define MEM_SIZE (16 * 1024)
+// Memory, MEM_SIZE comes from net_profile.h
 #define MEM_ALIGNMENT 4
+// Needed for zero-copy RX
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
 
 // NETIF
 #define LWIP_NETIF_HOSTNAME 1
 
-// Checksums, all done in hardware :)
+// Multicast, filtered by the MAC's hash table
+#define LWIP_IGMP 1
+
+// DHCP, off unless built with -DDHCP=ON. Leases are kept in flash (see
+// net_config.h) from the status callback, so the next boot starts out with one
+#ifndef LWIP_DHCP
+#define LWIP_DHCP 0
+#endif
+#define LWIP_NETIF_STATUS_CALLBACK LWIP_DHCP
+
+// VLANs, see ch32netif_vlan_init(). Tags are added as LwIP builds the Ethernet
+// header of frames from VLAN netifs, and taken off by the driver on the way in
+#ifndef ETH_VLAN_COUNT
+#define ETH_VLAN_COUNT 0
+#endif
+#if ETH_VLAN_COUNT
+#define ETHARP_SUPPORT_VLAN 1
+struct netif;
+int eth_vlan_tag(const struct netif *netif);
+#define LWIP_HOOK_VLAN_SET(netif, p, src, dst, eth_type) eth_vlan_tag(netif)
+#endif
+
+// Timers, plus one for eth_init() checking on the MAC and PHY resets
+#define MEMP_NUM_SYS_TIMEOUT (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 1)
+
+// Checksums
+// Generation is done in hardware :)
 #define CHECKSUM_GEN_IP      0
 #define CHECKSUM_GEN_UDP     0
 #define CHECKSUM_GEN_TCP     0
 #define CHECKSUM_GEN_ICMP    0
 #define CHECKSUM_GEN_ICMP6   0
-#define CHECKSUM_CHECK_IP    0
-#define CHECKSUM_CHECK_UDP   0
-#define CHECKSUM_CHECK_TCP   0
-#define CHECKSUM_CHECK_ICMP  0
+// So is checking, except for IP fragments and anything else the MAC lets
+// through unchecked. The driver turns these on per frame (see eth_rx_poll())
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+#define CHECKSUM_CHECK_IP    1
+#define CHECKSUM_CHECK_UDP   1
+#define CHECKSUM_CHECK_TCP   1
+#define CHECKSUM_CHECK_ICMP  1
 #define CHECKSUM_CHECK_ICMP6 0
+// LwIP's own checksum is kept as a reference for the host benchmark, the
+// firmware uses ch32_chksum() and --gc-sections drops it
+#define LWIP_CHKSUM_ALGORITHM 3
 
-// HTTP server returns garbage without this
-#define HTTP_IS_DATA_VOLATILE(hs) TCP_WRITE_FLAG_COPY
+// Stats, the names of each pool are needed for /stats
+#define LWIP_STATS_DISPLAY 1
+
+// HTTP server
+// Built from www/ by scripts/makefsdata.py, with the headers included
+#define HTTPD_FSDATA_FILE "fsdata_www.c"
+// Every response has a Content-Length, so connections can be reused
+#define LWIP_HTTPD_SUPPORT_11_KEEPALIVE 1
+// Idle keep-alive connections would otherwise hold every PCB (see
+// MEMP_NUM_TCP_PCB in net_profile.h), close the oldest to make room
+#define LWIP_HTTPD_KILL_OLD_ON_CONNECTIONS_EXCEEDED 1
+// /stats is generated on the fly (see httpd_stats.c)
+#define LWIP_HTTPD_CUSTOM_FILES 1
+// /capture.pcap is read from the capture ring a piece at a time as it's sent,
+// see eth_capture.h
+#ifndef ETH_CAPTURE
+#define ETH_CAPTURE 0
+#endif
+#define LWIP_HTTPD_DYNAMIC_FILE_READ ETH_CAPTURE
+// Generated files get reused, so they need to be copied. Everything else is
+// static and sent straight from flash
+#define HTTP_IS_DATA_VOLATILE(hs) (((hs)->handle != NULL && (hs)->handle->is_custom_file) ? TCP_WRITE_FLAG_COPY : 0)
 
 #endif
@@ -20,114 +20,259 @@
 #include <lwip/timeouts.h>
 #include <netif/ethernet.h>
 #include <lwip/apps/httpd.h>
+#if LWIPERF
+#include <lwip/apps/lwiperf.h>
+#endif
+#if LWIP_DHCP
+#include <lwip/dhcp.h>
+#endif
 
 #include "eth.h"
+#include "log.h"
+#include "net_config.h"
+#include "ping_latency.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "sys_arch.h"
 
+#ifndef INTERRUPT
 #define INTERRUPT(name) __attribute__((interrupt("WCH-Interrupt-fast"))) void name(void)
+#endif
 #define PHY_ADDRESS 1
-#define ETH_RX_RING_SIZE 6
-#define ETH_TX_RING_SIZE 2
 #define UART_BAUDRATE 115200
 
-__attribute__((aligned(4))) ETH_DMADESCTypeDef eth_dma_rx[ETH_RX_RING_SIZE];
-__attribute__((aligned(4))) ETH_DMADESCTypeDef eth_dma_tx[ETH_TX_RING_SIZE];
-__attribute__((aligned(4))) uint8_t eth_buffer_rx[ETH_RX_RING_SIZE][ETH_MAX_PACKET_SIZE];
-__attribute__((aligned(4))) uint8_t eth_buffer_tx[ETH_TX_RING_SIZE][ETH_MAX_PACKET_SIZE];
-struct pbuf *p = NULL;
-volatile int have_frame = 0;
-volatile int link_status_update = 0;
+// Longest a single RX run can take before letting other tasks in
+#ifndef RX_BUDGET_US
+#define RX_BUDGET_US 1000
+#endif
+
+static struct netif netif;
+#ifdef VLAN_IDS
+// A netif for each VLAN in the comma separated VLAN_IDS, with the address
+// 192.168.<ID>.10 (the lower byte of it)
+static const uint16_t vlan_ids[] = { VLAN_IDS };
+#define VLAN_NETIFS (sizeof(vlan_ids) / sizeof(vlan_ids[0]))
+static struct netif vlan_netifs[VLAN_NETIFS];
+#endif
 
 INTERRUPT(NMI_Handler) {
-    printf("Something bad happened");
+    log_printf("Something bad happened\n");
 }
 
 INTERRUPT(HardFault_Handler) {
-    printf("Something very bad happened");
+    log_printf("Something very bad happened\n");
+    // Nothing else is going to run, get the log out by hand
+    log_flush();
     while(1);
 }
 
 INTERRUPT(ETH_IRQHandler) {
-    // Receive
-    if (ETH_GetDMAITStatus(ETH_DMA_IT_R)) {
-        ETH_DMAClearITPendingBit(ETH_DMA_IT_R);
-        if (have_frame == 0) {
-            uint8_t *buffer;
-            uint16_t length;
-            if (eth_get_packet(&buffer, &length) == ETH_ERROR) {
-                return;
-            }
-
-            p = pbuf_alloc(PBUF_RAW, length, PBUF_POOL);
-            pbuf_take(p, buffer, length);
-            have_frame = 1;
-        }
+    PROFILE_SCOPE(PROFILE_ISR);
+
+    // Receive, the status is still set while the interrupt is masked for polling
+    if ((ETH->DMAIER & ETH_DMA_IT_R) && ETH_GetDMAITStatus(ETH_DMA_IT_R)) {
+        eth_rx_irq();
+        sched_post(SCHED_RX);
+    }
+
+    // Transmit complete, descriptors are reclaimed from the main loop
+    // since freeing pbufs here could race with LwIP
+    if (ETH_GetDMAITStatus(ETH_DMA_IT_T)) {
+        ETH_DMAClearITPendingBit(ETH_DMA_IT_T);
+        sched_post(SCHED_TX);
     }
 
     // Link status
     if (ETH_GetDMAITStatus(ETH_DMA_IT_PHYLINK)) {
         ETH_DMAClearITPendingBit(ETH_DMA_IT_PHYLINK);
-        link_status_update = 1;
+        sched_post(SCHED_LINK);
     }
 
     // Normal interrupt
     ETH_DMAClearITPendingBit(ETH_DMA_IT_NIS);
 }
 
+static void set_link(int up) {
+    if (up) {
+        netif_set_link_up(&netif);
+    } else {
+        netif_set_link_down(&netif);
+    }
+#ifdef VLAN_IDS
+    for (uint32_t i = 0; i < VLAN_NETIFS; i++) {
+        if (up) {
+            netif_set_link_up(&vlan_netifs[i]);
+        } else {
+            netif_set_link_down(&vlan_netifs[i]);
+        }
+    }
+#endif
+}
+
+static int link_task(void) {
+    if (ETH_ReadPHYRegister(PHY_ADDRESS, PHY_BMSR) & PHY_Linked_Status) {
+        set_link(1);
+        uint32_t mode;
+        if (ETH_ReadPHYRegister(PHY_ADDRESS, PHY_BMCR) & (1 << 8)) {
+            mode = ETH_Mode_FullDuplex;
+            log_printf("Link up full-duplex\n");
+        } else {
+            mode = ETH_Mode_HalfDuplex;
+            log_printf("Link up half-duplex\n");
+        }
+
+        // Send auto negotiated values to the MAC
+        ETH->MACCR &= ~0x0000C800;
+        ETH->MACCR |= mode | ETH_Speed_10M;
+    } else {
+        set_link(0);
+        log_printf("Link down\n");
+    }
+    return 0;
+}
+
+static int tx_task(void) {
+    eth_tx_poll();
+    return 0;
+}
+
+static int rx_task(void) {
+    do {
+        eth_rx_poll(&netif, ETH_RX_BATCH);
+        if (!eth_rx_pending()) {
+            return 0;
+        }
+    } while (!sched_over_budget());
+    return 1;
+}
+
+static int timers_task(void) {
+    sys_check_timeouts();
+    return 0;
+}
+
+static void eth_up(uint32_t status) {
+    if (status != ETH_SUCCESS) {
+        // Nothing works without it, keep trying
+        eth_init(PHY_ADDRESS, eth_up);
+        return;
+    }
+
+    log_printf("MAC ready %u us after boot\n", (unsigned)eth_stats.boot_up_us);
+    // Check the PHY, the link may have come up before its interrupt was enabled
+    sched_post(SCHED_LINK);
+}
+
+#if LWIP_DHCP
+static void netif_status(struct netif *netif) {
+    if (!dhcp_supplied_address(netif)) {
+        return;
+    }
+
+    // Keep the lease for the next boot
+    struct net_config config = {
+        .address = *netif_ip4_addr(netif),
+        .netmask = *netif_ip4_netmask(netif),
+        .gateway = *netif_ip4_gw(netif),
+    };
+    if (net_config_save(&config) != ERR_OK) {
+        log_printf("Error: couldn't save the network config\n");
+    }
+}
+#endif
+
+#if LWIPERF
+static void lwiperf_report(void *arg, enum lwiperf_report_type report_type,
+                           const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr, u16_t remote_port,
+                           u32_t bytes_transferred, u32_t ms_duration, u32_t bandwidth_kbitpsec) {
+    (void)arg;
+    (void)local_addr;
+    (void)local_port;
+    (void)remote_port;
+    // The address is passed by value, log_printf() formats it later
+    const ip4_addr_t *remote = ip_2_ip4(remote_addr);
+    log_printf("iperf: %u.%u.%u.%u %s, %u bytes in %u ms, %u kbit/s\n",
+        ip4_addr1_16(remote), ip4_addr2_16(remote), ip4_addr3_16(remote), ip4_addr4_16(remote),
+        report_type == LWIPERF_TCP_DONE_SERVER ? "done" : "aborted",
+        (unsigned)bytes_transferred,
+        (unsigned)ms_duration,
+        (unsigned)bandwidth_kbitpsec
+    );
+}
+#endif
+
 int main(void) {
-    // Enable SysTick with HCLK/8
-    // This will overflow every 32475 years, give or take
-    SysTick->CTLR = 1;
+#if HIGHCODE
+    sys_highcode_init();
+#endif
 
-    USART_Printf_Init(UART_BAUDRATE);
+    // Enable SysTick with HCLK/8, this also keeps time for LwIP
+    sys_tick_init();
 
-    eth_configure_clock();
-    eth_init(PHY_ADDRESS);
-    ETH_DMARxDescChainInit(eth_dma_rx, &eth_buffer_rx[0][0], ETH_RX_RING_SIZE);
-    ETH_DMATxDescChainInit(eth_dma_tx, &eth_buffer_tx[0][0], ETH_TX_RING_SIZE);
-    ETH_Start();
+    sys_uart_init(UART_BAUDRATE);
 
+    // The MAC and PHY resets are checked on from LwIP's timers, everything
+    // else gets set up in the meantime (see eth_up())
     lwip_init();
+    eth_configure_clock();
+    eth_init(PHY_ADDRESS, eth_up);
+#if ETH_PTP
+    ping_latency_init();
+#endif
+
     httpd_init();
-    struct netif netif;
-    ip_addr_t address = IPADDR4_INIT_BYTES(192, 168, 1,   10);
-    ip_addr_t gateway = IPADDR4_INIT_BYTES(192, 168, 1,   1);
-    ip_addr_t netmask = IPADDR4_INIT_BYTES(255, 255, 255, 0);
-    netif_add(&netif, &address, &netmask, &gateway, NULL, &ch32netif_init, &ethernet_input);
+    struct net_config config = {
+        .address = IPADDR4_INIT_BYTES(192, 168, 1,   10),
+        .netmask = IPADDR4_INIT_BYTES(255, 255, 255, 0),
+        .gateway = IPADDR4_INIT_BYTES(192, 168, 1,   1),
+    };
+#if LWIP_DHCP
+    // Start out with the last lease, DHCP replaces it if it's no good
+    if (net_config_load(&config) == ERR_OK) {
+        log_printf("Reusing %u.%u.%u.%u\n",
+            ip4_addr1_16(&config.address), ip4_addr2_16(&config.address),
+            ip4_addr3_16(&config.address), ip4_addr4_16(&config.address));
+    } else {
+        config = (struct net_config){ 0 };
+    }
+#endif
+    netif_add(&netif, &config.address, &config.netmask, &config.gateway, NULL, &ch32netif_init, &ethernet_input);
     netif_set_default(&netif);
+#if LWIP_DHCP
+    netif_set_status_callback(&netif, netif_status);
+#endif
     netif_set_up(&netif);
-
-    while (1) {
-        if (link_status_update) {
-            link_status_update = 0;
-            if (ETH_ReadPHYRegister(PHY_ADDRESS, PHY_BMSR) & PHY_Linked_Status) {
-                netif_set_link_up(&netif);
-                printf("Link up ");
-
-                uint32_t mode;
-                if (ETH_ReadPHYRegister(PHY_ADDRESS, PHY_BMCR) & (1 << 8)) {
-                    mode = ETH_Mode_FullDuplex;
-                    printf("full-duplex\n");
-                } else {
-                    mode = ETH_Mode_HalfDuplex;
-                    printf("half-duplex\n");
-                }
-
-                // Send auto negotiated values to the MAC
-                ETH->MACCR &= ~0x0000C800;
-                ETH->MACCR |= mode | ETH_Speed_10M;
-            } else {
-                netif_set_link_up(&netif);
-                printf("Link down\n");
-            }
-        }
-        if (have_frame) {
-            LINK_STATS_INC(link.recv);
-            if (netif.input(p, &netif) != ERR_OK) {
-                pbuf_free(p);
-            }
-            have_frame = 0;
+#if LWIP_DHCP
+    // Waits for the link to come up
+    dhcp_start(&netif);
+#endif
+#ifdef VLAN_IDS
+    for (uint32_t i = 0; i < VLAN_NETIFS; i++) {
+        ip4_addr_t address;
+        ip4_addr_t netmask;
+        ip4_addr_t gateway;
+        IP4_ADDR(&address, 192, 168, vlan_ids[i] & 0xFF, 10);
+        IP4_ADDR(&netmask, 255, 255, 255, 0);
+        IP4_ADDR(&gateway, 192, 168, vlan_ids[i] & 0xFF, 1);
+        if (netif_add(&vlan_netifs[i], &address, &netmask, &gateway, (void *)(uintptr_t)vlan_ids[i], ch32netif_vlan_init, ethernet_input) == NULL) {
+            log_printf("Error: couldn't add VLAN %u\n", vlan_ids[i]);
+            continue;
         }
-
-        sys_check_timeouts();
+        netif_set_up(&vlan_netifs[i]);
     }
+#endif
+#if LWIPERF
+    // iperf 2 server on port 5001, run `iperf -c 192.168.1.10` against it
+    lwiperf_start_tcp_server_default(lwiperf_report, NULL);
+#endif
+
+    sched_add(SCHED_LINK,   "link",   link_task,   0);
+    sched_add(SCHED_TX,     "tx",     tx_task,     0);
+    sched_add(SCHED_RX,     "rx",     rx_task,     RX_BUDGET_US);
+    sched_add(SCHED_TIMERS, "timers", timers_task, 0);
+    sched_add(SCHED_LOG,    "log",    log_task,    0);
+    // Frames (and log records) may have arrived before the tasks were there to handle them
+    sched_post(SCHED_RX);
+    sched_post(SCHED_LOG);
+    sched_run();
 }
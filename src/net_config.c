@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "net_config.h"
+
+// "NCF" and a version, bump it when struct net_config changes
+#define NET_CONFIG_MAGIC 0x4E434601
+
+struct net_config_record {
+    uint32_t magic;
+    struct net_config config;
+    // Over magic and config, so a half written record doesn't count
+    uint32_t crc;
+};
+
+static uint32_t net_config_crc(const uint32_t *words, uint32_t count) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < count; i++) {
+        crc ^= words[i];
+        for (int bit = 0; bit < 32; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+    }
+    return ~crc;
+}
+
+err_t net_config_load(struct net_config *config) {
+    const struct net_config_record *record = (const struct net_config_record *)NET_CONFIG_ADDRESS;
+    if (record->magic != NET_CONFIG_MAGIC) {
+        return ERR_VAL;
+    }
+    if (record->crc != net_config_crc((const uint32_t *)record, offsetof(struct net_config_record, crc) / 4)) {
+        return ERR_VAL;
+    }
+
+    *config = record->config;
+    return ERR_OK;
+}
+
+err_t net_config_save(const struct net_config *config) {
+    struct net_config stored;
+    if (net_config_load(&stored) == ERR_OK && memcmp(&stored, config, sizeof(stored)) == 0) {
+        return ERR_OK;
+    }
+
+    struct net_config_record record = {
+        .magic = NET_CONFIG_MAGIC,
+        .config = *config,
+    };
+    record.crc = net_config_crc((const uint32_t *)&record, offsetof(struct net_config_record, crc) / 4);
+
+    FLASH_Unlock();
+    FLASH_Status status = FLASH_ErasePage(NET_CONFIG_ADDRESS);
+    const uint32_t *words = (const uint32_t *)&record;
+    for (uint32_t i = 0; status == FLASH_COMPLETE && i < sizeof(record) / 4; i++) {
+        status = FLASH_ProgramWord(NET_CONFIG_ADDRESS + i * 4, words[i]);
+    }
+    FLASH_Lock();
+
+    if (status != FLASH_COMPLETE || net_config_load(&stored) != ERR_OK) {
+        return ERR_IF;
+    }
+    return ERR_OK;
+}
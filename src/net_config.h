@@ -0,0 +1,49 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ * Network configuration kept in flash, so after a reset the device can start
+ * out with the address it last had instead of waiting for DHCP. One record
+ * lives in its own flash page and is only rewritten when it changes; a record
+ * that doesn't check out (never written, or cut short by a reset) is ignored.
+ */
+
+#ifndef NET_CONFIG_H_
+#define NET_CONFIG_H_
+
+#include <debug.h>
+#include <lwip/ip4_addr.h>
+#include <lwip/err.h>
+
+// Last page of the 256K of flash set up in Link.ld, well past the end of the
+// firmware. Has to be the start of a page, erasing it stalls the CPU for a
+// few milliseconds.
+#ifndef NET_CONFIG_ADDRESS
+#define NET_CONFIG_ADDRESS (FLASH_BASE + 0x3F000)
+#endif
+#define NET_CONFIG_PAGE_SIZE 4096
+
+struct net_config {
+    ip4_addr_t address;
+    ip4_addr_t netmask;
+    ip4_addr_t gateway;
+};
+
+// Read the stored configuration, ERR_VAL if there isn't a valid one
+err_t net_config_load(struct net_config *config);
+// Store config unless it's there already, ERR_IF if flash couldn't be written
+err_t net_config_save(const struct net_config *config);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Sizing profiles (-DNET_PROFILE=low-ram|balanced|max-throughput), these
+ * set LwIP's TCP window, heap, pbuf pool and connection count together with
+ * the driver's DMA rings so they don't end up fighting each other. Anything
+ * set here can still be overridden on its own from the command line.
+ *
+ * A TCP window is only any use if there's somewhere to put it: every full
+ * sized segment in flight takes a large RX buffer (zero-copy) or a few
+ * PBUF_POOL pbufs (copying) until LwIP is done with it, so the window is
+ * kept to about what the RX side can hold.
+ *
+ * In zero-copy mode every pbuf LwIP holds on to keeps a DMA descriptor, and
+ * it holds on to out-of-order segments and fragments of unfinished datagrams
+ * until its timers give up on them (seconds). TCP_OOSEQ_MAX_PBUFS and
+ * IP_REASS_MAX_PBUFS together are kept below the RX ring size, so there are
+ * always descriptors left to receive the segment that fills the gap.
+ */
+
+#ifndef NET_PROFILE_H_
+#define NET_PROFILE_H_
+
+#define NET_PROFILE_LOW_RAM        1
+#define NET_PROFILE_BALANCED       2
+#define NET_PROFILE_MAX_THROUGHPUT 3
+
+#ifndef NET_PROFILE
+#define NET_PROFILE NET_PROFILE_BALANCED
+#endif
+
+// PBUF_POOL only holds received frames when they're copied out of the DMA
+// buffers (ETH_RX_ZERO_COPY=0), LwIP itself hardly uses it otherwise. The
+// ISR's share of it (ETH_RX_POOL_SIZE) has to fit with room to spare.
+#if defined(ETH_RX_ZERO_COPY) && !ETH_RX_ZERO_COPY
+#define NET_PROFILE_RX(zero_copy, copying) (copying)
+#else
+#define NET_PROFILE_RX(zero_copy, copying) (zero_copy)
+#endif
+// TX descriptors are cheap unless each one comes with a buffer to copy into
+#if defined(ETH_TX_ZERO_COPY) && !ETH_TX_ZERO_COPY
+#define NET_PROFILE_TX(zero_copy, copying) (copying)
+#else
+#define NET_PROFILE_TX(zero_copy, copying) (zero_copy)
+#endif
+
+#if NET_PROFILE == NET_PROFILE_LOW_RAM
+// Small segments so nothing has to be held in a large RX buffer for long,
+// enough for the web interface and not much else
+#ifndef TCP_MSS
+#define TCP_MSS 536
+#endif
+#ifndef TCP_WND
+#define TCP_WND (2 * TCP_MSS)
+#endif
+#ifndef TCP_SND_BUF
+#define TCP_SND_BUF (2 * TCP_MSS)
+#endif
+#ifndef MEM_SIZE
+#define MEM_SIZE (8 * 1024)
+#endif
+#ifndef PBUF_POOL_SIZE
+#define PBUF_POOL_SIZE NET_PROFILE_RX(2, 12)
+#endif
+#ifndef MEMP_NUM_TCP_PCB
+#define MEMP_NUM_TCP_PCB 4
+#endif
+#ifndef ETH_RX_SMALL_COUNT
+#define ETH_RX_SMALL_COUNT 4
+#endif
+#ifndef ETH_RX_LARGE_COUNT
+#define ETH_RX_LARGE_COUNT 1
+#endif
+#ifndef ETH_TX_RING_SIZE
+#define ETH_TX_RING_SIZE NET_PROFILE_TX(4, 2)
+#endif
+// 2 each of the 5 RX descriptors, fragmented datagrams much past one MSS won't fit
+#ifndef TCP_OOSEQ_MAX_PBUFS
+#define TCP_OOSEQ_MAX_PBUFS 2
+#endif
+#ifndef IP_REASS_MAX_PBUFS
+#define IP_REASS_MAX_PBUFS 2
+#endif
+
+#elif NET_PROFILE == NET_PROFILE_BALANCED
+// A 10BASE-T link with a LAN round trip is kept full by a few segments
+#ifndef TCP_MSS
+#define TCP_MSS 1460
+#endif
+#ifndef TCP_WND
+#define TCP_WND (4 * TCP_MSS)
+#endif
+#ifndef TCP_SND_BUF
+#define TCP_SND_BUF (4 * TCP_MSS)
+#endif
+#ifndef MEM_SIZE
+#define MEM_SIZE (16 * 1024)
+#endif
+#ifndef PBUF_POOL_SIZE
+#define PBUF_POOL_SIZE NET_PROFILE_RX(2, 14)
+#endif
+#ifndef MEMP_NUM_TCP_PCB
+#define MEMP_NUM_TCP_PCB 6
+#endif
+#ifndef ETH_RX_SMALL_COUNT
+#define ETH_RX_SMALL_COUNT 8
+#endif
+#ifndef ETH_RX_LARGE_COUNT
+#define ETH_RX_LARGE_COUNT 4
+#endif
+#ifndef ETH_TX_RING_SIZE
+#define ETH_TX_RING_SIZE NET_PROFILE_TX(8, 2)
+#endif
+// 4 each of the 12 RX descriptors
+#ifndef TCP_OOSEQ_MAX_PBUFS
+#define TCP_OOSEQ_MAX_PBUFS 4
+#endif
+#ifndef IP_REASS_MAX_PBUFS
+#define IP_REASS_MAX_PBUFS 4
+#endif
+
+#elif NET_PROFILE == NET_PROFILE_MAX_THROUGHPUT
+// The PHY only does 10 Mbit/s, where a full sized frame takes 1.2ms: the 8
+// segment window and 8 large RX buffers are about 10ms of line rate, enough
+// to ride out a busy main loop or a slower host
+#ifndef TCP_MSS
+#define TCP_MSS 1460
+#endif
+#ifndef TCP_WND
+#define TCP_WND (8 * TCP_MSS)
+#endif
+#ifndef TCP_SND_BUF
+#define TCP_SND_BUF (8 * TCP_MSS)
+#endif
+#ifndef MEM_SIZE
+#define MEM_SIZE (20 * 1024)
+#endif
+#ifndef PBUF_POOL_SIZE
+#define PBUF_POOL_SIZE NET_PROFILE_RX(4, 12)
+#endif
+#ifndef MEMP_NUM_TCP_PCB
+#define MEMP_NUM_TCP_PCB 8
+#endif
+#ifndef ETH_RX_SMALL_COUNT
+#define ETH_RX_SMALL_COUNT 8
+#endif
+#ifndef ETH_RX_LARGE_COUNT
+#define ETH_RX_LARGE_COUNT 8
+#endif
+#ifndef ETH_TX_RING_SIZE
+#define ETH_TX_RING_SIZE NET_PROFILE_TX(16, 4)
+#endif
+// 8 and 6 of the 16 RX descriptors
+#ifndef TCP_OOSEQ_MAX_PBUFS
+#define TCP_OOSEQ_MAX_PBUFS 8
+#endif
+#ifndef IP_REASS_MAX_PBUFS
+#define IP_REASS_MAX_PBUFS 6
+#endif
+
+#else
+#error "Unknown NET_PROFILE"
+#endif
+
+// LwIP's default, spelled out so every queued segment gets a tcp_seg
+#ifndef TCP_SND_QUEUELEN
+#define TCP_SND_QUEUELEN ((4 * TCP_SND_BUF + TCP_MSS - 1) / TCP_MSS)
+#endif
+#ifndef MEMP_NUM_TCP_SEG
+#define MEMP_NUM_TCP_SEG TCP_SND_QUEUELEN
+#endif
+
+#endif
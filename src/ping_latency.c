@@ -0,0 +1,116 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lwip/def.h>
+#include <lwip/prot/ethernet.h>
+#include <lwip/prot/icmp.h>
+#include <lwip/prot/ip4.h>
+
+#include "eth.h"
+#include "ping_latency.h"
+
+#if ETH_PTP
+struct ping_latency_stats ping_latency_stats;
+
+static struct {
+    struct eth_timestamp time;
+    uint16_t id;
+    uint16_t seqno;
+    uint8_t used;
+} pending[PING_LATENCY_PENDING];
+static uint32_t pending_next;
+
+// The echo header of an ICMP frame of the given type, NULL if it isn't one
+static const struct icmp_echo_hdr *ping_echo(const uint8_t *frame, uint16_t len, uint8_t type) {
+    if (len < SIZEOF_ETH_HDR + IP_HLEN) {
+        return NULL;
+    }
+    const struct eth_hdr *eth = (const struct eth_hdr *)frame;
+    uint16_t header = SIZEOF_ETH_HDR;
+    uint16_t ethertype = eth->type;
+#if ETH_VLAN_COUNT
+    // Sent frames from VLAN netifs still have their tag
+    if (ethertype == PP_HTONS(ETHTYPE_VLAN)) {
+        if (len < SIZEOF_ETH_HDR + SIZEOF_VLAN_HDR + IP_HLEN) {
+            return NULL;
+        }
+        ethertype = ((const struct eth_vlan_hdr *)&frame[SIZEOF_ETH_HDR])->tpid;
+        header += SIZEOF_VLAN_HDR;
+    }
+#endif
+    const struct ip_hdr *ip = (const struct ip_hdr *)&frame[header];
+    if (ethertype != PP_HTONS(ETHTYPE_IP) || IPH_PROTO(ip) != IP_PROTO_ICMP) {
+        return NULL;
+    }
+
+    uint16_t offset = header + IPH_HL_BYTES(ip);
+    if (len < offset + sizeof(struct icmp_echo_hdr)) {
+        return NULL;
+    }
+    const struct icmp_echo_hdr *echo = (const struct icmp_echo_hdr *)&frame[offset];
+    return ICMPH_TYPE(echo) == type ? echo : NULL;
+}
+
+static void ping_rx(const struct eth_timestamp *time, const uint8_t *frame, uint16_t len) {
+    const struct icmp_echo_hdr *echo = ping_echo(frame, len, ICMP_ECHO);
+    if (echo == NULL) {
+        return;
+    }
+
+    uint32_t i = pending_next++ % PING_LATENCY_PENDING;
+    pending[i].time = *time;
+    pending[i].id = echo->id;
+    pending[i].seqno = echo->seqno;
+    pending[i].used = 1;
+}
+
+static void ping_tx(const struct eth_timestamp *time, const uint8_t *frame, uint16_t len) {
+    const struct icmp_echo_hdr *echo = ping_echo(frame, len, ICMP_ER);
+    if (echo == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < PING_LATENCY_PENDING; i++) {
+        if (!pending[i].used || pending[i].id != echo->id || pending[i].seqno != echo->seqno) {
+            continue;
+        }
+        pending[i].used = 0;
+
+        int64_t ns = (int64_t)(time->seconds - pending[i].time.seconds) * 1000000000
+            + (int64_t)time->nanoseconds - pending[i].time.nanoseconds;
+        if (ns < 0 || ns > UINT32_MAX) {
+            // The clock was stepped in between
+            return;
+        }
+
+        struct ping_latency_stats *stats = &ping_latency_stats;
+        if (stats->samples == 0 || ns < stats->min_ns) {
+            stats->min_ns = ns;
+        }
+        if (ns > stats->max_ns) {
+            stats->max_ns = ns;
+        }
+        stats->total_ns += ns;
+        stats->samples++;
+        return;
+    }
+    ping_latency_stats.unmatched++;
+}
+
+void ping_latency_init(void) {
+    eth_ptp_set_hooks(ping_rx, ping_tx);
+}
+#endif
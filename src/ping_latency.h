@@ -0,0 +1,46 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * How long the device takes to answer pings, from the echo request's
+ * timestamp on the wire to the reply's, both taken by the MAC's IEEE 1588
+ * clock (ETH_PTP). Subtracted from the round trip a host measures, what's
+ * left is the network's share.
+ */
+
+#ifndef PING_LATENCY_H_
+#define PING_LATENCY_H_
+
+#include <stdint.h>
+
+// Echo requests waiting for their reply, the oldest is forgotten when full
+#ifndef PING_LATENCY_PENDING
+#define PING_LATENCY_PENDING 4
+#endif
+
+struct ping_latency_stats {
+    uint32_t samples;
+    // Replies sent for requests that had been forgotten
+    uint32_t unmatched;
+    uint32_t min_ns;
+    uint32_t max_ns;
+    uint64_t total_ns;
+};
+
+extern struct ping_latency_stats ping_latency_stats;
+
+// Take over the timestamp hooks, see eth_ptp_set_hooks()
+void ping_latency_init(void);
+
+#endif
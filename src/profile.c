@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "profile.h"
+
+#if PROFILE
+#include <string.h>
+
+const char *const profile_probe_names[PROFILE_PROBE_COUNT] = {
+    "isr",
+    "eth_get_packet",
+    "rx_pbuf",
+    "netif_input",
+    "netif_output",
+    "eth_send_packet"
+};
+
+struct profile_stats profile_stats[PROFILE_PROBE_COUNT];
+
+void profile_record(enum profile_probe probe, uint32_t elapsed) {
+    struct profile_stats *stats = &profile_stats[probe];
+    if (stats->count == 0 || elapsed < stats->min) {
+        stats->min = elapsed;
+    }
+    if (elapsed > stats->max) {
+        stats->max = elapsed;
+    }
+    stats->count++;
+    stats->total += elapsed;
+
+    uint32_t bucket = elapsed ? 32 - __builtin_clz(elapsed) : 0;
+    stats->histogram[bucket < 32 ? bucket : 31]++;
+}
+
+void profile_reset(void) {
+    memset(profile_stats, 0, sizeof(profile_stats));
+}
+
+void profile_print(void) {
+    printf("%-16s %10s %8s %8s %8s\n", "probe", "count", "min", "mean", "max");
+    for (int i = 0; i < PROFILE_PROBE_COUNT; i++) {
+        const struct profile_stats *stats = &profile_stats[i];
+        uint32_t mean = stats->count ? stats->total / stats->count : 0;
+        printf("%-16s %10u %8u %8u %8u\n", profile_probe_names[i], (unsigned)stats->count, (unsigned)stats->min, (unsigned)mean, (unsigned)stats->max);
+
+        for (int bucket = 0; bucket < 32; bucket++) {
+            if (stats->histogram[bucket]) {
+                printf("    < %-10u %u\n", bucket == 31 ? 0xFFFFFFFF : 1u << bucket, (unsigned)stats->histogram[bucket]);
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <debug.h>
+
+// Time the packet hot path, compiles to nothing when disabled
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+// Count CPU cycles with mcycle instead of SysTick (HCLK/8)
+#ifndef PROFILE_MCYCLE
+#define PROFILE_MCYCLE 0
+#endif
+
+enum profile_probe {
+    PROFILE_ISR,
+    PROFILE_GET_PACKET,
+    PROFILE_RX_PBUF,
+    PROFILE_NETIF_INPUT,
+    PROFILE_NETIF_OUTPUT,
+    PROFILE_SEND_PACKET,
+    PROFILE_PROBE_COUNT
+};
+
+#if PROFILE
+struct profile_stats {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    // Bucket 0 counts samples of 0 and bucket n those in [2^(n-1), 2^n),
+    // the last one also takes anything longer
+    uint32_t histogram[32];
+};
+extern struct profile_stats profile_stats[PROFILE_PROBE_COUNT];
+extern const char *const profile_probe_names[PROFILE_PROBE_COUNT];
+
+#if defined(CH32_HOST)
+// Nanoseconds
+uint32_t profile_host_now(void);
+#define PROFILE_NOW() profile_host_now()
+#elif PROFILE_MCYCLE
+static inline uint32_t profile_mcycle(void) {
+    uint32_t cycles;
+    __asm__ volatile("csrr %0, mcycle" : "=r"(cycles));
+    return cycles;
+}
+#define PROFILE_NOW() profile_mcycle()
+#else
+#define PROFILE_NOW() ((uint32_t)SysTick->CNT)
+#endif
+
+struct profile_scope {
+    enum profile_probe probe;
+    uint32_t start;
+};
+
+void profile_record(enum profile_probe probe, uint32_t elapsed);
+void profile_reset(void);
+void profile_print(void);
+
+static inline void profile_scope_end(struct profile_scope *scope) {
+    profile_record(scope->probe, PROFILE_NOW() - scope->start);
+}
+
+// Time from here until the end of the enclosing block, however it's left
+#define PROFILE_SCOPE(probe) \
+    __attribute__((cleanup(profile_scope_end))) struct profile_scope profile_scope_##probe = { (probe), PROFILE_NOW() }
+#else
+#define PROFILE_SCOPE(probe)
+#endif
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <debug.h>
+#include <lwip/timeouts.h>
+
+#include "scheduler.h"
+#include "sys_arch.h"
+
+struct sched_task sched_tasks[SCHED_MAX_TASKS];
+
+// One bit per task, set with an atomic OR (amoor.w) so ISRs never need a lock
+static volatile uint32_t sched_pending;
+// SysTick count when the running task has to give up
+static uint32_t sched_deadline;
+static int sched_limited;
+
+static inline uint32_t sched_now(void) {
+    return (uint32_t)SysTick->CNT;
+}
+
+void sched_add(uint32_t id, const char *name, sched_fn fn, uint32_t budget_us) {
+    struct sched_task *task = &sched_tasks[id];
+    task->name = name;
+    task->fn = fn;
+    task->budget = budget_us * SYS_TICKS_PER_US;
+}
+
+void sched_post(uint32_t id) {
+    uint32_t bit = 1u << id;
+    // Only the first post counts towards latency
+    if ((sched_pending & bit) == 0) {
+        sched_tasks[id].posted_at = sched_now();
+    }
+    __atomic_fetch_or(&sched_pending, bit, __ATOMIC_RELEASE);
+}
+
+int sched_over_budget(void) {
+    return sched_limited && (int32_t)(sched_now() - sched_deadline) >= 0;
+}
+
+static void sched_run_task(uint32_t id) {
+    struct sched_task *task = &sched_tasks[id];
+    __atomic_fetch_and(&sched_pending, ~(1u << id), __ATOMIC_ACQUIRE);
+    if (task->fn == NULL) {
+        return;
+    }
+
+    uint32_t start = sched_now();
+    uint32_t latency = start - task->posted_at;
+    sched_limited = task->budget != 0;
+    sched_deadline = start + task->budget;
+
+    int again = task->fn();
+
+    uint32_t run = sched_now() - start;
+    task->runs++;
+    task->total_run += run;
+    if (run > task->max_run) {
+        task->max_run = run;
+    }
+    if (latency > task->max_latency) {
+        task->max_latency = latency;
+    }
+    if (task->budget != 0 && run > task->budget) {
+        task->overruns++;
+    }
+
+    if (again) {
+        sched_post(id);
+    }
+}
+
+void sched_run(void) {
+    while (1) {
+        // Timeouts are polled rather than posted, this is just a compare
+        uint32_t sleep = sys_timeouts_sleeptime();
+        if (sleep == 0) {
+            sched_post(SCHED_TIMERS);
+        }
+
+        uint32_t pending = __atomic_load_n(&sched_pending, __ATOMIC_ACQUIRE);
+        if (pending == 0) {
+#if SYS_IDLE
+            // Sleep until the next timeout, unless an interrupt has just posted something
+            sys_irq_disable();
+            if (sched_pending == 0) {
+                sys_idle(sleep);
+            }
+            sys_irq_enable();
+#endif
+            continue;
+        }
+
+        // One turn each, highest priority first
+        while (pending) {
+            uint32_t id = __builtin_ctz(pending);
+            pending &= pending - 1;
+            sched_run_task(id);
+        }
+    }
+}
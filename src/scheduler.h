@@ -0,0 +1,74 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Run-to-completion scheduler for the main loop. Tasks run when their event
+ * is posted (from an ISR or another task), highest priority (lowest ID) first.
+ * Every pending task gets one turn per round, so a task that keeps re-posting
+ * itself can't starve the ones below it.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+
+#ifndef SCHED_MAX_TASKS
+#define SCHED_MAX_TASKS 8
+#endif
+
+// Event sources, in priority order
+enum sched_source {
+    SCHED_LINK,
+    // TX goes before RX so replies have descriptors to go out on
+    SCHED_TX,
+    SCHED_RX,
+    // Posted by the scheduler itself when a LwIP timeout is due
+    SCHED_TIMERS,
+    // Formatting and sending log records, see log.h
+    SCHED_LOG,
+    // Application tasks come after the network
+    SCHED_USER
+};
+
+// Returns non-zero if there's work left, the task is then run again next round
+typedef int (*sched_fn)(void);
+
+struct sched_task {
+    const char *name;
+    sched_fn fn;
+    // SysTick ticks a run should take at most, 0 for no limit
+    uint32_t budget;
+
+    // Stats, all times in SysTick ticks
+    uint32_t posted_at;
+    uint32_t runs;
+    uint32_t overruns;
+    uint32_t max_run;
+    uint32_t max_latency;
+    uint64_t total_run;
+};
+
+extern struct sched_task sched_tasks[SCHED_MAX_TASKS];
+
+void sched_add(uint32_t id, const char *name, sched_fn fn, uint32_t budget_us);
+// Mark a task as ready to run, safe to call from interrupts
+void sched_post(uint32_t id);
+// Whether the running task has used up its budget, long running tasks should
+// check this and return non-zero to let everything else have a turn
+int sched_over_budget(void);
+// Run tasks forever, sleeping when there's nothing to do (see SYS_IDLE)
+void sched_run(void) __attribute__((noreturn));
+
+#endif
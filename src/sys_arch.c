@@ -18,6 +18,12 @@
 
 #include "ch32v30x_conf.h"
 #include "arch/cc.h"
+#include "log.h"
+#include "sys_arch.h"
+
+#ifndef INTERRUPT
+#define INTERRUPT(name) __attribute__((interrupt("WCH-Interrupt-fast"))) void name(void)
+#endif
 
 // Standard system calls (here to shut up the linker)
 void _close() { }
@@ -30,19 +36,165 @@ void _read() { }
 
 // Use instead of Delay_Us
 void usleep(uint32_t time) {
-    uint64_t end = SysTick->CNT + (uint64_t)(time*18);
+    uint64_t end = SysTick->CNT + (uint64_t)time*SYS_TICKS_PER_US;
     while (SysTick->CNT < end);
 }
 
 // LwIP
+// Critical sections only mask the Ethernet interrupt, the only other context
+// that touches LwIP (or the driver's state), so everything else keeps its latency.
+// The nesting depth is handed back to sys_arch_unprotect() to restore.
+static volatile uint32_t protect_depth;
+
 sys_prot_t sys_arch_protect(void) {
-    return 1;
+    NVIC_DisableIRQ(ETH_IRQn);
+    // The PFIC takes a few cycles to apply the mask
+    __asm__ volatile("fence" ::: "memory");
+    return protect_depth++;
 }
 
 void sys_arch_unprotect(sys_prot_t pval) {
-    (void)pval;
+    __asm__ volatile("" ::: "memory");
+    protect_depth = pval;
+    if (pval == 0) {
+        NVIC_EnableIRQ(ETH_IRQn);
+    }
+}
+
+// Milliseconds since boot, kept by the SysTick compare interrupt so sys_now()
+// doesn't need a 64-bit division
+static volatile uint32_t sys_ms;
+// SysTick count of the next millisecond boundary
+static uint64_t sys_next_tick;
+
+static void systick_arm(uint64_t cmp) {
+    SysTick->CMP = cmp;
+    // The compare only fires on a match, if it's already gone by trigger the interrupt by hand
+    if (SysTick->CNT >= cmp) {
+        SysTick->CTLR |= SYSTICK_CTLR_SWIE;
+    }
+}
+
+// Account for every millisecond boundary that's gone by, normally just the one.
+// The (32-bit) division is only needed after sleeping.
+static void systick_update(void) {
+    uint64_t now = SysTick->CNT;
+    if (now >= sys_next_tick) {
+        uint32_t behind = (uint32_t)(now - sys_next_tick)/SYS_TICKS_PER_MS + 1;
+        sys_ms += behind;
+        sys_next_tick += (uint64_t)behind*SYS_TICKS_PER_MS;
+    }
+    systick_arm(sys_next_tick);
+}
+
+INTERRUPT(SysTick_Handler) {
+    SysTick->CTLR &= ~SYSTICK_CTLR_SWIE;
+    SysTick->SR = 0;
+    systick_update();
+}
+
+void sys_tick_init(void) {
+    // Count up from HCLK/8, this will overflow every 32475 years, give or take
+    sys_next_tick = SysTick->CNT + SYS_TICKS_PER_MS;
+    SysTick->CMP = sys_next_tick;
+    SysTick->SR = 0;
+    SysTick->CTLR = SYSTICK_CTLR_STE | SYSTICK_CTLR_STIE;
+    NVIC_EnableIRQ(SysTicK_IRQn);
+}
+
+// Logging
+void sys_uart_init(uint32_t baudrate) {
+    // Pins and baud rate, printf() keeps working for anything that still uses it
+    USART_Printf_Init(baudrate);
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    DMA_DeInit(DMA1_Channel4);
+    DMA_InitTypeDef dma = {
+        .DMA_PeripheralBaseAddr = (uint32_t)&USART1->DATAR,
+        .DMA_MemoryBaseAddr = 0,
+        .DMA_DIR = DMA_DIR_PeripheralDST,
+        .DMA_BufferSize = 0,
+        .DMA_PeripheralInc = DMA_PeripheralInc_Disable,
+        .DMA_MemoryInc = DMA_MemoryInc_Enable,
+        .DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte,
+        .DMA_MemoryDataSize = DMA_MemoryDataSize_Byte,
+        .DMA_Mode = DMA_Mode_Normal,
+        .DMA_Priority = DMA_Priority_Low,
+        .DMA_M2M = DMA_M2M_Disable
+    };
+    DMA_Init(DMA1_Channel4, &dma);
+    DMA_ITConfig(DMA1_Channel4, DMA_IT_TC, ENABLE);
+    USART_DMACmd(USART1, USART_DMAReq_Tx, ENABLE);
+    NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+}
+
+int sys_uart_busy(void) {
+    // Not the interrupt, so this still works with them masked
+    return (DMA1_Channel4->CFGR & DMA_CFGR1_EN) && DMA_GetCurrDataCounter(DMA1_Channel4) != 0;
+}
+
+void sys_uart_send(const char *data, uint32_t len) {
+    DMA_Cmd(DMA1_Channel4, DISABLE);
+    DMA1_Channel4->MADDR = (uint32_t)data;
+    DMA1_Channel4->CNTR = len;
+    DMA_Cmd(DMA1_Channel4, ENABLE);
+}
+
+void sys_uart_write(const char *data, uint32_t len) {
+    while (sys_uart_busy());
+    for (uint32_t i = 0; i < len; i++) {
+        while (USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET);
+        USART_SendData(USART1, data[i]);
+    }
+    while (USART_GetFlagStatus(USART1, USART_FLAG_TC) == RESET);
+}
+
+INTERRUPT(DMA1_Channel4_IRQHandler) {
+    DMA_ClearITPendingBit(DMA1_IT_TC4);
+    log_tx_done();
 }
 
 uint32_t sys_now(void) {
-    return SysTick->CNT/18000;
+    return sys_ms;
+}
+
+void sys_irq_disable(void) {
+    __asm__ volatile("csrc mstatus, 8" ::: "memory");
+}
+
+void sys_irq_enable(void) {
+    __asm__ volatile("csrs mstatus, 8" ::: "memory");
+}
+
+void sys_idle(uint32_t ms) {
+    if (ms == 0) {
+        return;
+    }
+    if (ms > SYS_IDLE_MAX_MS) {
+        ms = SYS_IDLE_MAX_MS;
+    }
+
+    // Skip the ticks in between, pending interrupts still wake the core up
+    // while they're masked
+    systick_arm(sys_next_tick + (uint64_t)(ms - 1)*SYS_TICKS_PER_MS);
+    __asm__ volatile("wfi");
+
+    // Catch up and go back to ticking every millisecond, whatever woke us up
+    systick_update();
+}
+
+#if HIGHCODE
+// From highcode.ld.in
+extern uint32_t _ramcode_lma[], _ramcode_start[], _ramcode_end[];
+
+void sys_highcode_init(void) {
+    // volatile so GCC can't turn this into a call to memcpy(), which may well
+    // be one of the functions being copied
+    const volatile uint32_t *src = _ramcode_lma;
+    volatile uint32_t *dst = _ramcode_start;
+    while (dst < _ramcode_end) {
+        *dst++ = *src++;
+    }
+    __asm__ volatile("fence.i" ::: "memory");
 }
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYS_ARCH_H_
+#define SYS_ARCH_H_
+
+#include <stdint.h>
+
+// Sleep in the main loop until the next LwIP timeout or interrupt
+#ifndef SYS_IDLE
+#define SYS_IDLE 1
+#endif
+// Longest sleep, so a missed wake-up can't stall things for too long
+#ifndef SYS_IDLE_MAX_MS
+#define SYS_IDLE_MAX_MS 1000
+#endif
+
+// SysTick runs at HCLK/8
+#define SYS_TICKS_PER_US 18
+#define SYS_TICKS_PER_MS (SYS_TICKS_PER_US * 1000)
+
+// SysTick CTLR bits
+#define SYSTICK_CTLR_STE  (1u << 0)
+#define SYSTICK_CTLR_STIE (1u << 1)
+#define SYSTICK_CTLR_SWIE (1u << 31)
+
+// Use instead of Delay_Us
+void usleep(uint32_t time);
+
+#if HIGHCODE
+// Copy the functions listed in HIGHCODE_FUNCTIONS to RAM, has to run before
+// any of them are called
+void sys_highcode_init(void);
+#endif
+
+// Log output on the SDK's debug UART (USART1), sent by DMA1 channel 4 whose
+// interrupt calls log_tx_done()
+void sys_uart_init(uint32_t baudrate);
+// Whether the last sys_uart_send() is still going
+int sys_uart_busy(void);
+// Send in the background, data has to stay put until it's done
+void sys_uart_send(const char *data, uint32_t len);
+// Send and wait, doesn't need interrupts
+void sys_uart_write(const char *data, uint32_t len);
+
+// Start SysTick and the millisecond clock behind sys_now()
+void sys_tick_init(void);
+
+// Mask/unmask every interrupt
+void sys_irq_disable(void);
+void sys_irq_enable(void);
+// Sleep until any interrupt or for at most ms milliseconds. Call with
+// interrupts disabled after checking there's nothing to do, so one arriving
+// in between still wakes it up. The interrupt runs once they're enabled again.
+void sys_idle(uint32_t ms);
+
+#endif
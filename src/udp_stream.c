@@ -0,0 +1,171 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <lwip/etharp.h>
+#include <lwip/ip4_addr.h>
+#include <lwip/udp.h>
+
+#include "eth.h"
+#include "udp_stream.h"
+
+// link is the length of the Ethernet header, with its VLAN tag if there is one
+#define STREAM_ETH(frame)        ((struct eth_hdr *)(frame))
+#define STREAM_IP(frame, link)   ((struct ip_hdr *)&(frame)[link])
+#define STREAM_UDP(frame, link)  ((struct udp_hdr *)&(frame)[(link) + IP_HLEN])
+#define STREAM_HEADER_LEN(link)  ((link) + IP_HLEN + UDP_HLEN)
+
+// Work out where frames for dest have to go on the wire
+static err_t stream_resolve(struct netif *netif, const ip4_addr_t *dest, struct eth_addr *mac) {
+    if (ip4_addr_isbroadcast(dest, netif)) {
+        memset(mac, 0xFF, sizeof(*mac));
+        return ERR_OK;
+    }
+    if (ip4_addr_ismulticast(dest)) {
+        // 01:00:5E followed by the low 23 bits of the group
+        const uint8_t *group = (const uint8_t *)&dest->addr;
+        const struct eth_addr multicast = {{ LL_IP4_MULTICAST_ADDR_0, LL_IP4_MULTICAST_ADDR_1, LL_IP4_MULTICAST_ADDR_2, group[1] & 0x7F, group[2], group[3] }};
+        *mac = multicast;
+        return ERR_OK;
+    }
+
+    // Anything off the local subnet goes through the gateway
+    const ip4_addr_t *hop = dest;
+    if (!ip4_addr_netcmp(dest, netif_ip4_addr(netif), netif_ip4_netmask(netif))) {
+        hop = netif_ip4_gw(netif);
+    }
+
+    struct eth_addr *found;
+    const ip4_addr_t *found_ip;
+    if (etharp_find_addr(netif, hop, &found, &found_ip) < 0) {
+        etharp_query(netif, hop, NULL);
+        return ERR_INPROGRESS;
+    }
+    *mac = *found;
+    return ERR_OK;
+}
+
+#if ETH_VLAN_COUNT
+static struct eth_vlan_stats *stream_vlan(int tag) {
+    for (int i = 0; i < ETH_VLAN_COUNT; i++) {
+        if (eth_vlan_stats[i].id == tag) {
+            return &eth_vlan_stats[i];
+        }
+    }
+    return NULL;
+}
+#endif
+
+err_t udp_stream_open(struct udp_stream *stream, struct netif *netif, const ip4_addr_t *dest, uint16_t src_port, uint16_t dest_port, uint16_t max_len) {
+#if ETH_VLAN_COUNT
+    int tag = eth_vlan_tag(netif);
+#else
+    int tag = -1;
+#endif
+    // Better to find out now than have every datagram dropped
+    if (max_len > (tag >= 0 ? UDP_STREAM_VLAN_MAX_LEN : UDP_STREAM_MAX_LEN)) {
+        return ERR_VAL;
+    }
+
+    struct eth_addr mac;
+    err_t err = stream_resolve(netif, dest, &mac);
+    if (err != ERR_OK) {
+        return err;
+    }
+
+    memset(stream, 0, sizeof(*stream));
+    stream->max_len = max_len;
+    struct eth_hdr *eth = STREAM_ETH(stream->header);
+    eth->dest = mac;
+    memcpy(&eth->src, netif->hwaddr, ETH_HWADDR_LEN);
+    eth->type = PP_HTONS(ETHTYPE_IP);
+    uint8_t link = SIZEOF_ETH_HDR;
+#if ETH_VLAN_COUNT
+    // The same tag ethernet_output() gives the netif's frames
+    if (tag >= 0) {
+        struct eth_vlan_hdr *vlan = (struct eth_vlan_hdr *)&stream->header[SIZEOF_ETH_HDR];
+        eth->type = PP_HTONS(ETHTYPE_VLAN);
+        vlan->prio_vid = lwip_htons((uint16_t)tag);
+        vlan->tpid = PP_HTONS(ETHTYPE_IP);
+        link += SIZEOF_VLAN_HDR;
+        stream->vlan = stream_vlan(tag);
+    }
+#endif
+    stream->link_len = link;
+
+    // Datagrams are never fragmented, so with DF set the ID can stay 0 (RFC 6864).
+    // Lengths are filled in per datagram, checksums by the MAC.
+    struct ip_hdr *ip = STREAM_IP(stream->header, link);
+    IPH_VHL_SET(ip, 4, IP_HLEN / 4);
+    IPH_TOS_SET(ip, 0);
+    IPH_ID_SET(ip, 0);
+    IPH_OFFSET_SET(ip, PP_HTONS(IP_DF));
+    IPH_TTL_SET(ip, UDP_TTL);
+    IPH_PROTO_SET(ip, IP_PROTO_UDP);
+    IPH_CHKSUM_SET(ip, 0);
+    ip4_addr_copy(ip->src, *netif_ip4_addr(netif));
+    ip4_addr_copy(ip->dest, *dest);
+
+    struct udp_hdr *udp = STREAM_UDP(stream->header, link);
+    udp->src = lwip_htons(src_port);
+    udp->dest = lwip_htons(dest_port);
+    udp->chksum = 0;
+    return ERR_OK;
+}
+
+void *udp_stream_claim(struct udp_stream *stream, uint16_t len) {
+    if (len > stream->max_len) {
+        stream->oversized++;
+        return NULL;
+    }
+
+    uint16_t header_len = STREAM_HEADER_LEN(stream->link_len);
+    stream->frame = eth_tx_claim(header_len + len);
+    if (stream->frame == NULL) {
+        stream->dropped++;
+        return NULL;
+    }
+
+    memcpy(stream->frame, stream->header, header_len);
+    return &stream->frame[header_len];
+}
+
+void udp_stream_commit(struct udp_stream *stream, uint16_t len) {
+    uint8_t link = stream->link_len;
+    IPH_LEN_SET(STREAM_IP(stream->frame, link), lwip_htons(IP_HLEN + UDP_HLEN + len));
+    STREAM_UDP(stream->frame, link)->len = lwip_htons(UDP_HLEN + len);
+    // Frames shorter than the minimum are padded by the MAC
+    eth_tx_commit(STREAM_HEADER_LEN(link) + len);
+#if ETH_VLAN_COUNT
+    if (stream->vlan != NULL) {
+        stream->vlan->tx_frames++;
+        stream->vlan->tx_bytes += STREAM_HEADER_LEN(link) + len;
+    }
+#endif
+    stream->frame = NULL;
+    stream->sent++;
+}
+
+err_t udp_stream_send(struct udp_stream *stream, const void *payload, uint16_t len) {
+    void *buffer = udp_stream_claim(stream, len);
+    if (buffer == NULL) {
+        return len > stream->max_len ? ERR_VAL : ERR_MEM;
+    }
+
+    memcpy(buffer, payload, len);
+    udp_stream_commit(stream, len);
+    return ERR_OK;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2023 Xerbo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Pre-resolved UDP streams, for sending telemetry to a fixed host without
+ * going through udp_sendto(), IP, ARP and a pbuf for every datagram. The
+ * Ethernet/IP/UDP headers are built once when the stream is opened and the
+ * payload is written straight into a TX DMA buffer (see eth_tx_claim()),
+ * checksums are filled in by the MAC.
+ *
+ * Frames share the TX ring with LwIP's, so like everything else that sends
+ * only use streams from the main loop. The destination's MAC address is
+ * looked up once, reopen the stream if it might have changed. Streams opened
+ * on a VLAN netif (see ch32netif_vlan_init()) are tagged like LwIP's frames.
+ */
+
+#ifndef UDP_STREAM_H_
+#define UDP_STREAM_H_
+
+#include <lwip/netif.h>
+#include <lwip/prot/ethernet.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/udp.h>
+
+#include "eth.h"
+
+#define UDP_STREAM_HEADER_LEN (SIZEOF_ETH_HDR + IP_HLEN + UDP_HLEN)
+#if ETH_VLAN_COUNT
+#define UDP_STREAM_HEADER_MAX (UDP_STREAM_HEADER_LEN + SIZEOF_VLAN_HDR)
+#else
+#define UDP_STREAM_HEADER_MAX UDP_STREAM_HEADER_LEN
+#endif
+
+struct udp_stream {
+    // Headers copied in front of every datagram
+    uint8_t header[UDP_STREAM_HEADER_MAX];
+    // Length of the Ethernet header, SIZEOF_VLAN_HDR more with a tag
+    uint8_t link_len;
+#if ETH_VLAN_COUNT
+    // The VLAN netif's counters, NULL if the stream isn't on one
+    struct eth_vlan_stats *vlan;
+#endif
+    // Frame being built between udp_stream_claim() and udp_stream_commit()
+    uint8_t *frame;
+    // Longest payload the stream was opened for
+    uint16_t max_len;
+    uint32_t sent;
+    // Datagrams that didn't fit in the TX ring
+    uint32_t dropped;
+    // Datagrams longer than max_len, never sent
+    uint32_t oversized;
+};
+
+// Longest payload a stream can be opened for, see ETH_TX_RAW_SIZE with zero-copy
+// TX. On a VLAN netif the tag takes UDP_STREAM_VLAN_MAX_LEN down 4 bytes.
+#define UDP_STREAM_MAX_LEN (ETH_TX_CLAIM_MAX > UDP_STREAM_HEADER_LEN ? ETH_TX_CLAIM_MAX - UDP_STREAM_HEADER_LEN : 0)
+#define UDP_STREAM_VLAN_MAX_LEN (UDP_STREAM_MAX_LEN > SIZEOF_VLAN_HDR ? UDP_STREAM_MAX_LEN - SIZEOF_VLAN_HDR : 0)
+
+// Build the headers for datagrams from src_port to dest:dest_port with
+// payloads of up to max_len bytes. Returns ERR_VAL if max_len is more than
+// UDP_STREAM_MAX_LEN (UDP_STREAM_VLAN_MAX_LEN on a VLAN netif), or
+// ERR_INPROGRESS if dest (or the gateway to it) isn't in the ARP cache yet,
+// an ARP request has been sent so try again later.
+err_t udp_stream_open(struct udp_stream *stream, struct netif *netif, const ip4_addr_t *dest, uint16_t src_port, uint16_t dest_port, uint16_t max_len);
+// Get somewhere to write a payload of up to len bytes, NULL if it's longer
+// than the stream was opened for or the TX ring is full. Nothing else may be
+// sent until udp_stream_commit() is called.
+void *udp_stream_claim(struct udp_stream *stream, uint16_t len);
+// Send the claimed datagram with a payload of len bytes
+void udp_stream_commit(struct udp_stream *stream, uint16_t len);
+// Copy payload into a datagram and send it, ERR_VAL if it's longer than the
+// stream was opened for or ERR_MEM if the TX ring is full
+err_t udp_stream_send(struct udp_stream *stream, const void *payload, uint16_t len);
+
+#endif